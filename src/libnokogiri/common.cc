@@ -10,21 +10,35 @@
 namespace libnokogiri::internal {
 	[[nodiscard]]
 	capture_compression_t detect_captrue_compression(fd_t& file) {
-		constexpr static std::array<uint8_t, 2> gzip_header{0x1FU, 0x8BU};
-		std::array<uint8_t, 2> read_bytes{};
-		const auto res{file.read<2>(read_bytes)};
+		std::array<uint8_t, 4> read_bytes{};
+		const auto res{file.read(read_bytes.data(), read_bytes.size(), nullptr)};
 		[[maybe_unused]]
 		const auto _ = file.head();
 
-		if (!res) {
+		if (res < 2) {
 			return capture_compression_t::Unknown;
 		}
 
-		const auto is_gzip = std::equal(
-			gzip_header.begin(), gzip_header.end(),
-			read_bytes.begin(), read_bytes.end()
-		);
+		return detect_captrue_compression(read_bytes.data(), std::size_t(res));
+	}
 
-		return is_gzip ? capture_compression_t::Compressed : capture_compression_t::Uncompressed;
+	[[nodiscard]]
+	capture_compression_t detect_captrue_compression(const std::uint8_t *const data, const std::size_t len) noexcept {
+		constexpr static std::array<uint8_t, 2> gzip_header{0x1FU, 0x8BU};
+		constexpr static std::array<uint8_t, 4> zstd_header{0x28U, 0xB5U, 0x2FU, 0xFDU};
+		constexpr static std::array<uint8_t, 4> lz4_header{0x04U, 0x22U, 0x4DU, 0x18U};
+
+		const auto starts_with = [&](const auto& header) {
+			return len >= header.size() && std::equal(header.begin(), header.end(), data);
+		};
+
+		if (starts_with(gzip_header)) {
+			return capture_compression_t::Compressed;
+		} else if (starts_with(zstd_header)) {
+			return capture_compression_t::ZStandard;
+		} else if (starts_with(lz4_header)) {
+			return capture_compression_t::LZ4;
+		}
+		return capture_compression_t::Uncompressed;
 	}
 }
@@ -324,24 +324,41 @@ namespace libnokogiri {
 		\brief Type of compression the capture file is under
 
 		This dictates how capture files are read and written, with or without compression.
+
+		Zstandard and LZ4 are only supported if libnokogiri was built with them,
+		otherwise they are still detected but the capture is not valid.
 	*/
 	enum struct capture_compression_t : std::uint8_t {
 		Uncompressed = 0x00U, /*!< Indicates that the capture is uncompressed */
-		Compressed   = 0x01U, /*!< Indicates that the capture is compressed */
+		Compressed   = 0x01U, /*!< Indicates that the capture is gzip compressed */
 		Autodetect   = 0x02U, /*!< When opening a file auto detect the file compression, when writing it defaults to Uncompressed */
+		ZStandard    = 0x03U, /*!< Indicates that the capture is made of one or more Zstandard frames */
+		LZ4          = 0x04U, /*!< Indicates that the capture is made of one or more LZ4 frames */
 		Unknown      = 0xFFU, /*!< Unknown compression or invalid file */
 	};
 
-	const std::array<const enum_pair_t<capture_compression_t>, 4> capture_compression_s{{
+	const std::array<const enum_pair_t<capture_compression_t>, 6> capture_compression_s{{
 		{ capture_compression_t::Uncompressed, "Uncompressed"sv },
 		{ capture_compression_t::Compressed,   "Compressed"sv   },
 		{ capture_compression_t::Autodetect,   "Autodetect"sv   },
+		{ capture_compression_t::ZStandard,    "ZStandard"sv    },
+		{ capture_compression_t::LZ4,          "LZ4"sv          },
 		{ capture_compression_t::Unknown,      "Unknown"sv      },
 	}};
 
+	/*! Check if `compression` is one of the actual compression formats */
+	[[nodiscard]]
+	constexpr bool is_compressed(const capture_compression_t compression) noexcept {
+		return compression == capture_compression_t::Compressed || compression == capture_compression_t::ZStandard ||
+			compression == capture_compression_t::LZ4;
+	}
+
 	namespace internal {
 		[[nodiscard]]
 		LIBNOKOGIRI_API capture_compression_t detect_captrue_compression(fd_t& file);
+		/*! Detect the compression from the first few bytes of a capture */
+		[[nodiscard]]
+		LIBNOKOGIRI_API capture_compression_t detect_captrue_compression(const std::uint8_t *const data, const std::size_t len) noexcept;
 	}
 
 	/*! \struct libnokogiri::version_t
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/cache.hh - Size bounded least recently used cache */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_CACHE_HH)
+#define LIBNOKOGIRI_INTERNAL_CACHE_HH
+
+#include <libnokogiri/internal/defs.hh>
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace libnokogiri::internal {
+	/*! \struct libnokogiri::internal::lru_cache_t
+		\brief A cache that evicts the least recently used entries once it goes over a byte budget
+
+		Every entry is inserted with a cost in bytes, and whenever the total cost of
+		the cache goes over the budget the least recently used entries are dropped
+		until it fits again. The most recently inserted entry is never evicted, even
+		if it alone is larger than the budget, so a reference to it stays valid at
+		least until the next insertion.
+
+		Anything that can evict entries can be given a callable that's called as
+		`evicted(key, value)` on each entry before it's dropped, this can move the
+		value out to keep it elsewhere, or return false to leave the entry in the
+		cache and stop evicting.
+	*/
+	template<typename K, typename V>
+	struct lru_cache_t final {
+	private:
+		struct entry_t final {
+			K key;
+			V value;
+			std::size_t cost;
+
+			entry_t(const K& entry_key, V&& entry_value, const std::size_t entry_cost) :
+				key{entry_key}, value{std::move(entry_value)}, cost{entry_cost} { /* NOP */ }
+		};
+
+		/* Ordered from most to least recently used */
+		std::list<entry_t> _entries{};
+		std::unordered_map<K, typename std::list<entry_t>::iterator> _lookup{};
+		std::size_t _used{0U};
+		std::size_t _budget;
+
+		/* Drop least recently used entries while there are more than `keep` and `over` says to */
+		template<typename over_t, typename evicted_t>
+		void evict(const std::size_t keep, over_t&& over, evicted_t&& evicted) noexcept {
+			while (_entries.size() > keep && over()) {
+				auto& entry = _entries.back();
+				if (!evicted(static_cast<const K&>(entry.key), entry.value)) {
+					return;
+				}
+				_used -= entry.cost;
+				_lookup.erase(entry.key);
+				_entries.pop_back();
+			}
+		}
+
+		template<typename evicted_t>
+		void evict(evicted_t&& evicted) noexcept {
+			evict(1U, [this]() { return _used > _budget; }, evicted);
+		}
+
+		[[nodiscard]]
+		static bool drop(const K&, V&) noexcept { return true; }
+	public:
+		lru_cache_t(const std::size_t budget) noexcept : _budget{budget} { /* NOP */ }
+
+		lru_cache_t(const lru_cache_t&) = delete;
+		lru_cache_t& operator=(const lru_cache_t&) = delete;
+
+		lru_cache_t(lru_cache_t&&) = default;
+		lru_cache_t& operator=(lru_cache_t&&) = default;
+
+		/*! Retrieve the number of entries in the cache */
+		[[nodiscard]]
+		std::size_t size() const noexcept { return _entries.size(); }
+
+		/*! Retrieve the total cost of everything in the cache */
+		[[nodiscard]]
+		std::size_t used() const noexcept { return _used; }
+
+		/*! Retrieve the byte budget of the cache */
+		[[nodiscard]]
+		std::size_t budget() const noexcept { return _budget; }
+		/*! Set the byte budget of the cache, evicting entries if it is now over budget */
+		void budget(const std::size_t budget) noexcept { this->budget(budget, drop); }
+		template<typename evicted_t>
+		void budget(const std::size_t budget, evicted_t&& evicted) noexcept {
+			_budget = budget;
+			evict(evicted);
+		}
+
+		/*! \brief Look up an entry, marking it as the most recently used
+
+			\returns A pointer to the cached value, or nullptr if it is not in the cache
+		*/
+		[[nodiscard]]
+		V *find(const K& key) noexcept {
+			const auto entry = _lookup.find(key);
+			if (entry == _lookup.end()) {
+				return nullptr;
+			}
+
+			_entries.splice(_entries.begin(), _entries, entry->second);
+			return &entry->second->value;
+		}
+
+		/*! \brief Look up an entry without changing how recently it was used
+
+			\returns A pointer to the cached value, or nullptr if it is not in the cache
+		*/
+		[[nodiscard]]
+		const V *peek(const K& key) const noexcept {
+			const auto entry = _lookup.find(key);
+			return (entry == _lookup.end()) ? nullptr : &entry->second->value;
+		}
+
+		/*! Retrieve the keys of everything in the cache, in no particular order */
+		[[nodiscard]]
+		std::vector<K> keys() const {
+			std::vector<K> keys{};
+			keys.reserve(_entries.size());
+			for (const auto& entry : _entries) {
+				keys.push_back(entry.key);
+			}
+			return keys;
+		}
+
+		/*! \brief Insert or replace an entry as the most recently used
+
+			If this runs out of memory it throws std::bad_alloc and leaves both
+			the cache and `value` as they were.
+
+			\param key The key to cache the value under
+			\param value The value to cache
+			\param cost How many bytes the value is accounted as
+			\returns A reference to the cached value
+		*/
+		V& insert(const K& key, V&& value, const std::size_t cost) { return insert(key, std::move(value), cost, drop); }
+		template<typename evicted_t>
+		V& insert(const K& key, V&& value, const std::size_t cost, evicted_t&& evicted) {
+			/* The node is allocated before `value` is moved into it */
+			_entries.emplace_front(key, std::move(value), cost);
+			try {
+				const auto [entry, inserted] = _lookup.try_emplace(key, _entries.begin());
+				if (!inserted) {
+					_used -= entry->second->cost;
+					_entries.erase(entry->second);
+					entry->second = _entries.begin();
+				}
+			} catch (...) {
+				value = std::move(_entries.front().value);
+				_entries.pop_front();
+				throw;
+			}
+			_used += cost;
+			evict(evicted);
+
+			return _entries.front().value;
+		}
+
+		/*! Drop an entry from the cache if it is in it */
+		void erase(const K& key) noexcept {
+			const auto entry = _lookup.find(key);
+			if (entry == _lookup.end()) {
+				return;
+			}
+
+			_used -= entry->second->cost;
+			_entries.erase(entry->second);
+			_lookup.erase(entry);
+		}
+
+		/*! Drop everything in the cache */
+		void clear() noexcept {
+			_lookup.clear();
+			_entries.clear();
+			_used = 0U;
+		}
+		/*! Drop everything in the cache, least recently used first, unless `evicted` keeps something */
+		template<typename evicted_t>
+		void clear(evicted_t&& evicted) noexcept {
+			evict(0U, []() { return true; }, evicted);
+		}
+	};
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_CACHE_HH */
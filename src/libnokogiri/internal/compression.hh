@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/compression.hh - One interface over all of the supported compression formats */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_COMPRESSION_HH)
+#define LIBNOKOGIRI_INTERNAL_COMPRESSION_HH
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+#include <libnokogiri/internal/lz4.hh>
+#include <libnokogiri/internal/zlib.hh>
+#include <libnokogiri/internal/zstd.hh>
+
+namespace libnokogiri::internal {
+	/*! \struct libnokogiri::internal::decompressor_t
+		\brief Streaming decompression for any of the formats in libnokogiri::capture_compression_t
+
+		This picks the right decompressor for the capture and forwards to it, they
+		all work the same way as inflate_t.
+	*/
+	struct decompressor_t final {
+	private:
+		std::variant<std::monostate, inflate_t, zstd_decompress_t, lz4_decompress_t> _codec{};
+	public:
+		decompressor_t(const capture_compression_t compression) noexcept {
+			switch (compression) {
+				case capture_compression_t::Compressed:
+					_codec.emplace<inflate_t>();
+					break;
+				case capture_compression_t::ZStandard:
+					_codec.emplace<zstd_decompress_t>();
+					break;
+				case capture_compression_t::LZ4:
+					_codec.emplace<lz4_decompress_t>();
+					break;
+				default:
+					break;
+			}
+		}
+
+		decompressor_t(const decompressor_t&) = delete;
+		decompressor_t& operator=(const decompressor_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept {
+			return std::visit([](const auto& codec) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(codec)>, std::monostate>) {
+					return false;
+				} else {
+					return codec.valid();
+				}
+			}, _codec);
+		}
+
+		/*! Check if the stream stopped at the end of a member or frame, rather than part way through one */
+		[[nodiscard]]
+		bool finished() const noexcept {
+			return std::visit([](const auto& codec) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(codec)>, std::monostate>) {
+					return false;
+				} else {
+					return codec.finished();
+				}
+			}, _codec);
+		}
+
+		/*! \brief Decompress as much of the input as will fit in the output
+
+			Both the input and output are advanced past what was consumed and produced.
+
+			\returns false on a corrupt stream, true otherwise
+		*/
+		[[nodiscard]]
+		bool decompress(const std::uint8_t *&in, std::size_t& in_len, std::uint8_t *&out, std::size_t& out_len) noexcept {
+			return std::visit([&](auto& codec) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(codec)>, std::monostate>) {
+					return false;
+				} else {
+					return codec.decompress(in, in_len, out, out_len);
+				}
+			}, _codec);
+		}
+	};
+
+	/*! \struct libnokogiri::internal::compressor_t
+		\brief Streaming compression into any of the formats in libnokogiri::capture_compression_t
+	*/
+	struct compressor_t final {
+	private:
+		std::variant<std::monostate, deflate_t, zstd_compress_t, lz4_compress_t> _codec{};
+	public:
+		/*! \brief Set up compression for a capture
+
+			\param compression The format to compress into
+			\param level The compression level, if not given the default for the format is used
+		*/
+		compressor_t(const capture_compression_t compression, const std::optional<std::int32_t> level = std::nullopt) noexcept {
+			switch (compression) {
+				case capture_compression_t::Compressed:
+					_codec.emplace<deflate_t>(level.value_or(Z_DEFAULT_COMPRESSION));
+					break;
+				case capture_compression_t::ZStandard:
+					_codec.emplace<zstd_compress_t>(level.value_or(zstd_default_level));
+					break;
+				case capture_compression_t::LZ4:
+					_codec.emplace<lz4_compress_t>(level.value_or(lz4_default_level));
+					break;
+				default:
+					break;
+			}
+		}
+
+		compressor_t(const compressor_t&) = delete;
+		compressor_t& operator=(const compressor_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept {
+			return std::visit([](const auto& codec) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(codec)>, std::monostate>) {
+					return false;
+				} else {
+					return codec.valid();
+				}
+			}, _codec);
+		}
+
+		/*! Compress `len` bytes from `in`, appending whatever comes out to `out` */
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const in, const std::size_t len, std::vector<std::uint8_t>& out) noexcept {
+			return std::visit([&](auto& codec) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(codec)>, std::monostate>) {
+					return false;
+				} else {
+					return codec.compress(in, len, out);
+				}
+			}, _codec);
+		}
+
+		/*! Finish the current member or frame, appending the rest of it to `out` */
+		[[nodiscard]]
+		bool finish(std::vector<std::uint8_t>& out) noexcept {
+			return std::visit([&](auto& codec) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(codec)>, std::monostate>) {
+					return false;
+				} else {
+					return codec.finish(out);
+				}
+			}, _codec);
+		}
+	};
+
+	/*! \brief Decompress all of `file` from where it is into `out`
+
+		\returns The number of bytes written to `out`, or -1 on error, including the data ending part way through a frame
+	*/
+	[[nodiscard]]
+	inline off_t decompress_to(const fd_t& file, const fd_t& out, const capture_compression_t compression) noexcept {
+		constexpr std::size_t chunk_size{1_MiB};
+		decompressor_t codec{compression};
+		std::unique_ptr<std::uint8_t[]> input{new (std::nothrow) std::uint8_t[chunk_size]};
+		std::unique_ptr<std::uint8_t[]> output{new (std::nothrow) std::uint8_t[chunk_size]};
+		if (!codec.valid() || !input || !output) {
+			return -1;
+		}
+
+		off_t decompressed{};
+		while (true) {
+			const auto res = file.read(input.get(), chunk_size, nullptr);
+			if (res < 0) {
+				return -1;
+			} else if (res == 0) {
+				break;
+			}
+
+			const std::uint8_t *in{input.get()};
+			std::size_t in_len{std::size_t(res)};
+			/* Keep going until all of this chunk of input is used and nothing more comes out */
+			while (true) {
+				std::uint8_t *out_ptr{output.get()};
+				std::size_t out_len{chunk_size};
+				if (!codec.decompress(in, in_len, out_ptr, out_len)) {
+					return -1;
+				}
+
+				const auto produced = chunk_size - out_len;
+				if (produced != 0U && !out.write(output.get(), produced)) {
+					return -1;
+				}
+				decompressed += off_t(produced);
+
+				if (in_len == 0U && produced != chunk_size) {
+					break;
+				}
+			}
+		}
+
+		return codec.finished() ? decompressed : -1;
+	}
+
+	/*! \brief Compress all of `file` from where it is into `out` as a single member or frame
+
+		\returns The number of bytes written to `out`, or -1 on error
+	*/
+	[[nodiscard]]
+	inline off_t compress_to(const fd_t& file, const fd_t& out, const capture_compression_t compression,
+		const std::optional<std::int32_t> level = std::nullopt) noexcept {
+		constexpr std::size_t chunk_size{1_MiB};
+		compressor_t codec{compression, level};
+		std::unique_ptr<std::uint8_t[]> input{new (std::nothrow) std::uint8_t[chunk_size]};
+		if (!codec.valid() || !input) {
+			return -1;
+		}
+
+		std::vector<std::uint8_t> output{};
+		off_t compressed{};
+		while (true) {
+			const auto res = file.read(input.get(), chunk_size, nullptr);
+			if (res < 0) {
+				return -1;
+			}
+
+			output.clear();
+			if (res == 0 ? !codec.finish(output) : !codec.compress(input.get(), std::size_t(res), output)) {
+				return -1;
+			}
+			if (!output.empty() && !out.write(output.data(), output.size())) {
+				return -1;
+			}
+			compressed += off_t(output.size());
+
+			if (res == 0) {
+				break;
+			}
+		}
+
+		return compressed;
+	}
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_COMPRESSION_HH */
@@ -7,12 +7,21 @@
 #include <libnokogiri/internal/defs.hh>
 #include <libnokogiri/internal/fs.hh>
 
+#include <cerrno>
 #include <cstdint>
 #include <cstddef>
 #ifndef _WINDOWS
 #	include <unistd.h>
+#	include <sys/uio.h>
+#	if defined(__linux__)
+#		include <sys/mman.h>
+#	endif
 #else
 #	include <io.h>
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -53,6 +62,53 @@ namespace libnokogiri::internal {
 		{ return lseek(fd, 0, SEEK_CUR); }
 	inline int32_t fdtruncate(const int32_t fd, const off_t size) noexcept
 		{ return ftruncate(fd, size); }
+	inline ssize_t fdpread(const int32_t fd, void *const bufferPtr, const size_t bufferLen, const off_t offset) noexcept
+		{ return pread(fd, bufferPtr, bufferLen, offset); }
+	inline ssize_t fdpread(const int32_t fd, void *const headPtr, const size_t headLen,
+		void *const bodyPtr, const size_t bodyLen, const off_t offset) noexcept {
+		const std::array<struct iovec, 2> iov{{
+			{ headPtr, headLen },
+			{ bodyPtr, bodyLen }
+		}};
+		return preadv(fd, iov.data(), int(iov.size()), offset);
+	}
+	inline ssize_t fdwrite(const int32_t fd, const void *const headPtr, const size_t headLen,
+		const void *const bodyPtr, const size_t bodyLen) noexcept {
+		/* iovec is shared with readv, so it can't take const pointers */
+		const std::array<struct iovec, 2> iov{{
+			{ const_cast<void *>(headPtr), headLen },
+			{ const_cast<void *>(bodyPtr), bodyLen }
+		}};
+		return writev(fd, iov.data(), int(iov.size()));
+	}
+	/* Copies between two files inside the kernel, from `offset` in `fdIn` to the file position of `fdOut` */
+	inline ssize_t fdcopy(const int32_t fdIn, const off_t offset, const int32_t fdOut, const size_t len) noexcept {
+#if defined(__linux__)
+		off_t inOffset{offset};
+		return copy_file_range(fdIn, &inOffset, fdOut, nullptr, len, 0U);
+#else
+		static_cast<void>(fdIn); static_cast<void>(offset); static_cast<void>(fdOut); static_cast<void>(len);
+		errno = ENOSYS;
+		return -1;
+#endif
+	}
+	inline int32_t fdsync(const int32_t fd) noexcept {
+#if defined(__linux__)
+		return fdatasync(fd);
+#else
+		return fsync(fd);
+#endif
+	}
+	/* Reserves space without changing the file length, so nothing past the end shows up as zeros */
+	inline int32_t fdallocate(const int32_t fd, const off_t offset, const off_t len) noexcept {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+		return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+		static_cast<void>(fd); static_cast<void>(offset); static_cast<void>(len);
+		errno = ENOSYS;
+		return -1;
+#endif
+	}
 
 #else
 #	define O_NOCTTY _O_BINARY
@@ -73,6 +129,44 @@ namespace libnokogiri::internal {
 		{ return _telli64(fd); }
 	inline int32_t fdtruncate(const int32_t fd, const off_t size) noexcept
 		{ return _chsize_s(fd, size); }
+	inline ssize_t fdpread(const int32_t fd, void *const bufferPtr, const size_t bufferLen, const off_t offset) noexcept {
+		OVERLAPPED overlapped{};
+		overlapped.Offset = DWORD(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD result{};
+		if (!ReadFile(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), bufferPtr, DWORD(bufferLen), &result, &overlapped)) {
+			return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+		}
+		return ssize_t(result);
+	}
+	inline ssize_t fdpread(const int32_t fd, void *const headPtr, const size_t headLen,
+		void *const bodyPtr, const size_t bodyLen, const off_t offset) noexcept {
+		const auto head = fdpread(fd, headPtr, headLen, offset);
+		if (head != ssize_t(headLen) || !bodyLen) {
+			return head;
+		}
+		const auto body = fdpread(fd, bodyPtr, bodyLen, offset + off_t(headLen));
+		return (body < 0) ? body : head + body;
+	}
+	inline ssize_t fdwrite(const int32_t fd, const void *const headPtr, const size_t headLen,
+		const void *const bodyPtr, const size_t bodyLen) noexcept {
+		const auto head = fdwrite(fd, headPtr, headLen);
+		if (head != ssize_t(headLen) || !bodyLen) {
+			return head;
+		}
+		const auto body = fdwrite(fd, bodyPtr, bodyLen);
+		return (body < 0) ? body : head + body;
+	}
+	inline ssize_t fdcopy(const int32_t, const off_t, const int32_t, const size_t) noexcept {
+		errno = ENOSYS;
+		return -1;
+	}
+	inline int32_t fdsync(const int32_t fd) noexcept
+		{ return _commit(fd); }
+	inline int32_t fdallocate(const int32_t, const off_t, const off_t) noexcept {
+		errno = ENOSYS;
+		return -1;
+	}
 #endif
 
 	struct fd_t final {
@@ -130,6 +224,20 @@ namespace libnokogiri::internal {
 			return fd_t{filepath, flags | O_CREAT, mode, true};
 		}
 
+		/*! \brief Make an anonymous read/write file that only exists in memory
+
+			On Linux this is a memfd, anywhere else, or if that fails, it falls back to a temporary file.
+		*/
+		static fd_t makemem(const std::string_view& ext = ".tmp"sv) noexcept {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+			fd_t file{::memfd_create("libnokogiri", MFD_CLOEXEC)};
+			if (file.valid()) {
+				return file;
+			}
+#endif
+			return maketemp(O_RDWR, S_IWUSR | S_IRUSR, ext);
+		}
+
 		void operator =(fd_t &&fd_) noexcept { swap(fd_); }
 		[[nodiscard]]
 		operator int32_t() const noexcept { return fd; }
@@ -161,6 +269,36 @@ namespace libnokogiri::internal {
 			return result;
 		}
 
+		/*! Read at the given offset without touching, or depending on, the file position */
+		[[nodiscard]]
+		bool pread(void *const bufferPtr, const size_t bufferLen, const off_t offset) const noexcept {
+			size_t done{};
+			while (done < bufferLen) {
+				const auto result = internal::fdpread(fd, static_cast<uint8_t *>(bufferPtr) + done, bufferLen - done, offset + off_t(done));
+				if (result <= 0) {
+					return false;
+				}
+				done += size_t(result);
+			}
+			return true;
+		}
+
+		/*! Read two consecutive regions at the given offset into two buffers without touching the file position */
+		[[nodiscard]]
+		bool pread(void *const headPtr, const size_t headLen, void *const bodyPtr, const size_t bodyLen, const off_t offset) const noexcept {
+			const auto result = internal::fdpread(fd, headPtr, headLen, bodyPtr, bodyLen, offset);
+			if (result < 0) {
+				return false;
+			}
+			/* Short reads are perfectly legal, pick up where it left off */
+			const auto done = size_t(result);
+			if (done < headLen) {
+				return pread(static_cast<uint8_t *>(headPtr) + done, headLen - done, offset + off_t(done)) &&
+					pread(bodyPtr, bodyLen, offset + off_t(headLen));
+			}
+			return pread(static_cast<uint8_t *>(bodyPtr) + (done - headLen), bodyLen - (done - headLen), offset + off_t(done));
+		}
+
 		[[nodiscard]]
 		off_t seek(const off_t offset, const int32_t whence = SEEK_CUR) const noexcept {
 			const auto result = internal::fdseek(fd, offset, whence);
@@ -171,6 +309,54 @@ namespace libnokogiri::internal {
 		[[nodiscard]]
 		ssize_t write(const void *const bufferPtr, const size_t bufferLen, std::nullptr_t) const noexcept
 			{ return internal::fdwrite(fd, bufferPtr, bufferLen); }
+		/*! Write two buffers back to back, in one call where the platform can */
+		[[nodiscard]]
+		bool write(const void *const headPtr, const size_t headLen, const void *const bodyPtr, const size_t bodyLen) const noexcept {
+			const auto result = internal::fdwrite(fd, headPtr, headLen, bodyPtr, bodyLen);
+			if (result < 0) {
+				return false;
+			}
+			/* Short writes are perfectly legal, pick up where it left off */
+			const auto done = size_t(result);
+			if (done < headLen) {
+				return writeAll(static_cast<const uint8_t *>(headPtr) + done, headLen - done) && writeAll(bodyPtr, bodyLen);
+			}
+			return writeAll(static_cast<const uint8_t *>(bodyPtr) + (done - headLen), bodyLen - (done - headLen));
+		}
+
+		/*! Write all of the buffer, however many calls it takes */
+		[[nodiscard]]
+		bool writeAll(const void *const bufferPtr, const size_t bufferLen) const noexcept {
+			size_t done{};
+			while (done < bufferLen) {
+				/* Cap each write, some platforms can't do more than this in one go */
+				const auto result = write(static_cast<const uint8_t *>(bufferPtr) + done, std::min<size_t>(bufferLen - done, 1U << 30U), nullptr);
+				if (result <= 0) {
+					return false;
+				}
+				done += size_t(result);
+			}
+			return true;
+		}
+
+		/*! \brief Copy part of another file to the file position without it passing through userspace
+
+			\returns How much was copied, which can be short, or -1 if the kernel can't do it for these two files
+		*/
+		[[nodiscard]]
+		ssize_t copy(const fd_t& from, const off_t offset, const size_t len, std::nullptr_t) const noexcept
+			{ return internal::fdcopy(from.fd, offset, fd, len); }
+		/*! Flush the file data out to the disk */
+		[[nodiscard]]
+		bool sync() const noexcept { return internal::fdsync(fd) == 0; }
+
+		/*! \brief Reserve space for the file to grow into without changing its length
+
+			This is only ever an optimisation, where it isn't supported it fails
+			and the file just grows as it's written.
+		*/
+		[[nodiscard]]
+		bool allocate(const off_t offset, const off_t len) const noexcept { return internal::fdallocate(fd, offset, len) == 0; }
 		[[nodiscard]]
 		off_t tell() const noexcept { return internal::fdtell(fd); }
 
@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/gunzip.hh - Multi-threaded decompression of multi-member gzip files */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_GUNZIP_HH)
+#define LIBNOKOGIRI_INTERNAL_GUNZIP_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <new>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+#include <libnokogiri/internal/mmap.hh>
+
+extern "C" {
+	#include <zlib.h>
+	#include <zconf.h>
+}
+
+namespace libnokogiri::internal {
+	/*! The smallest amount of compressed data that is worth handing to a thread of its own */
+	constexpr std::size_t gunzip_min_slice{4_MiB};
+
+	/*! \struct libnokogiri::internal::gunzip_slice_t
+		\brief The decompressed contents of a run of whole gzip members
+	*/
+	struct gunzip_slice_t final {
+		/*! The offset of the first member in the compressed data */
+		std::uint64_t start{0U};
+		/*! The offset just past the last member in the compressed data */
+		std::uint64_t stop{0U};
+		/*! If the slice ran into the end of the gzip data rather than its limit */
+		bool last{false};
+		std::vector<std::uint8_t> data{};
+	};
+
+	/* Inflated data is collected in a buffer that grows to fit */
+	struct gunzip_buffer_out_t final {
+		std::vector<std::uint8_t>& data;
+		std::size_t produced{0U};
+
+		[[nodiscard]]
+		std::uint8_t *next() {
+			if (produced == data.size()) {
+				data.resize(data.size() * 2U);
+			}
+			return data.data() + produced;
+		}
+		[[nodiscard]]
+		std::size_t room() const noexcept { return data.size() - produced; }
+		[[nodiscard]]
+		bool advance(const std::size_t len) noexcept {
+			produced += len;
+			return true;
+		}
+		[[nodiscard]]
+		bool flush() noexcept { return true; }
+	};
+
+	/* Inflated data goes straight out to a file a chunk at a time */
+	struct gunzip_file_out_t final {
+		static constexpr std::size_t chunk_size{1_MiB};
+
+		const fd_t& file;
+		std::unique_ptr<std::uint8_t[]> chunk{new (std::nothrow) std::uint8_t[chunk_size]};
+		std::size_t used{0U};
+		off_t written{0};
+
+		[[nodiscard]]
+		std::uint8_t *next() noexcept { return chunk.get() + used; }
+		[[nodiscard]]
+		std::size_t room() const noexcept { return chunk_size - used; }
+		[[nodiscard]]
+		bool advance(const std::size_t len) noexcept {
+			used += len;
+			return used != chunk_size || flush();
+		}
+		[[nodiscard]]
+		bool flush() noexcept {
+			if (used != 0U && !file.write(chunk.get(), used)) {
+				return false;
+			}
+			written += off_t(used);
+			used = 0U;
+			return true;
+		}
+	};
+
+	/*! \brief Inflate whole gzip members starting at `start` into `out` until one ends at or after `limit`
+
+		\returns Where the last member inflated stopped, and if that was the end of the gzip data, or
+		std::nullopt if `start` is not the start of a valid member or `out` couldn't take the data
+	*/
+	template<typename out_t>
+	[[nodiscard]]
+	std::optional<std::pair<std::uint64_t, bool>> gunzip_inflate(const std::uint8_t *const data, const std::size_t len,
+		const std::uint64_t start, const std::uint64_t limit, out_t& out) noexcept {
+		z_stream stream{};
+		if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+			return std::nullopt;
+		}
+
+		std::uint64_t pos{start};
+		bool last{false};
+		bool ok{true};
+		try {
+			while (true) {
+				stream.next_in = const_cast<Bytef *>(data + pos);
+				stream.avail_in = uInt(std::min<std::uint64_t>(len - pos, UINT32_MAX));
+				stream.next_out = out.next();
+				stream.avail_out = uInt(std::min<std::size_t>(out.room(), UINT32_MAX));
+				const auto avail_in = stream.avail_in;
+				const auto avail_out = stream.avail_out;
+
+				const auto res = ::inflate(&stream, Z_NO_FLUSH);
+				pos += avail_in - stream.avail_in;
+				if (!out.advance(avail_out - stream.avail_out)) {
+					ok = false;
+					break;
+				}
+
+				if (res == Z_STREAM_END) {
+					/* Anything after the last member that isn't another member is ignored, like gzread() does */
+					if (pos + 2U > len || data[pos] != 0x1FU || data[pos + 1U] != 0x8BU) {
+						last = true;
+						break;
+					}
+					if (pos >= limit) {
+						break;
+					}
+					if (inflateReset(&stream) != Z_OK) {
+						ok = false;
+						break;
+					}
+				} else if (res == Z_BUF_ERROR && stream.avail_out != 0U) {
+					/* The data ended in the middle of a member */
+					ok = false;
+					break;
+				} else if (res != Z_OK && res != Z_BUF_ERROR) {
+					ok = false;
+					break;
+				}
+			}
+		} catch (const std::bad_alloc&) {
+			ok = false;
+		}
+		inflateEnd(&stream);
+
+		if (!ok || !out.flush()) {
+			return std::nullopt;
+		}
+		return std::make_pair(pos, last);
+	}
+
+	/*! \brief Inflate whole gzip members starting at `start` until one ends at or after `limit`
+
+		\returns The inflated slice, or std::nullopt if `start` is not the start of a valid member
+	*/
+	[[nodiscard]]
+	inline std::optional<gunzip_slice_t> gunzip_members(const std::uint8_t *const data, const std::size_t len,
+		const std::uint64_t start, const std::uint64_t limit) noexcept {
+		gunzip_slice_t slice{};
+		slice.start = start;
+		try {
+			/* Packet captures tend to compress around 2:1, so this usually saves a few reallocations */
+			slice.data.resize(std::size_t(std::min<std::uint64_t>(limit - start, len - start)) * 2U + 64_KiB);
+		} catch (const std::bad_alloc&) {
+			return std::nullopt;
+		}
+
+		gunzip_buffer_out_t out{slice.data};
+		const auto result = gunzip_inflate(data, len, start, limit, out);
+		if (!result) {
+			return std::nullopt;
+		}
+		slice.stop = result->first;
+		slice.last = result->second;
+		slice.data.resize(out.produced);
+		slice.data.shrink_to_fit();
+		return slice;
+	}
+
+	/*! \brief Find where the first gzip member at or after `from` and before `to` starts
+
+		This only checks the member header looks sane, the data can happen to contain
+		something that looks like one, so it can't be trusted until it's inflated.
+	*/
+	[[nodiscard]]
+	inline std::optional<gunzip_slice_t> gunzip_find_members(const std::uint8_t *const data, const std::size_t len,
+		std::uint64_t from, const std::uint64_t to, const std::uint64_t limit) noexcept {
+		for (; from + 10U <= std::min<std::uint64_t>(to, len); ++from) {
+			/* ID1, ID2, CM = deflate, and none of the reserved flags set */
+			if (data[from] != 0x1FU || data[from + 1U] != 0x8BU || data[from + 2U] != 0x08U || (data[from + 3U] & 0xE0U) != 0U) {
+				continue;
+			}
+
+			auto slice = gunzip_members(data, len, from, limit);
+			if (slice) {
+				return slice;
+			}
+		}
+		return std::nullopt;
+	}
+
+	/*! \brief Decompress a gzip file into `out`, inflating separate members on separate threads
+
+		Each gzip member is a complete deflate stream that doesn't depend on
+		anything before it, so files made of many members, like the ones pigz
+		makes with `--independent` or from concatenating rotated captures, can be
+		split up and inflated in parallel.
+
+		The compressed data is cut into slices and each thread looks for the first
+		member header in its slice, and inflates whole members from there until
+		it crosses into the next slice. The slices are then written out in order,
+		and a slice is only used if it starts exactly where the slice before it
+		stopped, which can only be a real member boundary. Anything else, a bogus
+		header in the deflate data or a member spanning whole slices, is inflated
+		again from where the previous slice stopped.
+
+		The first slice, and anything that's inflated again, is inflated on this
+		thread straight into `out` a chunk at a time rather than into a slice,
+		so a single member file, the usual case, costs no more memory or time
+		than doing it on one thread.
+
+		At most `threads` slices are held in memory at once.
+
+		\param file The gzip file
+		\param out Where to write the decompressed data
+		\param threads How many threads to use, 0 to use one per core
+		\returns The number of bytes written to `out`, or -1 on error
+	*/
+	[[nodiscard]]
+	inline off_t gunzip_parallel(const fd_t& file, const fd_t& out, std::size_t threads = 0U) noexcept {
+		const mmap_t map{file};
+		if (!map.valid()) {
+			return -1;
+		}
+		const auto data = map.data();
+		const auto len = map.length();
+
+		if (threads == 0U) {
+			threads = std::max(std::thread::hardware_concurrency(), 1U);
+		}
+		/* A few slices per thread so one slow slice doesn't hold everything else up */
+		const auto slice_len = std::max<std::size_t>(gunzip_min_slice, len / (threads * 4U) + 1U);
+		const auto slices = (len + slice_len - 1U) / slice_len;
+
+		const auto decode = [=](const std::size_t slice) {
+			const auto from = std::uint64_t(slice * slice_len);
+			const auto to = std::min<std::uint64_t>(from + slice_len, len);
+			return gunzip_find_members(data, len, from, to, to);
+		};
+
+		std::deque<std::future<std::optional<gunzip_slice_t>>> pending{};
+		/* The first slice is always inflated here */
+		std::size_t next{1U};
+		const auto launch = [&]() {
+			while (next < slices && pending.size() < threads) {
+				try {
+					pending.emplace_back(std::async(std::launch::async, decode, next));
+				} catch (const std::system_error&) {
+					/* Out of threads, do it when we get to it instead */
+					pending.emplace_back(std::async(std::launch::deferred, decode, next));
+				}
+				++next;
+			}
+		};
+
+		std::uint64_t pos{};
+		off_t written{};
+		for (std::size_t slice{}; slice < slices; ++slice) {
+			launch();
+			std::optional<gunzip_slice_t> result{};
+			if (slice != 0U) {
+				result = pending.front().get();
+				pending.pop_front();
+			}
+
+			const auto limit = std::min<std::uint64_t>(std::uint64_t(slice + 1U) * slice_len, len);
+			/* The previous slice already ran past all of this one */
+			if (pos >= limit) {
+				continue;
+			}
+
+			bool last{};
+			if (result && result->start == pos) {
+				if (!out.write(result->data.data(), result->data.size())) {
+					break;
+				}
+				written += off_t(result->data.size());
+				pos = result->stop;
+				last = result->last;
+			} else {
+				gunzip_file_out_t direct{out};
+				const auto inflated = (direct.chunk) ? gunzip_inflate(data, len, pos, limit, direct) : std::nullopt;
+				if (!inflated) {
+					break;
+				}
+				written += direct.written;
+				pos = inflated->first;
+				last = inflated->second;
+			}
+
+			if (last) {
+				/* Let any threads still running finish before the mapping goes away */
+				pending.clear();
+				return written;
+			}
+		}
+
+		pending.clear();
+		return -1;
+	}
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_GUNZIP_HH */
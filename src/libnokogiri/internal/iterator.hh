@@ -1,55 +1,130 @@
 // SPDX-License-Identifier: LGPL-3.0-or-later
-/* internal/iterator.hh - A bi-directional templated iterator  */
+/* internal/iterator.hh - A random access templated iterator  */
 #pragma once
 #if !defined(LIBNOKOGIRI_INTERNAL_ITERATOR_HH)
 #define LIBNOKOGIRI_INTERNAL_ITERATOR_HH
 
 #include <libnokogiri/internal/defs.hh>
 
-#include <functional>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
 
 
 namespace libnokogiri::internal {
-	template<typename T, typename U, typename I>
-	struct bi_iterator final {
+	/*! \struct libnokogiri::internal::index_iterator
+		\brief A random access iterator over anything that is addressed by index
+
+		The iterator holds a pointer to the container and a position in it, and
+		dereferencing it calls `accessor` on the container with the index at that
+		position. The accessor is part of the type, so the call is direct and can
+		be inlined.
+
+		Without `locate` the position is the index, otherwise `locate` is called
+		to turn the position into the index to pass to `accessor`, which lets the
+		iterator walk a subset of the indices while the arithmetic operators all
+		still work on positions, so it stays a random access iterator.
+
+		Dereferencing yields whatever `accessor` returns by value, so `reference`
+		is not an actual reference, but that's enough for the standard algorithms.
+
+		\tparam C The container type, make this const for a const iterator
+		\tparam T The type `accessor` returns
+		\tparam accessor A pointer to the member function of `C` that takes an index and returns a `T`
+		\tparam locate Optionally a pointer to the const member function of `C` that takes a position and returns its index
+	*/
+	template<typename C, typename T, auto accessor, auto locate = nullptr>
+	struct index_iterator final {
 	public:
-		using acc_func_t = std::function<T(U&)>;
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = T;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = T;
 	private:
-		acc_func_t _accessor;
-		const I _begin;
-		const I _end;
-		I _current;
-	public:
-		constexpr bi_iterator(acc_func_t acc, const I begin, const I end, const bool forward = true) noexcept :
-			_accessor{acc}, _begin{begin}, _end{end}, _current{(forward) ? begin : end} { /* NOP */ }
+		C *_container;
+		std::size_t _position;
 
 		[[nodiscard]]
-		bi_iterator& operator++() noexcept {
-			if (_current != _end) {
-				_current++;
+		constexpr std::size_t index_at(const std::size_t position) const noexcept {
+			if constexpr (std::is_same_v<decltype(locate), std::nullptr_t>) {
+				return position;
+			} else {
+				return (_container->*locate)(position);
 			}
-
-			return *this;
 		}
+	public:
+		constexpr index_iterator() noexcept :
+			_container{nullptr}, _position{0U} { /* NOP */ }
+
+		constexpr index_iterator(C *const container, const std::size_t position) noexcept :
+			_container{container}, _position{position} { /* NOP */ }
 
+		/*! Retrieve the position of the iterator */
 		[[nodiscard]]
-		bi_iterator& operator--() noexcept {
-			if (_current != _begin) {
-				_current--;
-			}
+		constexpr std::size_t position() const noexcept { return _position; }
+		/*! Retrieve the index in the container the iterator is at */
+		[[nodiscard]]
+		constexpr std::size_t index() const noexcept { return index_at(_position); }
 
-			return *this;
+		[[nodiscard]]
+		T operator*() const noexcept { return (_container->*accessor)(index_at(_position)); }
+		[[nodiscard]]
+		T operator[](const difference_type n) const noexcept {
+			return (_container->*accessor)(index_at(_position + std::size_t(n)));
 		}
 
+		constexpr index_iterator& operator++() noexcept { ++_position; return *this; }
+		constexpr index_iterator operator++(int) noexcept { auto it{*this}; ++_position; return it; }
+		constexpr index_iterator& operator--() noexcept { --_position; return *this; }
+		constexpr index_iterator operator--(int) noexcept { auto it{*this}; --_position; return it; }
+
+		constexpr index_iterator& operator+=(const difference_type n) noexcept { _position += std::size_t(n); return *this; }
+		constexpr index_iterator& operator-=(const difference_type n) noexcept { _position -= std::size_t(n); return *this; }
+
+		[[nodiscard]]
+		constexpr index_iterator operator+(const difference_type n) const noexcept { return {_container, _position + std::size_t(n)}; }
 		[[nodiscard]]
-		T operator*() noexcept { return _accessor(*_current); }
+		friend constexpr index_iterator operator+(const difference_type n, const index_iterator& it) noexcept { return it + n; }
 		[[nodiscard]]
-		T operator->() noexcept { return operator*(); }
+		constexpr index_iterator operator-(const difference_type n) const noexcept { return {_container, _position - std::size_t(n)}; }
+		[[nodiscard]]
+		constexpr difference_type operator-(const index_iterator& it) const noexcept {
+			return difference_type(_position) - difference_type(it._position);
+		}
+
+		[[nodiscard]]
+		constexpr bool operator==(const index_iterator& it) const noexcept { return _position == it._position; }
+		[[nodiscard]]
+		constexpr bool operator!=(const index_iterator& it) const noexcept { return _position != it._position; }
+		[[nodiscard]]
+		constexpr bool operator<(const index_iterator& it) const noexcept { return _position < it._position; }
+		[[nodiscard]]
+		constexpr bool operator>(const index_iterator& it) const noexcept { return _position > it._position; }
+		[[nodiscard]]
+		constexpr bool operator<=(const index_iterator& it) const noexcept { return _position <= it._position; }
+		[[nodiscard]]
+		constexpr bool operator>=(const index_iterator& it) const noexcept { return _position >= it._position; }
+	};
+
+	/*! \struct libnokogiri::internal::index_range
+		\brief A pair of iterators that can be used in a range-based for loop
+
+		\tparam iterator_t The iterator type, normally an libnokogiri::internal::index_iterator
+	*/
+	template<typename iterator_t>
+	struct index_range final {
+	private:
+		iterator_t _begin;
+		iterator_t _end;
+	public:
+		constexpr index_range(const iterator_t begin, const iterator_t end) noexcept :
+			_begin{begin}, _end{end} { /* NOP */ }
 
 		[[nodiscard]]
-		bool operator==(bi_iterator& a) const noexcept { return _current == a._current; }
+		constexpr iterator_t begin() const noexcept { return _begin; }
 		[[nodiscard]]
-		bool operator!=(bi_iterator& a) const noexcept { return !operator==(a); }
+		constexpr iterator_t end() const noexcept { return _end; }
 	};
 }
 
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/lz4.hh - libnokogiri LZ4 frame wrapper */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_LZ4_HH)
+#define LIBNOKOGIRI_INTERNAL_LZ4_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+
+#if defined(LIBNOKOGIRI_LZ4)
+extern "C" {
+	#include <lz4frame.h>
+}
+#endif
+
+namespace libnokogiri::internal {
+	/*! The compression level used when none is given, 0 is the fast mode */
+	constexpr std::int32_t lz4_default_level{0};
+
+#if defined(LIBNOKOGIRI_LZ4)
+	/*! \struct libnokogiri::internal::lz4_decompress_t
+		\brief Streaming LZ4 frame decompression over caller provided buffers
+
+		This works the same way as inflate_t. Concatenated frames are decoded as one
+		stream and skippable frames are skipped.
+	*/
+	struct lz4_decompress_t final {
+	private:
+		std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)> _ctx;
+		std::size_t _error{0U};
+		bool _finished{true};
+	public:
+		lz4_decompress_t() noexcept : _ctx{nullptr, LZ4F_freeDecompressionContext} {
+			LZ4F_dctx *ctx{nullptr};
+			_error = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+			_ctx.reset(ctx);
+		}
+
+		lz4_decompress_t(lz4_decompress_t&&) = default;
+		lz4_decompress_t& operator=(lz4_decompress_t&&) = default;
+
+		lz4_decompress_t(const lz4_decompress_t&) = delete;
+		lz4_decompress_t& operator=(const lz4_decompress_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _ctx != nullptr && !LZ4F_isError(_error); }
+
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return LZ4F_getErrorName(_error); }
+
+		/*! Check if the stream stopped at the end of a frame, rather than part way through one */
+		[[nodiscard]]
+		bool finished() const noexcept { return _finished; }
+
+		/*! \brief Decompress as much of the input as will fit in the output
+
+			Both the input and output are advanced past what was consumed and produced.
+
+			\returns false on a corrupt stream, true otherwise
+		*/
+		[[nodiscard]]
+		bool decompress(const std::uint8_t *&in, std::size_t& in_len, std::uint8_t *&out, std::size_t& out_len) noexcept {
+			if (!valid()) {
+				return false;
+			}
+
+			while (out_len != 0U) {
+				std::size_t consumed{in_len};
+				std::size_t produced{out_len};
+
+				/* Once a frame is done the context is ready for the next one, so concatenated frames just work */
+				_error = LZ4F_decompress(_ctx.get(), out, &produced, in, &consumed, nullptr);
+				if (LZ4F_isError(_error)) {
+					return false;
+				}
+
+				in += consumed;
+				in_len -= consumed;
+				out += produced;
+				out_len -= produced;
+
+				if (consumed == 0U && produced == 0U) {
+					break;
+				}
+				/* 0 means a frame was just finished and everything from it has been flushed */
+				_finished = _error == 0U;
+			}
+
+			return true;
+		}
+	};
+
+	/*! \struct libnokogiri::internal::lz4_compress_t
+		\brief Streaming LZ4 frame compression, the counterpart to lz4_decompress_t
+	*/
+	struct lz4_compress_t final {
+	private:
+		std::unique_ptr<LZ4F_cctx, decltype(&LZ4F_freeCompressionContext)> _ctx;
+		LZ4F_preferences_t _prefs;
+		std::size_t _error{0U};
+		/* If the frame header has been written for the current frame */
+		bool _started{false};
+
+		[[nodiscard]]
+		bool begin(std::vector<std::uint8_t>& out) noexcept {
+			if (_started) {
+				return true;
+			}
+
+			const auto used = out.size();
+			out.resize(used + LZ4F_HEADER_SIZE_MAX);
+			_error = LZ4F_compressBegin(_ctx.get(), out.data() + used, LZ4F_HEADER_SIZE_MAX, &_prefs);
+			if (LZ4F_isError(_error)) {
+				return false;
+			}
+			out.resize(used + _error);
+			_started = true;
+			return true;
+		}
+	public:
+		/*! \brief Set up a new compression stream
+
+			\param level The LZ4 compression level, anything above 2 uses LZ4 HC
+		*/
+		lz4_compress_t(const std::int32_t level = lz4_default_level) noexcept :
+			_ctx{nullptr, LZ4F_freeCompressionContext}, _prefs{} {
+			LZ4F_cctx *ctx{nullptr};
+			_error = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+			_ctx.reset(ctx);
+
+			_prefs.compressionLevel = level;
+			_prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+			_prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+		}
+
+		lz4_compress_t(lz4_compress_t&&) = default;
+		lz4_compress_t& operator=(lz4_compress_t&&) = default;
+
+		lz4_compress_t(const lz4_compress_t&) = delete;
+		lz4_compress_t& operator=(const lz4_compress_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _ctx != nullptr && !LZ4F_isError(_error); }
+
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return LZ4F_getErrorName(_error); }
+
+		/*! Compress `len` bytes from `in`, appending whatever comes out to `out` */
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const in, const std::size_t len, std::vector<std::uint8_t>& out) noexcept {
+			if (!valid() || !begin(out)) {
+				return false;
+			}
+
+			/* Keep each update small enough that the bound doesn't get silly */
+			constexpr std::size_t chunk_size{1_MiB};
+			for (std::size_t done{}; done < len;) {
+				const auto chunk = std::min(len - done, chunk_size);
+				const auto used = out.size();
+				out.resize(used + LZ4F_compressBound(chunk, &_prefs));
+				_error = LZ4F_compressUpdate(_ctx.get(), out.data() + used, out.size() - used, in + done, chunk, nullptr);
+				if (LZ4F_isError(_error)) {
+					return false;
+				}
+				out.resize(used + _error);
+				done += chunk;
+			}
+
+			return true;
+		}
+
+		/*! Finish the current frame, appending the rest of it to `out`, anything compressed after this starts a new frame */
+		[[nodiscard]]
+		bool finish(std::vector<std::uint8_t>& out) noexcept {
+			if (!valid() || !begin(out)) {
+				return false;
+			}
+
+			const auto used = out.size();
+			out.resize(used + LZ4F_compressBound(0U, &_prefs));
+			_error = LZ4F_compressEnd(_ctx.get(), out.data() + used, out.size() - used, nullptr);
+			if (LZ4F_isError(_error)) {
+				return false;
+			}
+			out.resize(used + _error);
+			_started = false;
+			return true;
+		}
+	};
+#else
+	/* Built without LZ4, these are never valid so opening or writing an LZ4 capture just fails */
+	struct lz4_decompress_t final {
+		[[nodiscard]]
+		bool valid() const noexcept { return false; }
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return "LZ4 support is not enabled"; }
+		[[nodiscard]]
+		bool finished() const noexcept { return false; }
+		[[nodiscard]]
+		bool decompress(const std::uint8_t *&, std::size_t&, std::uint8_t *&, std::size_t&) noexcept { return false; }
+	};
+
+	struct lz4_compress_t final {
+		lz4_compress_t(const std::int32_t = lz4_default_level) noexcept { /* NOP */ }
+		[[nodiscard]]
+		bool valid() const noexcept { return false; }
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return "LZ4 support is not enabled"; }
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const, const std::size_t, std::vector<std::uint8_t>&) noexcept { return false; }
+		[[nodiscard]]
+		bool finish(std::vector<std::uint8_t>&) noexcept { return false; }
+	};
+#endif
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_LZ4_HH */
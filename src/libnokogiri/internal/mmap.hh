@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/mmap.hh - Cross platform memory mapped file wrapper */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_MMAP_HH)
+#define LIBNOKOGIRI_INTERNAL_MMAP_HH
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+#ifndef _WINDOWS
+#	include <sys/mman.h>
+#else
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#endif
+
+namespace libnokogiri::internal {
+	/*! \struct libnokogiri::internal::mmap_t
+		\brief A memory mapping of an entire file
+
+		The mapping is read only and its pages are shared with the page cache, so
+		any number of threads can read from it and none of them can change what
+		the others see.
+	*/
+	struct mmap_t final {
+	private:
+		std::uint8_t *_addr{nullptr};
+		std::size_t _len{0U};
+#ifdef _WINDOWS
+		HANDLE _mapping{nullptr};
+#endif
+	public:
+		constexpr mmap_t() noexcept = default;
+
+		mmap_t(const fd_t& file) noexcept {
+			const auto len = file.length();
+			if (len <= 0) {
+				return;
+			}
+#ifndef _WINDOWS
+			void *addr = ::mmap(nullptr, std::size_t(len), PROT_READ, MAP_PRIVATE, file, 0);
+			if (addr == MAP_FAILED) {
+				return;
+			}
+			_addr = static_cast<std::uint8_t *>(addr);
+#else
+			const auto handle = reinterpret_cast<HANDLE>(_get_osfhandle(file));
+			_mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (_mapping == nullptr) {
+				return;
+			}
+			_addr = static_cast<std::uint8_t *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+			if (_addr == nullptr) {
+				CloseHandle(_mapping);
+				_mapping = nullptr;
+				return;
+			}
+#endif
+			_len = std::size_t(len);
+		}
+
+		mmap_t(mmap_t&& map) noexcept : mmap_t{} { swap(map); }
+		void operator=(mmap_t&& map) noexcept { swap(map); }
+
+		mmap_t(const mmap_t&) = delete;
+		mmap_t& operator=(const mmap_t&) = delete;
+
+		~mmap_t() noexcept {
+			if (_addr == nullptr) {
+				return;
+			}
+#ifndef _WINDOWS
+			::munmap(_addr, _len);
+#else
+			UnmapViewOfFile(_addr);
+			CloseHandle(_mapping);
+#endif
+		}
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _addr != nullptr; }
+		[[nodiscard]]
+		std::size_t length() const noexcept { return _len; }
+
+		[[nodiscard]]
+		const std::uint8_t *data() const noexcept { return _addr; }
+
+		void swap(mmap_t& map) noexcept {
+			std::swap(_addr, map._addr);
+			std::swap(_len, map._len);
+#ifdef _WINDOWS
+			std::swap(_mapping, map._mapping);
+#endif
+		}
+	};
+
+	inline void swap(mmap_t& a, mmap_t& b) noexcept { a.swap(b); }
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_MMAP_HH */
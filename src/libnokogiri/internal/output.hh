@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/output.hh - Large buffered writes to a file */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_OUTPUT_HH)
+#define LIBNOKOGIRI_INTERNAL_OUTPUT_HH
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+
+namespace libnokogiri::internal {
+	/*! The default size of the buffer in front of an output file */
+	constexpr std::size_t output_default_buffer_size{4_MiB};
+
+	/*! \struct libnokogiri::internal::output_t
+		\brief Large buffered writes to a file
+
+		Small writes are gathered into a buffer and go out a buffer at a time.
+		Anything that wouldn't fit in what's left of the buffer is written
+		straight from where it is along with whatever is buffered, in one gather
+		write, so large packets are never copied.
+
+		Ranges of other files are copied inside the kernel where it can, only
+		falling back to reading them through the buffer when it can't.
+
+		Nothing is written out until the buffer fills, so call flush() when done.
+	*/
+	struct output_t final {
+	private:
+		fd_t _file;
+		std::unique_ptr<std::uint8_t[]> _buffer;
+		std::size_t _capacity;
+		std::size_t _used{0U};
+		std::uint64_t _written{0U};
+		/* Cleared the first time the kernel turns down a copy, so we don't keep asking */
+		bool _kernel_copy{true};
+		bool _valid;
+
+		/* Read part of another file into the buffer, flushing as it fills */
+		[[nodiscard]]
+		bool copy_through(const fd_t& from, off_t offset, std::uint64_t len) noexcept {
+			while (len != 0U) {
+				if (_used == _capacity && !flush()) {
+					return false;
+				}
+
+				const auto chunk = std::size_t(std::min<std::uint64_t>(len, _capacity - _used));
+				if (!from.pread(_buffer.get() + _used, chunk, offset)) {
+					return (_valid = false);
+				}
+				_used += chunk;
+				_written += chunk;
+				offset += off_t(chunk);
+				len -= chunk;
+			}
+			return true;
+		}
+	public:
+		/*! \brief Start writing to a file from its current position
+
+			\param file The file to write to
+			\param buffer_size How much to gather up before writing
+		*/
+		output_t(fd_t&& file, const std::size_t buffer_size = output_default_buffer_size) noexcept :
+			_file{std::move(file)}, _buffer{new (std::nothrow) std::uint8_t[std::max<std::size_t>(buffer_size, 1U)]},
+			_capacity{std::max<std::size_t>(buffer_size, 1U)}, _valid{_file.valid() && _buffer} { /* NOP */ }
+
+		output_t(const output_t&) = delete;
+		output_t& operator=(const output_t&) = delete;
+
+		output_t(output_t&&) = default;
+		output_t& operator=(output_t&&) = default;
+
+		/*! Check if everything so far has made it out, any error sticks */
+		[[nodiscard]]
+		bool valid() const noexcept { return _valid; }
+
+		/*! Retrieve the underlying file, anything still buffered isn't in it yet */
+		[[nodiscard]]
+		const fd_t& file() const noexcept { return _file; }
+
+		/*! Retrieve how much has been written, including what's still buffered */
+		[[nodiscard]]
+		std::uint64_t written() const noexcept { return _written; }
+
+		/*! Retrieve how much is waiting in the buffer */
+		[[nodiscard]]
+		std::size_t buffered() const noexcept { return _used; }
+
+		/*! Append some data */
+		[[nodiscard]]
+		bool write(const void *const data, const std::size_t len) noexcept {
+			if (!_valid) {
+				return false;
+			}
+
+			if (_used + len <= _capacity) {
+				std::memcpy(_buffer.get() + _used, data, len);
+				_used += len;
+			} else if (!_file.write(_buffer.get(), _used, data, len)) {
+				return (_valid = false);
+			} else {
+				_used = 0U;
+			}
+			_written += len;
+			return true;
+		}
+
+		/*! \brief Append two buffers back to back, like a record header and its body
+
+			If the body doesn't fit the head is buffered and goes out with it, so
+			it's still only the one write.
+		*/
+		[[nodiscard]]
+		bool write(const void *const head, const std::size_t head_len, const void *const body, const std::size_t body_len) noexcept
+			{ return write(head, head_len) && write(body, body_len); }
+
+		/*! \brief Append part of another file
+
+			\param from The file to copy from, this doesn't touch its file position
+			\param offset Where in `from` to start
+			\param len How much to copy
+		*/
+		[[nodiscard]]
+		bool copy(const fd_t& from, off_t offset, std::uint64_t len) noexcept {
+			if (!_valid) {
+				return false;
+			}
+
+			/* Anything that fits in the buffer is cheaper to read into it than to break up the writes around it */
+			if (!_kernel_copy || len <= _capacity - _used) {
+				return copy_through(from, offset, len);
+			}
+
+			if (!flush()) {
+				return false;
+			}
+			while (len != 0U) {
+				const auto res = _file.copy(from, offset, std::size_t(std::min<std::uint64_t>(len, 1_GiB)), nullptr);
+				if (res < 0 && (errno == EINTR || errno == EAGAIN)) {
+					continue;
+				} else if (res <= 0) {
+					/* An error other than the kernel not being able to do it is a real one */
+					if (res == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP && errno != EBADF)) {
+						return (_valid = false);
+					}
+					_kernel_copy = false;
+					return copy_through(from, offset, len);
+				}
+
+				_written += std::uint64_t(res);
+				offset += off_t(res);
+				len -= std::uint64_t(res);
+			}
+			return true;
+		}
+
+		/*! Write out everything that's buffered */
+		[[nodiscard]]
+		bool flush() noexcept {
+			if (!_valid) {
+				return false;
+			}
+			if (_used != 0U && !_file.writeAll(_buffer.get(), _used)) {
+				return (_valid = false);
+			}
+			_used = 0U;
+			return true;
+		}
+	};
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_OUTPUT_HH */
@@ -0,0 +1,709 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/seekable.hh - Compressed captures made of independently decodable frames */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_SEEKABLE_HH)
+#define LIBNOKOGIRI_INTERNAL_SEEKABLE_HH
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/compression.hh>
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+#include <libnokogiri/internal/zlib.hh>
+
+/*
+	A seekable capture is an ordinary compressed capture that has been split
+	into frames that can each be decompressed on their own, along with where
+	each of them is. Anything that can decompress the format still reads it
+	as a single stream.
+
+	Zstandard and LZ4 captures use the Zstandard seekable format, each frame
+	is a complete zstd or LZ4 frame, and the frame table is in a skippable
+	frame at the end of the file, which both formats ignore when decompressing.
+
+	gzip captures are done like BGZF, each frame is a gzip member with an
+	extra field holding the size of the member and how much it decompresses
+	to, so the table is built by hopping from one member header to the next.
+	The last member is empty and marks the end of the capture.
+*/
+namespace libnokogiri::internal {
+	/*! The default amount of uncompressed data in each frame */
+	constexpr std::size_t seekable_default_frame_size{1_MiB};
+	/*! The most uncompressed data a frame can hold, anything claiming more isn't one of ours */
+	constexpr std::size_t seekable_max_frame_size{1_GiB};
+	/* Data that doesn't compress grows a little, this is plenty of room for that in any of the formats */
+	constexpr std::size_t seekable_max_compressed_frame_size{seekable_max_frame_size + (seekable_max_frame_size / 64U)};
+
+	/* The Zstandard seekable format, which we also use for LZ4 */
+	constexpr std::uint32_t seek_table_skippable_magic{0x184D2A5EU};
+	constexpr std::uint32_t seek_table_magic{0x8F92EAB1U};
+	constexpr std::size_t seek_table_footer_len{9U};
+	constexpr std::size_t skippable_header_len{8U};
+
+	/* The gzip extra subfield that holds the size of each member */
+	constexpr std::array<std::uint8_t, 2> seekable_gzip_subfield{{'N', 'K'}};
+	/* Fixed gzip header, extra length, subfield id and length, then the two sizes */
+	constexpr std::size_t seekable_gzip_header_len{10U + 2U + 4U + 8U};
+
+	/*! \struct libnokogiri::internal::seekable_frame_t
+		\brief Where a frame is in a seekable capture and what it decompresses to
+	*/
+	struct seekable_frame_t final {
+		std::uint64_t compressed_offset;
+		std::uint32_t compressed_length;
+		std::uint64_t offset;
+		std::uint32_t length;
+	};
+
+	inline void seekable_put_le32(std::uint8_t *const data, const std::uint32_t value) noexcept {
+		for (std::size_t byte{}; byte < 4U; ++byte) {
+			data[byte] = std::uint8_t(value >> (byte * 8U));
+		}
+	}
+
+	[[nodiscard]]
+	inline std::uint32_t seekable_get_le32(const std::uint8_t *const data) noexcept {
+		return std::uint32_t(data[0]) | (std::uint32_t(data[1]) << 8U) |
+			(std::uint32_t(data[2]) << 16U) | (std::uint32_t(data[3]) << 24U);
+	}
+
+	/*! \brief Decompress a single frame of a seekable capture
+
+		\param out Where to put it, this is resized to fit
+	*/
+	[[nodiscard]]
+	inline bool seekable_decode_frame(const fd_t& file, const capture_compression_t compression,
+		const seekable_frame_t& frame, std::vector<std::uint8_t>& out) noexcept {
+		if (frame.length > seekable_max_frame_size || frame.compressed_length > seekable_max_compressed_frame_size) {
+			return false;
+		}
+
+		std::vector<std::uint8_t> input{};
+		try {
+			input.resize(frame.compressed_length);
+			/* Leave room for one more byte so running into the end of the output doesn't stop the trailer being checked */
+			out.resize(std::size_t(frame.length) + 1U);
+		} catch (const std::bad_alloc&) {
+			return false;
+		}
+		if (!file.pread(input.data(), input.size(), off_t(frame.compressed_offset))) {
+			return false;
+		}
+
+		decompressor_t codec{compression};
+		const std::uint8_t *in{input.data()};
+		std::size_t in_len{input.size()};
+		std::uint8_t *out_ptr{out.data()};
+		std::size_t out_len{out.size()};
+		if (!codec.decompress(in, in_len, out_ptr, out_len) || in_len != 0U || out_len != 1U || !codec.finished()) {
+			return false;
+		}
+
+		out.resize(frame.length);
+		return true;
+	}
+
+	/*! \brief Read the frame table of a seekable capture
+
+		\returns The frames, or std::nullopt if the capture isn't seekable
+	*/
+	[[nodiscard]]
+	inline std::optional<std::vector<seekable_frame_t>> seekable_frames(const fd_t& file, const capture_compression_t compression) noexcept {
+		const auto file_len = std::uint64_t(std::max<off_t>(file.length(), 0));
+		std::vector<seekable_frame_t> frames{};
+		std::uint64_t offset{};
+
+		if (compression == capture_compression_t::Compressed) {
+			std::uint64_t position{};
+			while (position < file_len) {
+				std::array<std::uint8_t, seekable_gzip_header_len> header{};
+				if (position + header.size() > file_len || !file.pread(header.data(), header.size(), off_t(position))) {
+					return std::nullopt;
+				}
+
+				/* Only our own layout, FEXTRA and nothing else, with our subfield first */
+				if (header[0] != 0x1FU || header[1] != 0x8BU || header[2] != 0x08U || header[3] != 0x04U ||
+					header[10] != 12U || header[11] != 0U || header[12] != seekable_gzip_subfield[0] ||
+					header[13] != seekable_gzip_subfield[1] || header[14] != 8U || header[15] != 0U) {
+					return std::nullopt;
+				}
+
+				const auto compressed_length = seekable_get_le32(header.data() + 16U);
+				const auto length = seekable_get_le32(header.data() + 20U);
+				if (compressed_length < header.size() + 8U || position + compressed_length > file_len ||
+					compressed_length > seekable_max_compressed_frame_size || length > seekable_max_frame_size) {
+					return std::nullopt;
+				}
+
+				/* The empty member at the end */
+				if (length == 0U) {
+					return (position + compressed_length == file_len) ? std::make_optional(std::move(frames)) : std::nullopt;
+				}
+
+				try {
+					frames.push_back({position, compressed_length, offset, length});
+				} catch (const std::bad_alloc&) {
+					return std::nullopt;
+				}
+				position += compressed_length;
+				offset += length;
+			}
+			return std::nullopt;
+		}
+
+		if (compression != capture_compression_t::ZStandard && compression != capture_compression_t::LZ4) {
+			return std::nullopt;
+		}
+
+		std::array<std::uint8_t, seek_table_footer_len> footer{};
+		if (file_len < footer.size() + skippable_header_len || !file.pread(footer.data(), footer.size(), off_t(file_len - footer.size()))) {
+			return std::nullopt;
+		}
+
+		const auto count = seekable_get_le32(footer.data());
+		const auto descriptor = footer[4];
+		if (seekable_get_le32(footer.data() + 5U) != seek_table_magic || (descriptor & 0x7CU) != 0U) {
+			return std::nullopt;
+		}
+
+		const std::size_t entry_len{(descriptor & 0x80U) ? 12U : 8U};
+		const auto table_len = std::uint64_t(count) * entry_len + footer.size();
+		if (table_len + skippable_header_len > file_len) {
+			return std::nullopt;
+		}
+
+		const auto table_start = file_len - table_len - skippable_header_len;
+		std::vector<std::uint8_t> table{};
+		try {
+			table.resize(std::size_t(table_len) + skippable_header_len);
+			frames.reserve(count);
+		} catch (const std::bad_alloc&) {
+			return std::nullopt;
+		}
+		if (!file.pread(table.data(), table.size(), off_t(table_start)) ||
+			seekable_get_le32(table.data()) != seek_table_skippable_magic ||
+			seekable_get_le32(table.data() + 4U) != table_len) {
+			return std::nullopt;
+		}
+
+		std::uint64_t position{};
+		for (std::size_t idx{}; idx < count; ++idx) {
+			const auto entry = table.data() + skippable_header_len + (idx * entry_len);
+			const auto compressed_length = seekable_get_le32(entry);
+			const auto length = seekable_get_le32(entry + 4U);
+			if (compressed_length > seekable_max_compressed_frame_size || length > seekable_max_frame_size) {
+				return std::nullopt;
+			}
+			frames.push_back({position, compressed_length, offset, length});
+			position += compressed_length;
+			offset += length;
+		}
+
+		/* The frames have to account for everything before the table */
+		if (position != table_start) {
+			return std::nullopt;
+		}
+		return frames;
+	}
+
+	/*! \struct libnokogiri::internal::seekable_writer_t
+		\brief Writes a capture as a seekable compressed capture
+
+		Data is written a record at a time, a frame is only ever ended between
+		records, so for a pcap every frame after the first starts with a packet.
+		A frame is ended once it holds at least `frame_size` bytes or
+		`frame_records` records, whichever comes first.
+
+		With more than one thread, full frames are handed off to a pool of
+		compression threads and the caller carries on filling the next one.
+		Frames are written out in the order they were ended, as soon as every
+		frame before them is done. Only `queue_depth` frames can be in flight at
+		once, past that ending a frame waits for the oldest to be written, so a
+		writer that outpaces the compression threads is held back rather than
+		using more and more memory.
+	*/
+	struct seekable_writer_t final {
+	private:
+		using compressed_t = std::optional<std::vector<std::uint8_t>>;
+
+		struct job_t final {
+			std::vector<std::uint8_t> data;
+			std::promise<compressed_t> result;
+		};
+
+		struct in_flight_t final {
+			std::uint32_t length;
+			std::future<compressed_t> result;
+		};
+
+		/* What frames are compressed with, each thread keeps one for all the frames it does rather than setting one up for every frame */
+		using codec_t = std::variant<std::monostate, deflate_t, compressor_t>;
+
+		fd_t _file;
+		capture_compression_t _compression;
+		std::size_t _frame_size;
+		std::size_t _frame_records;
+		std::optional<std::int32_t> _level;
+		std::size_t _queue_depth;
+
+		std::vector<seekable_frame_t> _frames{};
+		std::vector<std::uint8_t> _pending{};
+		std::size_t _pending_records{0U};
+		std::uint64_t _compressed{0U};
+		std::uint64_t _length{0U};
+		bool _valid;
+
+		/* Frames waiting for a compression thread, and all the frames that haven't been written yet in order */
+		std::vector<std::thread> _workers{};
+		std::mutex _jobs_lock{};
+		std::condition_variable _jobs_ready{};
+		std::deque<job_t> _jobs{};
+		bool _stopping{false};
+		std::deque<in_flight_t> _in_flight{};
+		/* For compressing on the calling thread when there are no compression threads */
+		codec_t _codec{};
+
+		/* A gzip member in our layout, this needs the deflate data in raw form to know the size up front */
+		[[nodiscard]]
+		static bool gzip_member(deflate_t& deflate, const std::vector<std::uint8_t>& data, std::vector<std::uint8_t>& out) noexcept {
+			out.resize(seekable_gzip_header_len);
+			if (!deflate.valid() || !deflate.compress(data.data(), data.size(), out) || !deflate.finish(out)) {
+				return false;
+			}
+
+			std::array<std::uint8_t, 8> trailer{};
+			seekable_put_le32(trailer.data(), std::uint32_t(crc32(crc32(0U, nullptr, 0U), data.data(), uInt(data.size()))));
+			seekable_put_le32(trailer.data() + 4U, std::uint32_t(data.size()));
+			out.insert(out.end(), trailer.begin(), trailer.end());
+
+			/* No mtime, no extra flags, and an unknown OS, like gzip -n */
+			const std::array<std::uint8_t, 16> header{{
+				0x1FU, 0x8BU, 0x08U, 0x04U, 0x00U, 0x00U, 0x00U, 0x00U, 0x00U, 0xFFU,
+				12U, 0U, seekable_gzip_subfield[0], seekable_gzip_subfield[1], 8U, 0U
+			}};
+			std::copy(header.begin(), header.end(), out.begin());
+			seekable_put_le32(out.data() + 16U, std::uint32_t(out.size()));
+			seekable_put_le32(out.data() + 20U, std::uint32_t(data.size()));
+			return true;
+		}
+
+		void make_codec(codec_t& codec) const noexcept {
+			if (_compression == capture_compression_t::Compressed) {
+				codec.emplace<deflate_t>(_level.value_or(Z_DEFAULT_COMPRESSION), -15);
+			} else {
+				codec.emplace<compressor_t>(_compression, _level);
+			}
+		}
+
+		/* Finishing a frame leaves the codec ready for the next, only one that failed part way through needs setting up again */
+		[[nodiscard]]
+		compressed_t compress_frame(codec_t& codec, const std::vector<std::uint8_t>& data) const noexcept {
+			std::vector<std::uint8_t> out{};
+			bool compressed{false};
+			if (auto *const deflate = std::get_if<deflate_t>(&codec)) {
+				compressed = gzip_member(*deflate, data, out);
+			} else if (auto *const compressor = std::get_if<compressor_t>(&codec)) {
+				compressed = compressor->valid() && compressor->compress(data.data(), data.size(), out) && compressor->finish(out);
+			}
+
+			if (!compressed) {
+				make_codec(codec);
+				return std::nullopt;
+			}
+			return out;
+		}
+
+		void work() noexcept {
+			codec_t codec{};
+			make_codec(codec);
+			while (true) {
+				std::unique_lock<std::mutex> lock{_jobs_lock};
+				_jobs_ready.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+				if (_jobs.empty()) {
+					return;
+				}
+
+				auto job = std::move(_jobs.front());
+				_jobs.pop_front();
+				lock.unlock();
+
+				job.result.set_value(compress_frame(codec, job.data));
+			}
+		}
+
+		void stop() noexcept {
+			{
+				const std::lock_guard<std::mutex> lock{_jobs_lock};
+				_stopping = true;
+			}
+			_jobs_ready.notify_all();
+			for (auto& worker : _workers) {
+				worker.join();
+			}
+			_workers.clear();
+		}
+
+		[[nodiscard]]
+		bool emit(const compressed_t& compressed, const std::uint32_t length) noexcept {
+			if (!compressed || compressed->size() > seekable_max_compressed_frame_size || !_file.write(compressed->data(), compressed->size())) {
+				return (_valid = false);
+			}
+
+			try {
+				_frames.push_back({_compressed, std::uint32_t(compressed->size()), _length, length});
+			} catch (const std::bad_alloc&) {
+				return (_valid = false);
+			}
+			_compressed += compressed->size();
+			_length += length;
+			return true;
+		}
+
+		/* Write out the oldest frame in flight, waiting for it to be compressed if need be */
+		[[nodiscard]]
+		bool emit_oldest() noexcept {
+			auto frame = std::move(_in_flight.front());
+			_in_flight.pop_front();
+			return emit(frame.result.get(), frame.length);
+		}
+
+		[[nodiscard]]
+		bool end_frame() noexcept {
+			if (_pending.empty()) {
+				return true;
+			}
+
+			const auto length = std::uint32_t(_pending.size());
+			_pending_records = 0U;
+			if (_workers.empty()) {
+				const auto compressed = compress_frame(_codec, _pending);
+				_pending.clear();
+				return emit(compressed, length);
+			}
+
+			job_t job{std::move(_pending), {}};
+			_in_flight.push_back({length, job.result.get_future()});
+			{
+				const std::lock_guard<std::mutex> lock{_jobs_lock};
+				_jobs.push_back(std::move(job));
+			}
+			_jobs_ready.notify_one();
+
+			_pending = std::vector<std::uint8_t>{};
+			_pending.reserve(_frame_size);
+
+			/* Any frames that are already done can go out now, and if too many aren't we wait */
+			while (!_in_flight.empty() && (_in_flight.size() > _queue_depth ||
+				_in_flight.front().result.wait_for(std::chrono::seconds{0}) == std::future_status::ready)) {
+				if (!emit_oldest()) {
+					return false;
+				}
+			}
+			return true;
+		}
+	public:
+		/*! \brief Start writing a seekable capture
+
+			\param file Where to write it
+			\param compression The compression format, one of the compressed ones
+			\param frame_size How much uncompressed data to put in each frame
+			\param frame_records How many records to put in each frame at most, 0 for no limit
+			\param level The compression level, if not given the default for the format is used
+			\param threads How many threads to compress frames on, 1 does it on the calling thread and 0 uses one per core
+			\param queue_depth How many frames can be waiting to be written before ending a frame blocks, 0 for twice the number of threads
+		*/
+		seekable_writer_t(fd_t&& file, const capture_compression_t compression, const std::size_t frame_size = seekable_default_frame_size,
+			const std::size_t frame_records = 0U, const std::optional<std::int32_t> level = std::nullopt,
+			std::size_t threads = 1U, const std::size_t queue_depth = 0U) noexcept :
+			_file{std::move(file)}, _compression{compression},
+			/* Frames are only ended between records, so leave room for a whole record past the limit */
+			_frame_size{std::clamp<std::size_t>(frame_size, 1U, seekable_max_frame_size / 2U)}, _frame_records{frame_records}, _level{level},
+			_queue_depth{0U}, _valid{_file.valid() && is_compressed(compression) && compressor_t{compression}.valid()} {
+			if (threads == 0U) {
+				threads = std::max(std::thread::hardware_concurrency(), 1U);
+			}
+			_queue_depth = (queue_depth != 0U) ? queue_depth : threads * 2U;
+
+			if (_valid && threads > 1U) {
+				try {
+					for (std::size_t worker{}; worker < threads; ++worker) {
+						_workers.emplace_back(&seekable_writer_t::work, this);
+					}
+				} catch (const std::system_error&) {
+					/* However many we managed to start will have to do, and with none it's all done inline */
+				}
+			}
+			if (_valid && _workers.empty()) {
+				make_codec(_codec);
+			}
+		}
+
+		seekable_writer_t(const seekable_writer_t&) = delete;
+		seekable_writer_t& operator=(const seekable_writer_t&) = delete;
+
+		/* Anything not finished is thrown away */
+		~seekable_writer_t() noexcept { stop(); }
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _valid; }
+
+		/*! Retrieve the frames written so far */
+		[[nodiscard]]
+		const std::vector<seekable_frame_t>& frames() const noexcept { return _frames; }
+
+		/*! Retrieve the file being written to */
+		[[nodiscard]]
+		const fd_t& file() const noexcept { return _file; }
+
+		/*! Append some data to the current record */
+		[[nodiscard]]
+		bool write(const void *const data, const std::size_t len) noexcept {
+			if (!_valid || _pending.size() + len > seekable_max_frame_size) {
+				return false;
+			}
+			const auto bytes = static_cast<const std::uint8_t *>(data);
+			try {
+				_pending.insert(_pending.end(), bytes, bytes + len);
+			} catch (const std::bad_alloc&) {
+				return false;
+			}
+			return true;
+		}
+
+		/*! End the current record, which ends the frame if it's full */
+		[[nodiscard]]
+		bool end_record() noexcept {
+			if (!_valid) {
+				return false;
+			}
+
+			++_pending_records;
+			if (_pending.size() >= _frame_size || (_frame_records != 0U && _pending_records >= _frame_records)) {
+				return end_frame();
+			}
+			return true;
+		}
+
+		/*! Write out the last frame and the frame table, nothing can be written after this */
+		[[nodiscard]]
+		bool finish() noexcept {
+			if (!_valid || !end_frame()) {
+				return false;
+			}
+			while (!_in_flight.empty()) {
+				if (!emit_oldest()) {
+					return false;
+				}
+			}
+			stop();
+			_valid = false;
+
+			std::vector<std::uint8_t> trailer{};
+			if (_compression == capture_compression_t::Compressed) {
+				/* An empty member to mark the end, so a truncated capture can be told apart from a short one */
+				if (!std::holds_alternative<deflate_t>(_codec)) {
+					make_codec(_codec);
+				}
+				if (!gzip_member(std::get<deflate_t>(_codec), {}, trailer)) {
+					return false;
+				}
+				return _file.write(trailer.data(), trailer.size());
+			}
+
+			const auto table_len = (_frames.size() * 8U) + seek_table_footer_len;
+			trailer.resize(skippable_header_len + table_len);
+			seekable_put_le32(trailer.data(), seek_table_skippable_magic);
+			seekable_put_le32(trailer.data() + 4U, std::uint32_t(table_len));
+			auto entry = trailer.data() + skippable_header_len;
+			for (const auto& frame : _frames) {
+				seekable_put_le32(entry, frame.compressed_length);
+				seekable_put_le32(entry + 4U, frame.length);
+				entry += 8U;
+			}
+			seekable_put_le32(entry, std::uint32_t(_frames.size()));
+			entry[4] = 0U;
+			seekable_put_le32(entry + 5U, seek_table_magic);
+
+			return _file.write(trailer.data(), trailer.size());
+		}
+	};
+
+	/*! \struct libnokogiri::internal::seekable_reader_t
+		\brief Random access reads of the uncompressed contents of a seekable capture
+
+		Reading anywhere only needs the frames that cover it to be decompressed,
+		and the last frame read is kept around so reading through the capture in
+		order decompresses each frame just once.
+
+		This has the same interface as gzip_index_t, read() and seekRel() go
+		through the capture in order, and pread() can be used at any time.
+	*/
+	struct seekable_reader_t final {
+	private:
+		fd_t _file;
+		capture_compression_t _compression;
+		std::vector<seekable_frame_t> _frames;
+		std::uint64_t _length{0U};
+		std::uint64_t _position{0U};
+
+		/* pread() is const, so the frame it decompressed last is cached behind the lock */
+		mutable std::mutex _lock{};
+		mutable std::size_t _cached{SIZE_MAX};
+		mutable std::vector<std::uint8_t> _cache{};
+
+		[[nodiscard]]
+		std::size_t frame_at(const std::uint64_t offset) const noexcept {
+			const auto frame = std::upper_bound(_frames.begin(), _frames.end(), offset,
+				[](const std::uint64_t value, const seekable_frame_t& frame) {
+					return value < frame.offset;
+				}
+			);
+			return std::size_t(std::distance(_frames.begin(), frame)) - 1U;
+		}
+	public:
+		/*! \brief Start reading a seekable capture
+
+			\param file The capture
+			\param compression The compression format of the capture
+			\param frames The frame table, from seekable_frames()
+		*/
+		seekable_reader_t(fd_t&& file, const capture_compression_t compression, std::vector<seekable_frame_t>&& frames) noexcept :
+			_file{std::move(file)}, _compression{compression}, _frames{std::move(frames)} {
+			if (!_frames.empty()) {
+				_length = _frames.back().offset + _frames.back().length;
+			}
+		}
+
+		seekable_reader_t(const seekable_reader_t&) = delete;
+		seekable_reader_t& operator=(const seekable_reader_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _file.valid() && decompressor_t{_compression}.valid(); }
+
+		/*! Retrieve the size of the uncompressed data */
+		[[nodiscard]]
+		std::uint64_t length() const noexcept { return _length; }
+
+		/*! Retrieve the frame table */
+		[[nodiscard]]
+		const std::vector<seekable_frame_t>& frames() const noexcept { return _frames; }
+
+		/*! \brief Read part of the uncompressed data at any offset
+
+			This is safe to call from multiple threads, but they will take turns.
+		*/
+		[[nodiscard]]
+		bool pread(void *const buffer, const std::size_t len, const off_t offset) const noexcept {
+			if (offset < 0 || std::uint64_t(offset) + len > _length) {
+				return false;
+			}
+
+			const std::lock_guard<std::mutex> lock{_lock};
+			auto out = static_cast<std::uint8_t *>(buffer);
+			auto position = std::uint64_t(offset);
+			std::size_t done{};
+			while (done < len) {
+				const auto idx = frame_at(position);
+				if (idx != _cached) {
+					_cached = SIZE_MAX;
+					if (!seekable_decode_frame(_file, _compression, _frames[idx], _cache)) {
+						return false;
+					}
+					_cached = idx;
+				}
+
+				const auto& frame = _frames[idx];
+				const auto start = std::size_t(position - frame.offset);
+				const auto chunk = std::min<std::size_t>(len - done, frame.length - start);
+				std::copy_n(_cache.begin() + std::ptrdiff_t(start), chunk, out + done);
+				done += chunk;
+				position += chunk;
+			}
+
+			return true;
+		}
+
+		/*! \brief Read the next part of the uncompressed data
+
+			\returns The number of bytes read, 0 at the end of the data, or -1 on error
+		*/
+		[[nodiscard]]
+		ssize_t read(void *const buffer, const std::size_t len, std::nullptr_t) noexcept {
+			const auto chunk = std::size_t(std::min<std::uint64_t>(len, _length - _position));
+			if (!pread(buffer, chunk, off_t(_position))) {
+				return -1;
+			}
+			_position += chunk;
+			return ssize_t(chunk);
+		}
+
+		/*! Skip over the next `offset` bytes of the uncompressed data */
+		[[nodiscard]]
+		bool seekRel(const off_t offset) noexcept {
+			if (offset < 0 || std::uint64_t(offset) > _length - _position) {
+				return false;
+			}
+			_position += std::uint64_t(offset);
+			return true;
+		}
+
+		/*! \brief Decompress the whole capture into `out`, decompressing frames on multiple threads
+
+			\param threads How many threads to use, 0 to use one per core
+			\returns The number of bytes written to `out`, or -1 on error
+		*/
+		[[nodiscard]]
+		off_t decompress_to(const fd_t& out, std::size_t threads = 0U) const noexcept {
+			if (threads == 0U) {
+				threads = std::max(std::thread::hardware_concurrency(), 1U);
+			}
+
+			const auto decode = [this](const std::size_t idx) {
+				std::vector<std::uint8_t> data{};
+				return seekable_decode_frame(_file, _compression, _frames[idx], data) ?
+					std::make_optional(std::move(data)) : std::nullopt;
+			};
+
+			std::deque<std::future<std::optional<std::vector<std::uint8_t>>>> pending{};
+			std::size_t next{};
+			off_t written{};
+			for (std::size_t idx{}; idx < _frames.size(); ++idx) {
+				while (next < _frames.size() && pending.size() < threads) {
+					try {
+						pending.emplace_back(std::async(std::launch::async, decode, next));
+					} catch (const std::system_error&) {
+						pending.emplace_back(std::async(std::launch::deferred, decode, next));
+					}
+					++next;
+				}
+
+				auto data = pending.front().get();
+				pending.pop_front();
+				if (!data || !out.write(data->data(), data->size())) {
+					return -1;
+				}
+				written += off_t(data->size());
+			}
+
+			return written;
+		}
+	};
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_SEEKABLE_HH */
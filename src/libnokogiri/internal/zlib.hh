@@ -3,12 +3,15 @@
 #if !defined(LIBNOKOGIRI_INTERNAL_ZLIB_HH)
 #define LIBNOKOGIRI_INTERNAL_ZLIB_HH
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <memory>
+#include <new>
 #include <optional>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 #include <libnokogiri/config.hh>
 #include <libnokogiri/common.hh>
@@ -134,47 +137,213 @@ namespace libnokogiri::internal {
 		[[nodiscard]]
 		std::int32_t last_error() noexcept { return _error; }
 
-		std::int32_t decompress_to(fd_t& file) {
-			std::int32_t decmpressed{};
-			std::int32_t gzread_ret{};
-			std::array<uint8_t, 8_KiB> tmp{};
+		void clear_error() noexcept { gzclearerr(_gz_file.get()); _error = 0; }
+
+		void swap(gzfile_t &desc) noexcept {
+			std::swap(_file, desc._file);
+			std::swap(_gz_file, desc._gz_file);
+			std::swap(_error, desc._error);
+		}
+
+	};
+
+	inline void swap(gzfile_t &a, gzfile_t &b) noexcept { a.swap(b); }
+
+	/*! \struct libnokogiri::internal::inflate_t
+		\brief Streaming inflate over caller provided buffers
+
+		Unlike gzfile_t this does no I/O of its own, it is fed compressed data
+		and writes decompressed data into whatever buffer it is handed. Concatenated
+		gzip members are transparently decoded as one stream.
+	*/
+	struct inflate_t final {
+	private:
+		std::unique_ptr<z_stream> _stream;
+		std::int32_t _error{Z_OK};
+		bool _finished{true};
+	public:
+		/*! \brief Set up a new inflate stream
+
+			\param window_bits The zlib window bits, the default auto detects gzip and zlib headers
+		*/
+		inflate_t(const std::int32_t window_bits = 15 + 32) noexcept :
+			_stream{new (std::nothrow) z_stream{}} {
+			if (!_stream || inflateInit2(_stream.get(), window_bits) != Z_OK) {
+				_stream.reset();
+			}
+		}
 
-			while ((gzread_ret = gzread(_gz_file.get(), tmp.data(), 8_KiB)) == 8_KiB) {
-				const auto ret = file.write(tmp);
-				if (!ret) {
-					return -1;
+		inflate_t(inflate_t&& inf) noexcept : _stream{} { swap(inf); }
+		void operator=(inflate_t&& inf) noexcept { swap(inf); }
+
+		inflate_t(const inflate_t&) = delete;
+		inflate_t& operator=(const inflate_t&) = delete;
+
+		~inflate_t() noexcept {
+			if (_stream) {
+				inflateEnd(_stream.get());
+			}
+		}
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _stream != nullptr && (_error == Z_OK || _error == Z_STREAM_END); }
+
+		[[nodiscard]]
+		std::int32_t last_error() const noexcept { return _error; }
+
+		/*! Check if the stream stopped at the end of a gzip member, rather than part way through one */
+		[[nodiscard]]
+		bool finished() const noexcept { return _finished; }
+
+		/*! \brief Decompress as much of the input as will fit in the output
+
+			Both the input and output are advanced past what was consumed and produced.
+
+			\returns false on a corrupt stream, true otherwise
+		*/
+		[[nodiscard]]
+		bool decompress(const std::uint8_t *&in, std::size_t& in_len, std::uint8_t *&out, std::size_t& out_len) noexcept {
+			if (!_stream) {
+				return false;
+			}
+
+			/* Even with no input left there may be pending output buffered in the stream */
+			while (out_len != 0U) {
+				_stream->next_in = const_cast<Bytef *>(in);
+				_stream->avail_in = static_cast<uInt>(std::min<std::size_t>(in_len, UINT32_MAX));
+				_stream->next_out = out;
+				_stream->avail_out = static_cast<uInt>(std::min<std::size_t>(out_len, UINT32_MAX));
+				const auto consumed_in = _stream->avail_in;
+				const auto consumed_out = _stream->avail_out;
+
+				_error = ::inflate(_stream.get(), Z_NO_FLUSH);
+
+				in += consumed_in - _stream->avail_in;
+				in_len -= consumed_in - _stream->avail_in;
+				out += consumed_out - _stream->avail_out;
+				out_len -= consumed_out - _stream->avail_out;
+				if (consumed_in != _stream->avail_in) {
+					_finished = false;
+				}
+
+				if (_error == Z_STREAM_END) {
+					_finished = true;
+					/* Another member may follow, if it doesn't the caller will run out of input */
+					if (inflateReset(_stream.get()) != Z_OK) {
+						return false;
+					}
+				} else if (_error == Z_BUF_ERROR) {
+					/* No progress possible, need more input or output */
+					_error = Z_OK;
+					break;
+				} else if (_error != Z_OK) {
+					return false;
 				}
-				decmpressed += gzread_ret;
-				tmp.fill(0x00U);
 			}
 
-			if (gzread_ret < 0) {
-				return -1;
+			return true;
+		}
+
+		void swap(inflate_t& inf) noexcept {
+			std::swap(_stream, inf._stream);
+			std::swap(_error, inf._error);
+			std::swap(_finished, inf._finished);
+		}
+	};
+
+	inline void swap(inflate_t &a, inflate_t &b) noexcept { a.swap(b); }
+
+	/*! \struct libnokogiri::internal::deflate_t
+		\brief Streaming gzip compression into caller provided buffers
+
+		The counterpart to inflate_t, everything compressed is appended to the
+		output vector, which is grown as needed.
+	*/
+	struct deflate_t final {
+	private:
+		std::unique_ptr<z_stream> _stream;
+		std::int32_t _error{Z_OK};
+
+		[[nodiscard]]
+		bool deflate(const std::uint8_t *const in, const std::size_t len, std::vector<std::uint8_t>& out, const std::int32_t flush) noexcept {
+			if (!_stream) {
+				return false;
 			}
 
-			for (std::int32_t idx{}; idx < gzread_ret; ++idx) {
-				const auto ret = file.write(tmp[idx]);
-				if (!ret) {
-					return -1;
+			_stream->next_in = const_cast<Bytef *>(in);
+			_stream->avail_in = static_cast<uInt>(len);
+			do {
+				const auto used = out.size();
+				out.resize(used + std::max<std::size_t>(deflateBound(_stream.get(), _stream->avail_in), 64U));
+				_stream->next_out = out.data() + used;
+				_stream->avail_out = static_cast<uInt>(out.size() - used);
+
+				_error = ::deflate(_stream.get(), flush);
+				out.resize(out.size() - _stream->avail_out);
+				if (_error != Z_OK && _error != Z_STREAM_END && _error != Z_BUF_ERROR) {
+					return false;
 				}
+			} while (_stream->avail_in != 0U || (flush == Z_FINISH && _error != Z_STREAM_END));
+
+			return true;
+		}
+	public:
+		/*! \brief Set up a new deflate stream that writes a gzip member
+
+			\param level The zlib compression level
+			\param window_bits The zlib window bits, the default writes a gzip member and -15 writes raw deflate data
+		*/
+		deflate_t(const std::int32_t level = Z_DEFAULT_COMPRESSION, const std::int32_t window_bits = 15 + 16) noexcept :
+			_stream{new (std::nothrow) z_stream{}} {
+			if (!_stream || deflateInit2(_stream.get(), level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				_stream.reset();
 			}
+		}
 
-			decmpressed += gzread_ret;
+		deflate_t(deflate_t&& def) noexcept : _stream{} { swap(def); }
+		void operator=(deflate_t&& def) noexcept { swap(def); }
 
-			return decmpressed;
+		deflate_t(const deflate_t&) = delete;
+		deflate_t& operator=(const deflate_t&) = delete;
+
+		~deflate_t() noexcept {
+			if (_stream) {
+				deflateEnd(_stream.get());
+			}
 		}
 
-		void clear_error() noexcept { gzclearerr(_gz_file.get()); _error = 0; }
+		[[nodiscard]]
+		bool valid() const noexcept { return _stream != nullptr && (_error == Z_OK || _error == Z_STREAM_END || _error == Z_BUF_ERROR); }
 
-		void swap(gzfile_t &desc) noexcept {
-			std::swap(_file, desc._file);
-			std::swap(_gz_file, desc._gz_file);
-			std::swap(_error, desc._error);
+		[[nodiscard]]
+		std::int32_t last_error() const noexcept { return _error; }
+
+		/*! Compress `len` bytes from `in`, appending whatever comes out to `out` */
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const in, const std::size_t len, std::vector<std::uint8_t>& out) noexcept {
+			for (std::size_t done{}; done < len;) {
+				const auto chunk = std::min<std::size_t>(len - done, UINT32_MAX);
+				if (!deflate(in + done, chunk, out, Z_NO_FLUSH)) {
+					return false;
+				}
+				done += chunk;
+			}
+			return true;
+		}
+
+		/*! Finish the gzip member, appending the rest of it to `out`, the stream can then be used for a new member */
+		[[nodiscard]]
+		bool finish(std::vector<std::uint8_t>& out) noexcept {
+			return deflate(nullptr, 0U, out, Z_FINISH) && deflateReset(_stream.get()) == Z_OK;
 		}
 
+		void swap(deflate_t& def) noexcept {
+			std::swap(_stream, def._stream);
+			std::swap(_error, def._error);
+		}
 	};
 
-	inline void swap(gzfile_t &a, gzfile_t &b) noexcept { a.swap(b); }
+	inline void swap(deflate_t &a, deflate_t &b) noexcept { a.swap(b); }
 }
 
 #endif /* LIBNOKOGIRI_INTERNAL_ZLIB_HH */
@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/zran.hh - Random access into gzip files */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_ZRAN_HH)
+#define LIBNOKOGIRI_INTERNAL_ZRAN_HH
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+
+extern "C" {
+	#include <zlib.h>
+	#include <zconf.h>
+}
+
+namespace libnokogiri::internal {
+	/*! The size of the deflate history window */
+	constexpr std::size_t gzip_window_size{32_KiB};
+
+	/*! \struct libnokogiri::internal::gzip_checkpoint_t
+		\brief A point in a gzip file that inflating can be restarted from
+
+		Deflate blocks refer back to up to 32KiB of previous output, so to restart
+		at a block boundary we need both where it is in the compressed data, down
+		to the bit, and the window of output that came before it.
+	*/
+	struct gzip_checkpoint_t final {
+		/*! The offset into the uncompressed data */
+		std::uint64_t out;
+		/*! The offset of the first whole byte of the block in the compressed data */
+		std::uint64_t in;
+		/*! How many bits of the byte before `in` belong to the block */
+		std::uint32_t bits;
+		/*! How much of `window` is used, it is only less than full near the start of the stream */
+		std::uint32_t window_len;
+		std::array<std::uint8_t, gzip_window_size> window;
+	};
+
+	static_assert(std::is_trivially_copyable_v<gzip_checkpoint_t>);
+
+	/*! \struct libnokogiri::internal::gzip_index_t
+		\brief Random access reads of the uncompressed contents of a gzip file
+
+		This is the approach from zlib's `zran.c`, the file is inflated once from
+		start to finish, and every `span` bytes of output a checkpoint is taken
+		at the next deflate block boundary. A read at any offset then only has to
+		inflate from the closest checkpoint before it rather than from the start.
+
+		The first pass is done through read() and seekRel() so it can be used to
+		build other indexes at the same time. Once finish() is called, pread()
+		can be used to read at any offset.
+
+		The inflate state from the last read is kept, so reads that move forward
+		by less than `span` carry on from there instead of going back to a
+		checkpoint, which keeps sequential reads as cheap as one pass.
+
+		Concatenated gzip members are handled, and anything after the last
+		member that isn't another member is ignored, like gzread() does.
+	*/
+	struct gzip_index_t final {
+	private:
+		fd_t _file;
+		std::size_t _span;
+		std::vector<gzip_checkpoint_t> _checkpoints{};
+		std::uint64_t _length{0U};
+		bool _building{true};
+
+		/* All of the inflate state below is shared by pread(), so it's behind the lock */
+		mutable std::mutex _lock{};
+		mutable z_stream _stream{};
+		mutable bool _stream_valid{false};
+		/* If the stream was restarted from a checkpoint it's raw deflate until the end of the member */
+		mutable bool _raw{false};
+		/* How many bytes of the gzip trailer are left to skip in raw mode */
+		mutable std::size_t _trailer{0U};
+		mutable bool _eof{false};
+		mutable std::vector<std::uint8_t> _input;
+		mutable std::vector<std::uint8_t> _scratch;
+		/* The compressed offset of the next byte to read in, and the uncompressed offset of the next byte out */
+		mutable std::uint64_t _in_pos{0U};
+		mutable std::uint64_t _out_pos{0U};
+
+		void end_stream() const noexcept {
+			if (_stream_valid) {
+				inflateEnd(&_stream);
+				_stream_valid = false;
+			}
+		}
+
+		[[nodiscard]]
+		bool refill() const noexcept {
+			const auto res = fdpread(_file, _input.data(), _input.size(), off_t(_in_pos));
+			if (res <= 0) {
+				_eof = true;
+				return false;
+			}
+			_in_pos += std::uint64_t(res);
+			_stream.next_in = _input.data();
+			_stream.avail_in = uInt(res);
+			return true;
+		}
+
+		/* Check if another gzip member starts where the input is up to */
+		[[nodiscard]]
+		bool member_follows() const noexcept {
+			std::array<std::uint8_t, 2> magic{};
+			return fdpread(_file, magic.data(), magic.size(), off_t(_in_pos - _stream.avail_in)) == ssize_t(magic.size()) &&
+				magic[0] == 0x1FU && magic[1] == 0x8BU;
+		}
+
+		/* Start inflating again from the very start of the file */
+		[[nodiscard]]
+		bool rewind() const noexcept {
+			end_stream();
+			_stream = z_stream{};
+			if (inflateInit2(&_stream, 15 + 32) != Z_OK) {
+				return false;
+			}
+			_stream_valid = true;
+			_raw = false;
+			_trailer = 0U;
+			_eof = false;
+			_in_pos = 0U;
+			_out_pos = 0U;
+			return true;
+		}
+
+		/* Start inflating again from a checkpoint, this is raw deflate with the window primed */
+		[[nodiscard]]
+		bool restore(const gzip_checkpoint_t& checkpoint) const noexcept {
+			end_stream();
+			_stream = z_stream{};
+			if (inflateInit2(&_stream, -15) != Z_OK) {
+				return false;
+			}
+			_stream_valid = true;
+			_raw = true;
+			_trailer = 0U;
+			_eof = false;
+			_in_pos = checkpoint.in;
+			_out_pos = checkpoint.out;
+
+			if (checkpoint.bits != 0U) {
+				std::uint8_t byte{};
+				if (fdpread(_file, &byte, 1U, off_t(checkpoint.in - 1U)) != 1) {
+					return false;
+				}
+				if (inflatePrime(&_stream, std::int32_t(checkpoint.bits), byte >> (8U - checkpoint.bits)) != Z_OK) {
+					return false;
+				}
+			}
+
+			return inflateSetDictionary(&_stream, checkpoint.window.data(), checkpoint.window_len) == Z_OK;
+		}
+
+		void checkpoint(std::vector<gzip_checkpoint_t>& checkpoints) const noexcept {
+			if ((_stream.data_type & 128) == 0 || (_stream.data_type & 64) != 0) {
+				return;
+			}
+			if (!checkpoints.empty() && _out_pos - checkpoints.back().out < _span) {
+				return;
+			}
+
+			auto& point = checkpoints.emplace_back();
+			point.out = _out_pos;
+			point.in = _in_pos - _stream.avail_in;
+			point.bits = std::uint32_t(_stream.data_type & 7);
+			uInt window_len{gzip_window_size};
+			inflateGetDictionary(&_stream, point.window.data(), &window_len);
+			point.window_len = window_len;
+		}
+
+		/*
+			Inflate up to `len` bytes from wherever the stream is, this is only
+			short at the end of the data. Checkpoints are only taken if there's
+			somewhere to put them.
+		*/
+		[[nodiscard]]
+		ssize_t inflate_into(std::uint8_t *const out, const std::size_t len,
+				std::vector<gzip_checkpoint_t> *const checkpoints = nullptr) const noexcept {
+			if (!_stream_valid) {
+				return -1;
+			}
+
+			std::size_t produced{};
+			while (produced < len && !_eof) {
+				if (_stream.avail_in == 0U && !refill()) {
+					break;
+				}
+
+				if (_trailer != 0U) {
+					const auto skip = std::min<std::size_t>(_trailer, _stream.avail_in);
+					_stream.next_in += skip;
+					_stream.avail_in -= uInt(skip);
+					_trailer -= skip;
+					/* Anything after the trailer is either the next member, which has a gzip header of its own, or ignored */
+					if (_trailer == 0U) {
+						if (!member_follows()) {
+							_eof = true;
+						} else if (inflateReset2(&_stream, 15 + 16) != Z_OK) {
+							return -1;
+						}
+					}
+					continue;
+				}
+
+				_stream.next_out = out + produced;
+				_stream.avail_out = uInt(std::min<std::size_t>(len - produced, UINT32_MAX));
+				const auto avail_out = _stream.avail_out;
+
+				/* Stopping at block boundaries is only needed to spot where to take checkpoints */
+				const auto res = ::inflate(&_stream, (checkpoints != nullptr) ? Z_BLOCK : Z_NO_FLUSH);
+				const auto done = std::size_t(avail_out - _stream.avail_out);
+				produced += done;
+				_out_pos += done;
+
+				if (res == Z_STREAM_END) {
+					if (_raw) {
+						_raw = false;
+						_trailer = 8U;
+					} else if (!member_follows()) {
+						_eof = true;
+					} else if (inflateReset(&_stream) != Z_OK) {
+						return -1;
+					}
+				} else if (res == Z_BUF_ERROR) {
+					/* Out of input, the top of the loop will get more */
+					if (_stream.avail_in != 0U) {
+						return -1;
+					}
+				} else if (res != Z_OK) {
+					return -1;
+				} else if (checkpoints != nullptr) {
+					checkpoint(*checkpoints);
+				}
+			}
+
+			return ssize_t(produced);
+		}
+
+		[[nodiscard]]
+		bool discard(std::uint64_t len, std::vector<gzip_checkpoint_t> *const checkpoints = nullptr) const noexcept {
+			while (len != 0U) {
+				const auto chunk = std::size_t(std::min<std::uint64_t>(len, _scratch.size()));
+				if (inflate_into(_scratch.data(), chunk, checkpoints) != ssize_t(chunk)) {
+					return false;
+				}
+				len -= chunk;
+			}
+			return true;
+		}
+	public:
+		/*! \brief Start indexing a gzip file
+
+			\param file The gzip file
+			\param span How much uncompressed data there should be between checkpoints
+		*/
+		gzip_index_t(fd_t&& file, const std::size_t span = 1_MiB) noexcept :
+			_file{std::move(file)}, _span{span}, _input(128_KiB), _scratch(64_KiB) {
+			if (!rewind()) {
+				end_stream();
+			}
+		}
+
+		gzip_index_t(const gzip_index_t&) = delete;
+		gzip_index_t& operator=(const gzip_index_t&) = delete;
+		gzip_index_t(gzip_index_t&&) = delete;
+		gzip_index_t& operator=(gzip_index_t&&) = delete;
+
+		~gzip_index_t() noexcept { end_stream(); }
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _file.valid() && (_stream_valid || !_building); }
+
+		/*! Retrieve the size of the uncompressed data, this is only known once indexing is finished */
+		[[nodiscard]]
+		std::uint64_t length() const noexcept { return _length; }
+
+		/*! Retrieve the checkpoints that have been taken */
+		[[nodiscard]]
+		const std::vector<gzip_checkpoint_t>& checkpoints() const noexcept { return _checkpoints; }
+
+		/*! \brief Read the next part of the uncompressed data while indexing
+
+			\returns The number of bytes read, 0 at the end of the data, or -1 on error
+		*/
+		[[nodiscard]]
+		ssize_t read(void *const buffer, const std::size_t len, std::nullptr_t) noexcept {
+			return (_building) ? inflate_into(static_cast<std::uint8_t *>(buffer), len, &_checkpoints) : -1;
+		}
+
+		/*! Skip over the next `offset` bytes of the uncompressed data while indexing */
+		[[nodiscard]]
+		bool seekRel(const off_t offset) noexcept {
+			return _building && offset >= 0 && discard(std::uint64_t(offset), &_checkpoints);
+		}
+
+		/*! Finish the indexing pass, all of the uncompressed data must have been read or skipped */
+		void finish() noexcept {
+			_length = _out_pos;
+			_building = false;
+		}
+
+		/*! Skip the indexing pass, using checkpoints from a previous one */
+		void finish(std::vector<gzip_checkpoint_t>&& checkpoints, const std::uint64_t length) noexcept {
+			_checkpoints = std::move(checkpoints);
+			_length = length;
+			_building = false;
+			end_stream();
+		}
+
+		/*! \brief Read part of the uncompressed data at any offset
+
+			This is safe to call from multiple threads, but they will take turns.
+		*/
+		[[nodiscard]]
+		bool pread(void *const buffer, const std::size_t len, const off_t offset) const noexcept {
+			if (_building || offset < 0 || std::uint64_t(offset) + len > _length) {
+				return false;
+			}
+
+			const std::lock_guard<std::mutex> lock{_lock};
+			const auto target = std::uint64_t(offset);
+
+			/* Only go back to a checkpoint if carrying on from where we are would be further */
+			if (!_stream_valid || _eof || target < _out_pos || target - _out_pos > _span) {
+				const auto point = std::upper_bound(_checkpoints.begin(), _checkpoints.end(), target,
+					[](const std::uint64_t value, const gzip_checkpoint_t& checkpoint) {
+						return value < checkpoint.out;
+					}
+				);
+
+				if (point == _checkpoints.begin()) {
+					if (!rewind()) {
+						return false;
+					}
+				} else if (!restore(*std::prev(point))) {
+					return false;
+				}
+			}
+
+			return discard(target - _out_pos) &&
+				inflate_into(static_cast<std::uint8_t *>(buffer), len) == ssize_t(len);
+		}
+	};
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_ZRAN_HH */
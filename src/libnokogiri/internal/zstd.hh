@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* internal/zstd.hh - libnokogiri Zstandard wrapper */
+#pragma once
+#if !defined(LIBNOKOGIRI_INTERNAL_ZSTD_HH)
+#define LIBNOKOGIRI_INTERNAL_ZSTD_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+
+#if defined(LIBNOKOGIRI_ZSTD)
+extern "C" {
+	#include <zstd.h>
+}
+#endif
+
+namespace libnokogiri::internal {
+	/*! The compression level used when none is given */
+	constexpr std::int32_t zstd_default_level{3};
+
+#if defined(LIBNOKOGIRI_ZSTD)
+	/*! \struct libnokogiri::internal::zstd_decompress_t
+		\brief Streaming Zstandard decompression over caller provided buffers
+
+		This works the same way as inflate_t. Concatenated frames are decoded as one
+		stream and skippable frames are skipped.
+	*/
+	struct zstd_decompress_t final {
+	private:
+		std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> _ctx;
+		std::size_t _error{0U};
+		bool _finished{true};
+	public:
+		zstd_decompress_t() noexcept : _ctx{ZSTD_createDCtx(), ZSTD_freeDCtx} { /* NOP */ }
+
+		zstd_decompress_t(zstd_decompress_t&&) = default;
+		zstd_decompress_t& operator=(zstd_decompress_t&&) = default;
+
+		zstd_decompress_t(const zstd_decompress_t&) = delete;
+		zstd_decompress_t& operator=(const zstd_decompress_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _ctx != nullptr && !ZSTD_isError(_error); }
+
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return ZSTD_getErrorName(_error); }
+
+		/*! Check if the stream stopped at the end of a frame, rather than part way through one */
+		[[nodiscard]]
+		bool finished() const noexcept { return _finished; }
+
+		/*! \brief Decompress as much of the input as will fit in the output
+
+			Both the input and output are advanced past what was consumed and produced.
+
+			\returns false on a corrupt stream, true otherwise
+		*/
+		[[nodiscard]]
+		bool decompress(const std::uint8_t *&in, std::size_t& in_len, std::uint8_t *&out, std::size_t& out_len) noexcept {
+			if (!valid()) {
+				return false;
+			}
+
+			while (out_len != 0U) {
+				ZSTD_inBuffer input{in, in_len, 0U};
+				ZSTD_outBuffer output{out, out_len, 0U};
+
+				_error = ZSTD_decompressStream(_ctx.get(), &output, &input);
+				if (ZSTD_isError(_error)) {
+					return false;
+				}
+
+				in += input.pos;
+				in_len -= input.pos;
+				out += output.pos;
+				out_len -= output.pos;
+
+				if (input.pos == 0U && output.pos == 0U) {
+					break;
+				}
+				/* 0 means a frame was just finished and everything from it has been flushed */
+				_finished = _error == 0U;
+			}
+
+			return true;
+		}
+	};
+
+	/*! \struct libnokogiri::internal::zstd_compress_t
+		\brief Streaming Zstandard compression, the counterpart to zstd_decompress_t
+	*/
+	struct zstd_compress_t final {
+	private:
+		std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> _ctx;
+		std::size_t _error{0U};
+
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const in, const std::size_t len, std::vector<std::uint8_t>& out,
+			const ZSTD_EndDirective mode) noexcept {
+			if (!valid()) {
+				return false;
+			}
+
+			ZSTD_inBuffer input{in, len, 0U};
+			do {
+				const auto used = out.size();
+				out.resize(used + std::max(ZSTD_CStreamOutSize(), len - input.pos));
+				ZSTD_outBuffer output{out.data() + used, out.size() - used, 0U};
+
+				/* The result is how much is still left to flush */
+				_error = ZSTD_compressStream2(_ctx.get(), &output, &input, mode);
+				out.resize(used + output.pos);
+				if (ZSTD_isError(_error)) {
+					return false;
+				}
+			} while (input.pos != len || (mode != ZSTD_e_continue && _error != 0U));
+
+			return true;
+		}
+	public:
+		/*! \brief Set up a new compression stream
+
+			\param level The Zstandard compression level
+		*/
+		zstd_compress_t(const std::int32_t level = zstd_default_level) noexcept : _ctx{ZSTD_createCCtx(), ZSTD_freeCCtx} {
+			if (_ctx) {
+				_error = ZSTD_CCtx_setParameter(_ctx.get(), ZSTD_c_compressionLevel, level);
+			}
+			if (_ctx && !ZSTD_isError(_error)) {
+				_error = ZSTD_CCtx_setParameter(_ctx.get(), ZSTD_c_checksumFlag, 1);
+			}
+		}
+
+		zstd_compress_t(zstd_compress_t&&) = default;
+		zstd_compress_t& operator=(zstd_compress_t&&) = default;
+
+		zstd_compress_t(const zstd_compress_t&) = delete;
+		zstd_compress_t& operator=(const zstd_compress_t&) = delete;
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _ctx != nullptr && !ZSTD_isError(_error); }
+
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return ZSTD_getErrorName(_error); }
+
+		/*! Compress `len` bytes from `in`, appending whatever comes out to `out` */
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const in, const std::size_t len, std::vector<std::uint8_t>& out) noexcept {
+			return compress(in, len, out, ZSTD_e_continue);
+		}
+
+		/*! Finish the current frame, appending the rest of it to `out`, anything compressed after this starts a new frame */
+		[[nodiscard]]
+		bool finish(std::vector<std::uint8_t>& out) noexcept {
+			return compress(nullptr, 0U, out, ZSTD_e_end);
+		}
+	};
+#else
+	/* Built without Zstandard, these are never valid so opening or writing a Zstandard capture just fails */
+	struct zstd_decompress_t final {
+		[[nodiscard]]
+		bool valid() const noexcept { return false; }
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return "Zstandard support is not enabled"; }
+		[[nodiscard]]
+		bool finished() const noexcept { return false; }
+		[[nodiscard]]
+		bool decompress(const std::uint8_t *&, std::size_t&, std::uint8_t *&, std::size_t&) noexcept { return false; }
+	};
+
+	struct zstd_compress_t final {
+		zstd_compress_t(const std::int32_t = zstd_default_level) noexcept { /* NOP */ }
+		[[nodiscard]]
+		bool valid() const noexcept { return false; }
+		[[nodiscard]]
+		const char *last_error_str() const noexcept { return "Zstandard support is not enabled"; }
+		[[nodiscard]]
+		bool compress(const std::uint8_t *const, const std::size_t, std::vector<std::uint8_t>&) noexcept { return false; }
+		[[nodiscard]]
+		bool finish(std::vector<std::uint8_t>&) noexcept { return false; }
+	};
+#endif
+}
+
+#endif /* LIBNOKOGIRI_INTERNAL_ZSTD_HH */
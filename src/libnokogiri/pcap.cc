@@ -3,36 +3,129 @@
 
 
 #include <cstdio>
+#include <cstring>
+#include <new>
 #include <string>
 #include <optional>
+#include <utility>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 
 #include <libnokogiri/pcap.hh>
 
+#include <libnokogiri/internal/compression.hh>
 #include <libnokogiri/internal/zlib.hh>
+#include <libnokogiri/internal/gunzip.hh>
+#include <libnokogiri/internal/output.hh>
 
 #include <iostream>
 
 namespace fs = libnokogiri::internal::fs;
 
 namespace libnokogiri::pcap {
+	/* How much of the capture to pull in at once when building the packet index */
+	static constexpr std::size_t index_chunk_size{1_MiB};
 
-	pcap_t::pcap_t(libnokogiri::internal::fs::path& file, capture_compression_t compression, bool read_only, bool prefetch) noexcept :
-		_file{}, _compression{compression}, _readonly{read_only}, _prefetch{prefetch} {
+	/* The version of the sidecar index layout, bump this whenever it changes */
+	static constexpr std::uint32_t index_sidecar_version{4U};
+	/* How much of the start of the capture is checksummed to detect it changing under the index */
+	static constexpr std::size_t index_sidecar_crc_len{4_KiB};
+
+	/*
+		The sidecar is a cache of the packet index that lives next to the
+		capture, it's only ever read back on the machine that wrote it so
+		everything is in host byte order.
+
+		It's laid out as this header followed by the offset column, which is
+		all that's needed to rebuild the packet index, then the timestamp
+		column so searching by time doesn't have to read every packet header
+		again, and then the gzip checkpoints if the capture is being
+		decompressed lazily. The timestamp column is either there for every
+		packet or not at all.
+	*/
+	struct index_sidecar_header_t final {
+		std::array<char, 8> magic;
+		std::uint32_t version;
+		std::uint32_t capture_crc;
+		std::uint64_t capture_size;
+		std::int64_t capture_mtime;
+		std::uint64_t packet_count;
+		std::uint64_t end_offset;
+		std::uint64_t checkpoint_count;
+		std::uint64_t timestamp_count;
+	};
+
+	static_assert(sizeof(index_sidecar_header_t) % alignof(std::uint64_t) == 0U, "The sidecar columns are read in place");
+
+	static constexpr std::array<char, 8> index_sidecar_magic{{'N', 'K', 'G', 'I', 'D', 'X', '\r', '\n'}};
+
+	pcap_t::pcap_t(libnokogiri::internal::fs::path& file, capture_compression_t compression, bool read_only, bool prefetch, bool memory_map,
+		bool use_index, bool lazy_decompress) noexcept :
+		_file{}, _path{file}, _compression{compression}, _readonly{read_only}, _prefetch{prefetch} {
 		libnokogiri::internal::fd_t cap{file, (read_only) ? O_RDONLY : O_RDWR};
 		if (_compression == capture_compression_t::Autodetect) {
 			_compression = libnokogiri::internal::detect_captrue_compression(cap);
 		}
 
-		if (_compression == capture_compression_t::Compressed) {
-			_file = std::move(libnokogiri::internal::fd_t::maketemp(O_RDWR,  S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH, ".pcap"sv));
-			libnokogiri::internal::gzfile_t gzcap{cap};
-			if (gzcap.decompress_to(_file) == -1) {
+		/* Fingerprint the capture as it is on disk so we can tell if the sidecar is stale */
+		index_sidecar_header_t sidecar{};
+		if (use_index) {
+			std::error_code ec{};
+			std::array<std::uint8_t, index_sidecar_crc_len> start{};
+			const auto len = std::min<std::size_t>(start.size(), std::size_t(std::max<off_t>(cap.length(), 0)));
+			if (!cap.pread(start.data(), len, 0)) {
+				use_index = false;
+			}
+
+			sidecar.magic = index_sidecar_magic;
+			sidecar.version = index_sidecar_version;
+			sidecar.capture_crc = std::uint32_t(crc32(0U, start.data(), uInt(len)));
+			sidecar.capture_size = std::uint64_t(cap.length());
+			sidecar.capture_mtime = std::int64_t(fs::last_write_time(file, ec).time_since_epoch().count());
+			use_index = use_index && !ec;
+		}
+		const auto sidecar_path = fs::path{file} += ".nkidx"sv;
+
+		/* A seekable capture says where every frame is, so it can be read lazily or decompressed in parallel whatever the format */
+		auto frames = (is_compressed(_compression)) ?
+			libnokogiri::internal::seekable_frames(cap, _compression) : std::nullopt;
+
+		if (frames && lazy_decompress && read_only) {
+			_frames = std::make_unique<libnokogiri::internal::seekable_reader_t>(std::move(cap), _compression, std::move(*frames));
+			if (!_frames->valid()) {
+				return;
+			}
+		} else if (frames) {
+			_file = libnokogiri::internal::fd_t::makemem(".pcap"sv);
+			const libnokogiri::internal::seekable_reader_t reader{std::move(cap), _compression, std::move(*frames)};
+			if (reader.decompress_to(_file) == -1 || !_file.head()) {
+				return;
+			}
+		} else if (_compression == capture_compression_t::Compressed && lazy_decompress && read_only) {
+			_gzip = std::make_unique<libnokogiri::internal::gzip_index_t>(std::move(cap));
+			if (!_gzip->valid()) {
+				return;
+			}
+		} else if (_compression == capture_compression_t::Compressed) {
+			/*
+				Decompress into memory rather than round tripping the whole capture through the disk,
+				and spread the gzip members over as many threads as we can.
+			*/
+			_file = libnokogiri::internal::fd_t::makemem(".pcap"sv);
+			if (libnokogiri::internal::gunzip_parallel(cap, _file) == -1) {
 				return;
 			}
 
 			if(!_file.head()) {
 				return;
 			}
+		} else if (is_compressed(_compression)) {
+			_file = libnokogiri::internal::fd_t::makemem(".pcap"sv);
+			if (libnokogiri::internal::decompress_to(cap, _file, _compression) == -1 || !_file.head()) {
+				return;
+			}
 		} else {
 			_file = std::move(cap);
 		}
@@ -40,224 +133,992 @@ namespace libnokogiri::pcap {
 		if (!read_header()) {
 			return;
 		}
+		_index = packet_index_t{std::uint32_t(packet_header_length(_header.variant()))};
+
+		/*
+			If we can't map or prefetch the file we just fall back to doing normal I/O.
 
-		if (!ingest_packets()) {
+			A decompressed capture is already in memory, so mapping it is the
+			cheapest way to prefetch it, there's no need for a second copy.
+		*/
+		if (lazily_decompressed()) {
+			/* There's nothing decompressed to map or prefetch */
+		} else if (memory_map || (_prefetch && is_compressed(_compression))) {
+			_map = libnokogiri::internal::mmap_t{_file};
+		} else if (_prefetch && !prefetch_capture()) {
 			return;
 		}
 
+		if (!use_index || !load_index(sidecar_path, sidecar)) {
+			if (!ingest_packets()) {
+				return;
+			}
+
+			/* Not being able to write the sidecar is fine, we'll just index again next time */
+			if (use_index) {
+				/* The timestamps are only a pass over the packet headers now, but a read of every one of them later */
+				[[maybe_unused]]
+				const auto timestamps = index_timestamps();
+				[[maybe_unused]]
+				const auto _ = write_index(sidecar_path, sidecar);
+			}
+		}
+
 		_valid = true;
 	}
 
 	bool pcap_t::read_header() noexcept {
-		if (auto magic = _file.read<std::uint32_t>()) {
-			const auto pcap_magic{static_cast<pcap_variant_t>(*magic)};
-			switch (pcap_magic) {
-				case pcap_variant_t::Standard:
-				case pcap_variant_t::Modified:
-				case pcap_variant_t::IXIAHW:
-				case pcap_variant_t::IXIASW:
-				case pcap_variant_t::Nanosecond: {
-					/* Swapping is disabled by default, no need to do so */
-					_header.variant(pcap_magic);
-					break;
-				}
-				case pcap_variant_t::SwappedStandard:
-				case pcap_variant_t::SwappedModified:
-				case pcap_variant_t::SwappedIXIAHW:
-				case pcap_variant_t::SwappedIXIASW:
-				case pcap_variant_t::SwappedNanosecond: {
-					/* We need to swap all the things when reading */
-					_needs_swapping = true;
-					_header.variant(static_cast<pcap_variant_t>(LIBNOKOGIRI_SWAP32(*magic)));
-					break;
-				} default : {
-					/* Unknown file, bail */
-					return false;
-				}
+		std::array<std::uint8_t, file_header_length> raw_header{};
+		if (_frames) {
+			if (_frames->read(raw_header.data(), raw_header.size(), nullptr) != ssize_t(raw_header.size())) {
+				return false;
 			}
-		} else {
+		} else if (_gzip) {
+			if (_gzip->read(raw_header.data(), raw_header.size(), nullptr) != ssize_t(raw_header.size())) {
+				return false;
+			}
+		} else if (!_file.read(raw_header)) {
 			return false;
 		}
 
-		const auto majorv = _file.read<std::uint16_t>();
-		const auto minorv = _file.read<std::uint16_t>();
-		if(majorv && minorv) {
-			_header.version(
-				(_needs_swapping) ?
-				version_t{LIBNOKOGIRI_SWAP16(*majorv), LIBNOKOGIRI_SWAP16(*minorv)} :
-				version_t{*majorv, *minorv}
-			);
-		} else {
+		return decode_file_header(raw_header.data(), _header, _needs_swapping);
+	}
+
+	bool pcap_t::load_index(const fs::path& sidecar_path, const index_sidecar_header_t& expected) noexcept {
+		libnokogiri::internal::fd_t sidecar_file{sidecar_path, O_RDONLY};
+		if (!sidecar_file.valid()) {
 			return false;
 		}
 
+		libnokogiri::internal::mmap_t sidecar{sidecar_file};
+		if (!sidecar.valid() || sidecar.length() < sizeof(index_sidecar_header_t)) {
+			return false;
+		}
 
-		if (auto tz_offset = _file.read<std::int32_t>()) {
-			_header.timezone_offset((_needs_swapping) ? LIBNOKOGIRI_SWAP32(*tz_offset) : *tz_offset);
-		} else {
+		index_sidecar_header_t header{};
+		std::memcpy(&header, sidecar.data(), sizeof(header));
+		if (header.magic != expected.magic || header.version != expected.version ||
+			header.capture_crc != expected.capture_crc || header.capture_size != expected.capture_size ||
+			header.capture_mtime != expected.capture_mtime) {
 			return false;
 		}
 
-		if (auto ts_figs = _file.read<std::uint32_t>()) {
-			_header.timestamp_accuracy((_needs_swapping) ? LIBNOKOGIRI_SWAP32(*ts_figs) : *ts_figs);
-		} else {
+		using libnokogiri::internal::gzip_checkpoint_t;
+		const auto count = std::size_t(header.packet_count);
+		const auto checkpoint_count = std::size_t(header.checkpoint_count);
+		const auto body_len = sidecar.length() - sizeof(header);
+		/* A lazily decompressed capture can't do anything without its checkpoints */
+		if ((_gzip && checkpoint_count == 0U) || checkpoint_count > body_len / sizeof(gzip_checkpoint_t) ||
+			(header.timestamp_count != 0U && header.timestamp_count != header.packet_count)) {
 			return false;
 		}
 
-		if (auto pckt_len = _file.read<std::uint32_t>()) {
-			_header.max_packet_length((_needs_swapping) ? LIBNOKOGIRI_SWAP32(*pckt_len) : *pckt_len);
-		} else {
+		const auto columns = (header.timestamp_count != 0U) ? 2U : 1U;
+		const auto columns_len = body_len - (checkpoint_count * sizeof(gzip_checkpoint_t));
+		if (columns_len / (columns * sizeof(std::uint64_t)) != count || columns_len % (columns * sizeof(std::uint64_t)) != 0U) {
 			return false;
 		}
 
-		if (auto lnk_type = _file.read<std::uint32_t>()) {
-			_header.link_type(
-				(_needs_swapping) ?
-				static_cast<link_type_t>(LIBNOKOGIRI_SWAP32(*lnk_type)) :
-				static_cast<link_type_t>(*lnk_type)
-			);
-		} else {
+		/* Only the ends are checked here, the index checks each record against its neighbours as it's used */
+		const auto capture_length = (_frames) ? _frames->length() : std::uint64_t(_file.length());
+		if (!_gzip && header.end_offset != capture_length) {
+			return false;
+		}
+
+		/* The header is a multiple of 8 bytes and the mapping is page aligned, so the columns can be used in place */
+		const auto columns_base = reinterpret_cast<const std::uint64_t *>(sidecar.data() + sizeof(header));
+		if (count != 0U && columns_base[0] < file_header_length) {
 			return false;
 		}
+		_index.borrow(columns_base, (header.timestamp_count != 0U) ? columns_base + count : nullptr, count);
+		_index.end(header.end_offset);
 
+		if (_gzip) {
+			std::vector<gzip_checkpoint_t> checkpoints(checkpoint_count);
+			std::memcpy(checkpoints.data(), sidecar.data() + sizeof(header) + columns_len, checkpoint_count * sizeof(gzip_checkpoint_t));
+
+			const bool usable = std::all_of(checkpoints.begin(), checkpoints.end(), [&](const gzip_checkpoint_t& checkpoint) {
+				return checkpoint.bits < 8U && checkpoint.window_len <= checkpoint.window.size() &&
+					checkpoint.out <= header.end_offset && checkpoint.in <= header.capture_size;
+			});
+			if (!usable) {
+				_index.clear();
+				return false;
+			}
+
+			_gzip->finish(std::move(checkpoints), header.end_offset);
+		}
+
+		_sidecar = std::move(sidecar);
 		return true;
 	}
 
-	std::size_t get_packet_body_offset(pcap_variant_t v) {
-		switch (v) {
-			case pcap_variant_t::Modified: {
-				return 12U;
-			} case pcap_variant_t::Standard:
-			case pcap_variant_t::IXIAHW:
-			case pcap_variant_t::IXIASW:
-			case pcap_variant_t::Nanosecond:
-			default: {
-				return 4U;
+	bool pcap_t::write_index(const fs::path& sidecar_path, const index_sidecar_header_t& header) const noexcept {
+		index_sidecar_header_t hdr{header};
+		hdr.packet_count = _index.size();
+		hdr.end_offset = _index.end();
+		hdr.checkpoint_count = (_gzip) ? _gzip->checkpoints().size() : 0U;
+		hdr.timestamp_count = (_index.has_timestamps()) ? _index.size() : 0U;
+
+		const auto write_all = [](libnokogiri::internal::fd_t& out, const void *const data, const std::size_t len) -> bool {
+			const auto bytes = static_cast<const std::uint8_t *>(data);
+			std::size_t written{};
+			while (written < len) {
+				const auto res = out.write(bytes + written, std::min<std::size_t>(len - written, 1_GiB), nullptr);
+				if (res <= 0) {
+					return false;
+				}
+				written += std::size_t(res);
 			}
+			return true;
 		};
+
+		/* Write it off to the side and move it into place so readers never see a partial index */
+		const auto temp_path = fs::path{sidecar_path} += ".tmp"sv;
+		{
+			libnokogiri::internal::fd_t out{temp_path, O_WRONLY | O_CREAT | O_TRUNC, libnokogiri::internal::normalMode};
+			if (!out.valid()) {
+				return false;
+			}
+
+			const bool written = write_all(out, &hdr, sizeof(hdr)) &&
+				write_all(out, _index.offsets(), _index.size() * sizeof(std::uint64_t)) &&
+				(hdr.timestamp_count == 0U || write_all(out, _index.timestamps(), _index.size() * sizeof(std::uint64_t))) &&
+				(!_gzip || write_all(out, _gzip->checkpoints().data(),
+					_gzip->checkpoints().size() * sizeof(libnokogiri::internal::gzip_checkpoint_t)));
+			if (!written) {
+				std::error_code ec{};
+				fs::remove(temp_path, ec);
+				return false;
+			}
+		}
+
+		std::error_code ec{};
+		fs::rename(temp_path, sidecar_path, ec);
+		if (ec) {
+			fs::remove(temp_path, ec);
+			return false;
+		}
+		return true;
+	}
+
+	/* Pulls the entire capture into one contiguous arena with as few reads as we can get away with */
+	bool pcap_t::prefetch_capture() noexcept {
+		const auto len = _file.length();
+		if (len < 0) {
+			return true;
+		}
+
+		std::unique_ptr<std::uint8_t[]> arena{new (std::nothrow) std::uint8_t[std::size_t(len)]};
+		if (!arena || !_file.head()) {
+			return true;
+		}
+
+		std::size_t filled{};
+		while (filled < std::size_t(len)) {
+			/* Cap each read, some platforms can't do more than this in one go */
+			const auto res = _file.read(arena.get() + filled, std::min<std::size_t>(std::size_t(len) - filled, 1_GiB), nullptr);
+			if (res <= 0) {
+				return false;
+			}
+			filled += std::size_t(res);
+		}
+
+		_arena = std::move(arena);
+		_arena_len = filled;
+		return true;
+	}
+
+	/*
+		Indexes all of the packet records whose headers are entirely within
+		the given buffer, `base` is the file offset of the start of the buffer.
+
+		This returns the position in the buffer where the next record would
+		start, which may very well be past the end of the buffer if the body
+		of the last record is not entirely within it.
+	*/
+	std::size_t pcap_t::index_records(const std::uint8_t *const data, const std::size_t len, const std::uintptr_t base) noexcept {
+		const auto pkt_hdr_len = _index.header_length();
+		std::size_t pos{};
+
+		while (pos < len && len - pos >= pkt_hdr_len) {
+			std::uint32_t captured_len{};
+			std::memcpy(&captured_len, data + pos + 8U, sizeof(captured_len));
+			if (_needs_swapping) {
+				captured_len = LIBNOKOGIRI_SWAP32(captured_len);
+			}
+
+			_index.push_back(base + pos);
+			pos += pkt_hdr_len + captured_len;
+		}
+
+		return pos;
 	}
 
 	/*
 		The idea behind this is fairly simple.
 
 		Because we are only interested in the packet offset and the size of
-		the data on the first pass, we can skip most if not all of the other
-		needed read calls.
+		the data on the first pass, we don't need to do I/O per packet, we
+		just need to see every packet header once.
 
 		Seeing as the packet headers are all fixed sizes, and all share the
-		common standard header we can seek to a known offset to extract the
-		length of the packet data, then based on the packet header type, add
-		that to our offset to get the proper offset for the packet data.
+		common standard header, we can pull the file in in large chunks and
+		walk the headers in memory, jumping over the packet bodies.
 
 		So it works as follows:
 
-			Assume the offset of _file is at the end of the file header.
-
-			Get the packet header offset for the type of headers we expect.
+			Assume the source is positioned at the end of the file header.
 
 			Until we reach the end of the file:
 
-				Seek 8 bytes, skips the time-stamp members of the packet header
+				Read as much as will fit into the buffer after any left over bytes
 
-				Extract the next 4 bytes which is the size of the packet data
+				Index every packet whose header is entirely within the buffer
 
-				Seek the remaining offset 4 for standard packets and 12 for modified
+				If the last header was cut off by the end of the buffer, move it
+				to the front of the buffer so the next read completes it
 
-				Get the current seek position, set that as the offset.
+				Otherwise remember how much of the last packet body is still
+				left to jump over, if that is more than a buffer's worth seek
+				over it rather than reading it in
 
-				Seek to the current position + packet length
+		The source is either the capture file itself, or the gzip index for a
+		lazily decompressed capture, which builds its checkpoints as we go.
 
+		If the file is mapped then the whole thing is already in memory and
+		we can just walk it in one go.
 	*/
-	bool pcap_t::ingest_packets() noexcept {
-		const auto pkt_body_offset = get_packet_body_offset(_header.variant());
-		const std::size_t pkt_len_offset = 8U;
+	template<typename source_t>
+	bool pcap_t::index_stream(source_t& source, std::uintptr_t base) noexcept {
+		std::vector<std::uint8_t> buffer(index_chunk_size);
+		std::size_t avail{};
+		std::size_t skip{};
 
-		while (!_file.isEOF()) {
-			const auto prev_pos = _file.tell();
-			if(_file.seek(pkt_len_offset) != std::ptrdiff_t(pkt_len_offset + prev_pos))
+		while (true) {
+			const auto res = source.read(buffer.data() + avail, buffer.size() - avail, nullptr);
+			if (res < 0) {
 				return false;
+			} else if (res == 0) {
+				break;
+			}
+			avail += std::size_t(res);
 
-			/* Returns an optional */
-			const auto size = _file.read<std::uint32_t>();
-			if (!size) {
-				return false;
+			if (skip >= avail) {
+				skip -= avail;
+				base += avail;
+				avail = 0;
+			} else {
+				const auto next = skip + index_records(buffer.data() + skip, avail - skip, base + skip);
+				if (next < avail) {
+					/* Partial header, carry it over into the next read */
+					std::memmove(buffer.data(), buffer.data() + next, avail - next);
+					base += next;
+					avail -= next;
+					skip = 0;
+				} else {
+					skip = next - avail;
+					base += avail;
+					avail = 0;
+				}
 			}
 
-			_packets.emplace_back(packet_storage_t{*size, std::uintptr_t(prev_pos)});
-			const auto pckt_size = _file.tell();
-			const auto next_packet =  *size + pkt_body_offset;
-			if(_file.seek(next_packet) != std::ptrdiff_t(next_packet + pckt_size))
-				return false;
+			if (skip > buffer.size()) {
+				if (!source.seekRel(off_t(skip))) {
+					return false;
+				}
+				base += skip;
+				skip = 0;
+			}
+		}
+
+		_index.end(base);
+		/* Anything left over means the capture is truncated */
+		return avail == 0 && skip == 0;
+	}
+
+	bool pcap_t::ingest_packets() noexcept {
+		if (in_memory()) {
+			const auto start = file_header_length;
+			const auto end = index_records(image() + start, image_length() - start, start);
+			_index.end(start + end);
+			/* A short final record means the capture is truncated */
+			return start + end == image_length();
 		}
 
+		if (_frames) {
+			return index_stream(*_frames, file_header_length) && _frames->length() == _index.end();
+		}
+
+		if (_gzip) {
+			const bool complete = index_stream(*_gzip, file_header_length);
+			_gzip->finish();
+			return complete && _gzip->length() == _index.end();
+		}
+
+		/* Seeking over the last packet body can take us past the end of a truncated capture */
+		return index_stream(_file, std::uintptr_t(_file.tell())) && off_t(_index.end()) == _file.length();
+	}
+
+	/* The checksum is over the record as it would be written, so changing the header is spotted too */
+	std::uint32_t pcap_t::fingerprint(const packet_t& packet) const noexcept {
+		std::array<std::uint8_t, 24> raw_header{};
+		encode_packet_header(packet.header(), _header.variant(), false, std::uint32_t(packet.length()), raw_header.data());
+		const auto sum = crc32(0U, raw_header.data(), uInt(packet_header_length(_header.variant())));
+		return std::uint32_t(crc32(sum, packet.begin(), uInt(packet.length())));
+	}
+
+	/* Called on each packet evicted from the cache, ones that were changed are moved aside so they can still be saved */
+	bool pcap_t::keep_changed(const std::size_t idx, cached_packet_t& cached) noexcept {
+		if (fingerprint(cached.packet) == cached.fingerprint) {
+			return true;
+		}
+
+		try {
+			_changed.emplace(idx, std::move(cached.packet));
+		} catch (const std::bad_alloc&) {
+			/* Then it has to stay in the cache */
+			return false;
+		}
 		return true;
 	}
 
-	std::optional<std::reference_wrapper<packet_t>> pcap_t::get_packet(packet_storage_t& pkt_storage) noexcept {
-		if (_file.seek(pkt_storage.offset(), SEEK_SET) != std::ptrdiff_t(pkt_storage.offset())) {
+	void pcap_t::cache_budget(const std::size_t budget) noexcept {
+		_packet_cache.budget(budget, [this](const std::size_t idx, cached_packet_t& cached) { return keep_changed(idx, cached); });
+	}
+
+	void pcap_t::clear_cache() noexcept {
+		_packet_cache.clear([this](const std::size_t idx, cached_packet_t& cached) { return keep_changed(idx, cached); });
+	}
+
+	std::optional<std::reference_wrapper<packet_t>> pcap_t::get_packet(std::size_t idx) noexcept {
+		if (const auto cached = _packet_cache.find(idx); cached != nullptr) {
+			return std::make_optional(std::ref(cached->packet));
+		}
+		if (const auto changed = _changed.find(idx); changed != _changed.end()) {
+			return std::make_optional(std::ref(changed->second));
+		}
+
+		auto packet = read_packet(idx);
+		if (!packet) {
 			return std::nullopt;
 		}
 
-		packet_t::pkt_header_t header{};
-		/* extract the header */
-		switch (_header.variant()) {
-			case pcap_variant_t::Modified: {
-				if (auto hdr = _file.read<packet_header_modified_t>()) {
-					header = std::move(*hdr);
-				} else {
-					return std::nullopt;
+		std::optional<cached_packet_t> entry{};
+		try {
+			/* Views are cached as they are, they only get copied if they're written to, so the cost assumes they will be */
+			const auto sum = fingerprint(*packet);
+			entry.emplace(cached_packet_t{std::move(*packet), sum});
+			const auto cost = sizeof(cached_packet_t) + entry->packet.length();
+			auto& cached = _packet_cache.insert(idx, std::move(*entry), cost,
+				[this](const std::size_t evicted, cached_packet_t& value) { return keep_changed(evicted, value); });
+			return std::make_optional(std::ref(cached.packet));
+		} catch (const std::bad_alloc&) {
+			if (entry) {
+				packet.emplace(std::move(entry->packet));
+			}
+			/* No room to cache it, but we've already got it so it can still be handed out */
+			_uncached.emplace(std::move(*packet));
+			return std::make_optional(std::ref(*_uncached));
+		}
+	}
+
+	bool pcap_t::remove_packet(const std::size_t idx) noexcept {
+		if (idx >= _index.size()) {
+			return false;
+		}
+
+		try {
+			if (!_index.remove(idx)) {
+				return false;
+			}
+		} catch (const std::bad_alloc&) {
+			return false;
+		}
+		/* Whatever was done to it no longer matters */
+		_packet_cache.erase(idx);
+		_changed.erase(idx);
+		return true;
+	}
+
+	std::optional<packet_t> pcap_t::read_packet(std::size_t idx) const noexcept {
+		if (idx >= _index.size() || _index.removed(idx) || !_index.record_valid(idx)) {
+			return std::nullopt;
+		}
+
+		const auto pkt_hdr_len = _index.header_length();
+		const auto offset = _index.offset(idx);
+		const auto length = _index.length(idx);
+
+		if (in_memory()) {
+			if (offset + pkt_hdr_len + length > image_length()) {
+				return std::nullopt;
+			}
+
+			/* Hand out a read only view straight into the mapping or arena, no I/O and no copy */
+			return packet_t{
+				decode_packet_header(image() + offset, _header.variant(), _needs_swapping),
+				image() + offset + pkt_hdr_len,
+				length
+			};
+		}
+
+		/* Grab the header and body in one go */
+		std::array<std::uint8_t, 24> raw_header{};
+		std::optional<packet_t> packet{};
+		try {
+			packet.emplace(length);
+		} catch (const std::bad_alloc&) {
+			return std::nullopt;
+		}
+		if (lazily_decompressed()) {
+			if (!read_capture(raw_header.data(), pkt_hdr_len, off_t(offset)) ||
+				!read_capture(packet->begin(), packet->length(), off_t(offset + pkt_hdr_len))) {
+				return std::nullopt;
+			}
+		} else if (!_file.pread(raw_header.data(), pkt_hdr_len, packet->begin(), packet->length(), off_t(offset))) {
+			return std::nullopt;
+		}
+
+		packet->header() = decode_packet_header(raw_header.data(), _header.variant(), _needs_swapping);
+		return packet;
+	}
+
+	/*
+		As the records in the capture are back to back, a run of packets is
+		one contiguous range of the file, so we read the whole run in one
+		go and then walk it, moving each body down over the headers before
+		it so the data ends up packed.
+
+		The body of a record is always at or after where it needs to end
+		up, and we decode the header before moving anything, so nothing is
+		overwritten before it's been used.
+	*/
+	std::size_t pcap_t::read_batch(std::size_t first, std::size_t count, std::uint8_t *buffer, std::size_t buffer_len,
+			packet_descriptor_t *descriptors, std::size_t *const next) const noexcept {
+		first = _index.next_live(first, _index.size());
+		if (next != nullptr) {
+			*next = first;
+		}
+		if (first >= _index.size() || buffer == nullptr || descriptors == nullptr) {
+			return 0U;
+		}
+
+		const auto pkt_hdr_len = _index.header_length();
+		const auto record_end = [&](const std::size_t idx) -> std::uint64_t { return _index.record_end(idx); };
+
+		const auto start = _index.offset(first);
+
+		if (in_memory()) {
+			std::size_t used{};
+			std::size_t packets{};
+			auto idx = first;
+			for (; packets < count && idx < _index.size(); idx = _index.next_live(idx + 1U, _index.size()), ++packets) {
+				const auto offset = _index.offset(idx);
+				const auto length = _index.length(idx);
+				if (!_index.record_valid(idx) || used + length > buffer_len || record_end(idx) > image_length()) {
+					break;
 				}
-				break;
-			} case pcap_variant_t::Standard:
-			case pcap_variant_t::IXIAHW:
-			case pcap_variant_t::IXIASW:
-			case pcap_variant_t::Nanosecond:
-			default: {
-				if (auto hdr = _file.read<packet_header_t>()) {
-					header = std::move(*hdr);
-				} else {
-					return std::nullopt;
+
+				descriptors[packets] = decode_packet_descriptor(image() + offset, _header.variant(), _needs_swapping, used);
+				std::memcpy(buffer + used, image() + offset + pkt_hdr_len, length);
+				used += length;
+			}
+			if (next != nullptr) {
+				*next = idx;
+			}
+			return packets;
+		}
+
+		/* Find how many whole records fit into the buffer, removed ones are read along with the rest and dropped */
+		auto last = first;
+		std::size_t packets{};
+		while (last < _index.size() && packets < count && _index.record_valid(last) && record_end(last) - start <= buffer_len) {
+			packets += (_index.removed(last)) ? 0U : 1U;
+			++last;
+		}
+
+		if (packets == 0U || !read_capture(buffer, std::size_t(record_end(last - 1U) - start), off_t(start))) {
+			return 0U;
+		}
+
+		std::size_t used{};
+		std::size_t pkt{};
+		for (auto idx = first; idx < last; idx = _index.next_live(idx + 1U, last), ++pkt) {
+			const auto record = std::size_t(_index.offset(idx) - start);
+			const auto length = _index.length(idx);
+
+			descriptors[pkt] = decode_packet_descriptor(buffer + record, _header.variant(), _needs_swapping, used);
+			std::memmove(buffer + used, buffer + record + pkt_hdr_len, length);
+			used += length;
+		}
+
+		if (next != nullptr) {
+			*next = _index.next_live(last, _index.size());
+		}
+		return packets;
+	}
+
+	/*
+		The timestamps aren't kept while indexing as most uses of a capture
+		never search it by time, so they're pulled in here the first time.
+
+		Much like indexing, rather than a read per packet we read the capture
+		in large chunks and only go back to the file once we walk off the end
+		of the chunk.
+	*/
+	bool pcap_t::index_timestamps() noexcept {
+		if (_index.has_timestamps()) {
+			return true;
+		}
+
+		const auto record_timestamp = [this](const std::uint8_t *const record) -> std::uint64_t {
+			std::array<std::uint32_t, 2> ts{};
+			std::memcpy(ts.data(), record, sizeof(ts));
+			if (_needs_swapping) {
+				ts = {LIBNOKOGIRI_SWAP32(ts[0]), LIBNOKOGIRI_SWAP32(ts[1])};
+			}
+			return timestamp_ns(ts[0], ts[1], _header.variant());
+		};
+
+		std::vector<std::uint64_t> timestamps(_index.size());
+
+		if (in_memory()) {
+			for (std::size_t idx{}; idx < _index.size(); ++idx) {
+				if (!_index.record_valid(idx) || _index.record_end(idx) > image_length()) {
+					return false;
 				}
-				break;
+				timestamps[idx] = record_timestamp(image() + _index.offset(idx));
+			}
+		} else {
+			std::vector<std::uint8_t> buffer(index_chunk_size);
+			std::uint64_t window_base{};
+			std::size_t window_len{};
+
+			for (std::size_t idx{}; idx < _index.size(); ++idx) {
+				if (!_index.record_valid(idx)) {
+					return false;
+				}
+				const auto offset = _index.offset(idx);
+				if (offset < window_base || offset + 8U > window_base + window_len) {
+					window_len = std::size_t(std::min<std::uint64_t>(buffer.size(), _index.end() - offset));
+					if (!read_capture(buffer.data(), window_len, off_t(offset))) {
+						return false;
+					}
+					window_base = offset;
+				}
+				timestamps[idx] = record_timestamp(buffer.data() + (offset - window_base));
 			}
 		}
 
-		packet_t packet{
-			std::visit([](auto& header) -> std::size_t {
-				using T = std::decay_t<decltype(header)>;
-				if constexpr (std::is_same_v<T, packet_header_modified_t>) {
-					return header.base_header().captured_len();
-				} else if constexpr (std::is_same_v<T, packet_header_t>) {
-					return header.captured_len();
-				} else {
-					return -1U;
+		_index.timestamps(std::move(timestamps));
+		return true;
+	}
+
+	/*
+		Almost every capture is already in chronological order, so we only
+		pay for a sorted permutation of the index when it's actually needed.
+		Packets with the same timestamp keep their capture order.
+	*/
+	bool pcap_t::build_time_order() noexcept {
+		if (_time_order_built) {
+			return true;
+		}
+
+		if (!index_timestamps()) {
+			return false;
+		}
+
+		_time_sorted = true;
+		for (std::size_t idx{1U}; idx < _index.size() && _time_sorted; ++idx) {
+			_time_sorted = _index.timestamp(idx - 1U) <= _index.timestamp(idx);
+		}
+
+		if (!_time_sorted) {
+			_time_order.resize(_index.size());
+			std::iota(_time_order.begin(), _time_order.end(), std::size_t{});
+			std::stable_sort(_time_order.begin(), _time_order.end(), [this](const std::size_t a, const std::size_t b) {
+				return _index.timestamp(a) < _index.timestamp(b);
+			});
+		}
+
+		_time_order_built = true;
+		return true;
+	}
+
+	/* Returns the position in time order of the first packet at or after `timestamp` */
+	std::size_t pcap_t::time_lower_bound(const std::uint64_t timestamp) const noexcept {
+		std::size_t first{};
+		std::size_t count{_index.size()};
+
+		while (count > 0U) {
+			const auto step = count / 2U;
+			if (_index.timestamp(time_order(first + step)) < timestamp) {
+				first += step + 1U;
+				count -= step + 1U;
+			} else {
+				count = step;
+			}
+		}
+
+		return first;
+	}
+
+	std::optional<std::size_t> pcap_t::lower_bound_time(const std::uint64_t timestamp) noexcept {
+		if (!build_time_order()) {
+			return std::nullopt;
+		}
+
+		auto pos = time_lower_bound(timestamp);
+		while (pos < _index.size() && _index.removed(time_order(pos))) {
+			++pos;
+		}
+		if (pos == _index.size()) {
+			return std::nullopt;
+		}
+		return time_order(pos);
+	}
+
+	std::vector<std::size_t> pcap_t::range_by_time(const std::uint64_t begin, const std::uint64_t end) noexcept {
+		std::vector<std::size_t> packets{};
+		if (begin >= end || !build_time_order()) {
+			return packets;
+		}
+
+		const auto first = time_lower_bound(begin);
+		const auto last = time_lower_bound(end);
+		packets.reserve(last - first);
+		for (auto pos = first; pos < last; ++pos) {
+			if (!_index.removed(time_order(pos))) {
+				packets.push_back(time_order(pos));
+			}
+		}
+
+		return packets;
+	}
+
+	/*
+		write_capture() hands the capture to a sink in runs of whole records,
+		a file takes them as they come, while a seekable capture ends a record
+		after each run so frames are only ever cut between packets.
+	*/
+	namespace {
+		struct file_sink_t final {
+			libnokogiri::internal::output_t& output;
+
+			[[nodiscard]]
+			bool write(const void *const data, const std::size_t len) noexcept { return output.write(data, len); }
+			[[nodiscard]]
+			bool write(const void *const head, const std::size_t head_len, const void *const body, const std::size_t body_len) noexcept
+				{ return output.write(head, head_len, body, body_len); }
+			[[nodiscard]]
+			bool copy(const libnokogiri::internal::fd_t& from, const off_t offset, const std::uint64_t len) noexcept
+				{ return output.copy(from, offset, len); }
+			[[nodiscard]]
+			bool end_run() noexcept { return true; }
+		};
+
+		struct seekable_sink_t final {
+			libnokogiri::internal::seekable_writer_t& writer;
+			std::vector<std::uint8_t> buffer{};
+
+			[[nodiscard]]
+			bool write(const void *const data, const std::size_t len) noexcept { return writer.write(data, len); }
+			[[nodiscard]]
+			bool write(const void *const head, const std::size_t head_len, const void *const body, const std::size_t body_len) noexcept
+				{ return writer.write(head, head_len) && writer.write(body, body_len); }
+			[[nodiscard]]
+			bool copy(const libnokogiri::internal::fd_t& from, off_t offset, std::uint64_t len) noexcept {
+				buffer.resize(std::size_t(std::min<std::uint64_t>(len, index_chunk_size)));
+				while (len != 0U) {
+					const auto chunk = std::size_t(std::min<std::uint64_t>(len, buffer.size()));
+					if (!from.pread(buffer.data(), chunk, offset) || !writer.write(buffer.data(), chunk)) {
+						return false;
+					}
+					offset += off_t(chunk);
+					len -= chunk;
 				}
-			}, header),
-			std::move(header)
+				return true;
+			}
+			[[nodiscard]]
+			bool end_run() noexcept { return writer.end_record(); }
 		};
+	}
 
-		/* ingest the body */
-		// fucking broken
-		const auto ingested = _file.read(packet.address(0), packet.length());
+	/* Copies the records in [`start`, `start` + `len`) of the uncompressed capture to the sink as they are */
+	template<typename sink_t>
+	bool pcap_t::copy_records(sink_t& sink, const std::uint64_t start, const std::uint64_t len) const noexcept {
+		if (in_memory()) {
+			return start + len <= image_length() && sink.write(image() + start, std::size_t(len));
+		}
 
-		if (ingested) {
-			pkt_storage.set_packet(std::move(packet));
+		if (!lazily_decompressed()) {
+			return sink.copy(_file, off_t(start), len);
+		}
 
-			return std::make_optional(std::ref(pkt_storage.get_packet()));
+		std::vector<std::uint8_t> buffer(std::size_t(std::min<std::uint64_t>(len, index_chunk_size)));
+		for (std::uint64_t done{}; done < len;) {
+			const auto chunk = std::size_t(std::min<std::uint64_t>(len - done, buffer.size()));
+			if (!read_capture(buffer.data(), chunk, off_t(start + done)) || !sink.write(buffer.data(), chunk)) {
+				return false;
+			}
+			done += chunk;
 		}
+		return true;
+	}
 
-		return std::nullopt;
+	/*
+		Only packets that have been handed out by get_packet() can have been
+		changed, those still in the packet cache that don't match their
+		fingerprint and all of the ones set aside when they were evicted, so
+		everything between them goes across untouched. Those gaps are contiguous in the capture
+		so each one is a single copy, broken up into runs of at most
+		`run_limit` bytes on record boundaries.
+
+		Removed packets split the gaps further, each stretch of live packets
+		between them is still one copy, so pruning scattered packets costs a
+		copy per stretch and not one per packet.
+	*/
+	template<typename sink_t>
+	bool pcap_t::write_capture(sink_t& sink, const std::uint64_t run_limit, const std::size_t first, const std::size_t last,
+		const std::vector<bool> *const selected) const noexcept {
+		/* Unchanged records are copied as they are, so they have to still match the header */
+		const auto pkt_hdr_len = _index.header_length();
+		if (packet_header_length(_header.variant()) != pkt_hdr_len) {
+			return false;
+		}
+
+		std::array<std::uint8_t, file_header_length> raw_header{};
+		encode_file_header(_header, _needs_swapping, raw_header.data());
+		if (!sink.write(raw_header.data(), raw_header.size()) || !sink.end_run()) {
+			return false;
+		}
+
+		const auto kept = [&](const std::size_t idx) -> bool {
+			return !_index.removed(idx) && (selected == nullptr || (*selected)[idx]);
+		};
+		/* The first packet in [`idx`, `limit`) that is written, and the first after that which isn't */
+		const auto next_kept = [&](std::size_t idx, const std::size_t limit) -> std::size_t {
+			if (selected == nullptr) {
+				return _index.next_live(idx, limit);
+			}
+			while (idx < limit && !kept(idx)) {
+				++idx;
+			}
+			return idx;
+		};
+		const auto next_dropped = [&](std::size_t idx, const std::size_t limit) -> std::size_t {
+			if (selected == nullptr) {
+				return _index.next_removed(idx, limit);
+			}
+			while (idx < limit && kept(idx)) {
+				++idx;
+			}
+			return idx;
+		};
+
+		auto changed = _packet_cache.keys();
+		changed.erase(std::remove_if(changed.begin(), changed.end(), [&](const std::size_t idx) {
+			const auto *const cached = _packet_cache.peek(idx);
+			return idx < first || idx >= last || !kept(idx) || fingerprint(cached->packet) == cached->fingerprint;
+		}), changed.end());
+		for (auto evicted = _changed.lower_bound(first); evicted != _changed.end() && evicted->first < last; ++evicted) {
+			if (kept(evicted->first)) {
+				changed.push_back(evicted->first);
+			}
+		}
+		std::sort(changed.begin(), changed.end());
+		changed.push_back(last);
+
+		const auto offsets = _index.offsets();
+		const auto record_start = [&](const std::size_t idx) -> std::uint64_t {
+			return (idx < _index.size()) ? _index.offset(idx) : _index.end();
+		};
+
+		auto idx = first;
+		for (const auto next : changed) {
+			while ((idx = next_kept(idx, next)) < next) {
+				const auto start = _index.offset(idx);
+				const auto stretch = next_dropped(idx, next);
+				auto end = stretch;
+				if (record_start(stretch) - start > run_limit) {
+					/* As many whole records as fit, but always at least one */
+					const auto limit = std::upper_bound(offsets + idx + 1U, offsets + stretch, start + run_limit);
+					end = std::max(idx + 1U, std::size_t(limit - offsets) - 1U);
+				}
+
+				/* A borrowed index is only checked as it's used, so the run can't be allowed to go backwards or off the end */
+				const auto run_end = record_start(end);
+				if (run_end < start || run_end > _index.end() ||
+					!copy_records(sink, start, run_end - start) || !sink.end_run()) {
+					return false;
+				}
+				idx = end;
+			}
+
+			if (next == last) {
+				break;
+			}
+
+			const packet_t *packet{nullptr};
+			if (const auto *const cached = _packet_cache.peek(next); cached != nullptr) {
+				packet = &cached->packet;
+			} else if (const auto evicted = _changed.find(next); evicted != _changed.end()) {
+				packet = &evicted->second;
+			}
+			if (packet == nullptr || packet->length() > UINT32_MAX) {
+				return false;
+			}
+
+			std::array<std::uint8_t, 24> raw_packet_header{};
+			encode_packet_header(packet->header(), _header.variant(), _needs_swapping, std::uint32_t(packet->length()), raw_packet_header.data());
+			if (!sink.write(raw_packet_header.data(), pkt_hdr_len, packet->begin(), packet->length()) || !sink.end_run()) {
+				return false;
+			}
+			idx = next + 1U;
+		}
+
+		return true;
 	}
 
 	bool pcap_t::save() const noexcept {
-		if (_readonly)
+		if (_readonly || _path.empty()) {
 			return false;
+		}
 
-		if (_file.seek(0, SEEK_SET) != 0)
+		return save(_path, _compression);
+	}
+
+	bool pcap_t::save(const fs::path& file, const capture_compression_t compression) const noexcept {
+		return write_file(file, compression, 0U, _index.size(), nullptr);
+	}
+
+	bool pcap_t::extract(const fs::path& file, const std::size_t first, const std::size_t last,
+		const capture_compression_t compression) const noexcept {
+		const auto end = std::min(last, _index.size());
+		return first <= end && write_file(file, compression, first, end, nullptr);
+	}
+
+	bool pcap_t::extract(const fs::path& file, const std::function<bool(std::size_t, const packet_descriptor_t&)>& predicate,
+		const capture_compression_t compression) const noexcept {
+		std::vector<bool> selected{};
+		return predicate && select_packets(predicate, selected) && write_file(file, compression, 0U, _index.size(), &selected);
+	}
+
+	/*
+		Only the packet headers are needed to decide, so rather than reading
+		each packet we read windows of the capture that end just after the
+		last header that fits. Small packets come in many to a window, while
+		large ones end up being a read of just their header.
+	*/
+	bool pcap_t::select_packets(const std::function<bool(std::size_t, const packet_descriptor_t&)>& predicate,
+		std::vector<bool>& selected) const noexcept {
+		try {
+			selected.assign(_index.size(), false);
+		} catch (const std::bad_alloc&) {
 			return false;
+		}
 
+		const auto pkt_hdr_len = _index.header_length();
+		std::vector<std::uint8_t> buffer{};
+		std::uint64_t window_base{};
+		std::size_t window_len{};
 
+		for (auto idx = _index.next_live(0U, _index.size()); idx < _index.size(); idx = _index.next_live(idx + 1U, _index.size())) {
+			if (!_index.record_valid(idx)) {
+				return false;
+			}
+			const auto offset = _index.offset(idx);
+			const std::uint8_t *record{};
+			if (in_memory()) {
+				if (offset + pkt_hdr_len > image_length()) {
+					return false;
+				}
+				record = image() + offset;
+			} else {
+				if (offset < window_base || offset + pkt_hdr_len > window_base + window_len) {
+					if (buffer.empty()) {
+						buffer.resize(index_chunk_size);
+					}
+					auto last = idx;
+					while (last + 1U < _index.size() && _index.record_valid(last + 1U) && _index.offset(last + 1U) + pkt_hdr_len - offset <= buffer.size()) {
+						++last;
+					}
+					window_len = std::size_t(_index.offset(last) + pkt_hdr_len - offset);
+					if (!read_capture(buffer.data(), window_len, off_t(offset))) {
+						return false;
+					}
+					window_base = offset;
+				}
+				record = buffer.data() + (offset - window_base);
+			}
 
-		return {};
+			selected[idx] = predicate(idx, decode_packet_descriptor(record, _header.variant(), _needs_swapping, 0U));
+		}
+		return true;
+	}
+
+	bool pcap_t::write_file(const fs::path& file, capture_compression_t compression, const std::size_t first, const std::size_t last,
+		const std::vector<bool> *const selected) const noexcept {
+		if (compression == capture_compression_t::Autodetect) {
+			compression = _compression;
+		}
+		if (!_valid || compression == capture_compression_t::Unknown) {
+			return false;
+		}
+
+		/*
+			Write it off to the side and move it into place, if we're saving over
+			the capture it's still being read from. The name only has to not be
+			in use, so two saves to the same place don't write over each other.
+		*/
+		static std::atomic<std::uint32_t> temp_count{0U};
+		fs::path temp_path{};
+		bool written{false};
+		{
+			libnokogiri::internal::fd_t out{};
+			for (std::size_t attempt{}; !out.valid() && attempt < 64U; ++attempt) {
+				temp_path = fs::path{file} += ".tmp." + std::to_string(temp_count++);
+				out = libnokogiri::internal::fd_t{temp_path, O_WRONLY | O_CREAT | O_EXCL, libnokogiri::internal::normalMode};
+				if (!out.valid() && errno != EEXIST) {
+					break;
+				}
+			}
+			if (!out.valid()) {
+				return false;
+			}
+
+			/* Replacing a file keeps its permissions */
+			std::error_code ec{};
+			if (const auto status = fs::status(file, ec); !ec && fs::is_regular_file(status)) {
+				fs::permissions(temp_path, status.permissions(), ec);
+			}
+
+			if (is_compressed(compression)) {
+				libnokogiri::internal::seekable_writer_t writer{
+					std::move(out), compression, libnokogiri::internal::seekable_default_frame_size, 0U, std::nullopt, 0U
+				};
+				seekable_sink_t sink{writer};
+				written = writer.valid() && write_capture(sink, libnokogiri::internal::seekable_default_frame_size, first, last, selected) &&
+					writer.finish();
+			} else {
+				libnokogiri::internal::output_t output{std::move(out)};
+				file_sink_t sink{output};
+				written = write_capture(sink, UINT64_MAX, first, last, selected) && output.flush();
+			}
+		}
+
+		std::error_code ec{};
+		if (!written) {
+			fs::remove(temp_path, ec);
+			return false;
+		}
+
+		fs::rename(temp_path, file, ec);
+		if (ec) {
+			fs::remove(temp_path, ec);
+			return false;
+		}
+		return true;
 	}
 }
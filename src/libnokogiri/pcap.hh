@@ -4,20 +4,37 @@
 #define LIBNOKOGIRI_PCAP_HH
 
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 
 #include <libnokogiri/config.hh>
 #include <libnokogiri/common.hh>
 
+#include <libnokogiri/internal/cache.hh>
 #include <libnokogiri/internal/defs.hh>
 #include <libnokogiri/internal/fs.hh>
 #include <libnokogiri/internal/iterator.hh>
+#include <libnokogiri/internal/mmap.hh>
+#include <libnokogiri/internal/seekable.hh>
+#include <libnokogiri/internal/zran.hh>
 
 #include <libnokogiri/pcap/header.hh>
+#include <libnokogiri/pcap/index.hh>
+#include <libnokogiri/pcap/merge.hh>
 #include <libnokogiri/pcap/packet.hh>
+#include <libnokogiri/pcap/rotating_writer.hh>
+#include <libnokogiri/pcap/sort.hh>
+#include <libnokogiri/pcap/split.hh>
+#include <libnokogiri/pcap/stream_reader.hh>
+#include <libnokogiri/pcap/writer.hh>
 
 namespace libnokogiri::pcap {
+	struct index_sidecar_header_t;
+
+	/*! The default number of bytes of packets libnokogiri::pcap::pcap_t::get_packet() will keep around */
+	constexpr std::size_t default_packet_cache_budget{64_MiB};
 
 	/*! \struct pcap_t
 		\brief pcap file container
@@ -26,31 +43,93 @@ namespace libnokogiri::pcap {
 
 		The structure of a pcap file is a file header (pcap_header_t) followed
 		by a collection of packet header and packet data pairs. This is all optionally
-		gz compressed.
+		gzip, Zstandard, or LZ4 compressed.
 
 	*/
 	struct LIBNOKOGIRI_CLS_API pcap_t final {
-	public:
-		using iterator_t = libnokogiri::internal::bi_iterator<
-			std::optional<std::reference_wrapper<packet_t>>,
-			packet_storage_t,
-			std::vector<packet_storage_t>::iterator
-		>;
-
 	private:
 		libnokogiri::internal::fd_t _file;
+		/* Where the capture was opened from, which is where save() puts it back */
+		libnokogiri::internal::fs::path _path{};
 		capture_compression_t _compression;
 		bool _readonly;
 		bool _prefetch;
+		libnokogiri::internal::mmap_t _map{};
+		/* The index sidecar, the packet index borrows its columns straight out of this */
+		libnokogiri::internal::mmap_t _sidecar{};
+		std::unique_ptr<std::uint8_t[]> _arena{};
+		std::size_t _arena_len{0U};
+		/* Only used if a compressed capture is being decompressed lazily, _frames if it's seekable and _gzip if not */
+		std::unique_ptr<libnokogiri::internal::seekable_reader_t> _frames{};
+		std::unique_ptr<libnokogiri::internal::gzip_index_t> _gzip{};
 		file_header_t _header{};
 
 		bool _valid{false};
 		bool _needs_swapping{false};
 
-		std::vector<packet_storage_t> _packets;
+		/* A packet handed out by get_packet() and a checksum of it as it was read, so changes made to it can be spotted */
+		struct cached_packet_t final {
+			packet_t packet;
+			std::uint32_t fingerprint;
+		};
+
+		packet_index_t _index{};
+		/* Packets that have been handed out by get_packet(), kept apart from the index */
+		libnokogiri::internal::lru_cache_t<std::size_t, cached_packet_t> _packet_cache{default_packet_cache_budget};
+		/* Packets that were changed and then evicted from the cache, these are needed to save so aren't bound by the budget */
+		std::map<std::size_t, packet_t> _changed{};
+		/* The last packet get_packet() couldn't cache for want of memory */
+		std::optional<packet_t> _uncached{};
+
+		/* Lazily built the first time the capture is searched by time */
+		bool _time_order_built{false};
+		bool _time_sorted{true};
+		std::vector<std::size_t> _time_order{};
 
 		bool read_header() noexcept;
+		bool prefetch_capture() noexcept;
 		bool ingest_packets() noexcept;
+		template<typename source_t>
+		bool index_stream(source_t& source, std::uintptr_t base) noexcept;
+		bool load_index(const libnokogiri::internal::fs::path& sidecar_path, const index_sidecar_header_t& expected) noexcept;
+		bool write_index(const libnokogiri::internal::fs::path& sidecar_path, const index_sidecar_header_t& header) const noexcept;
+		bool index_timestamps() noexcept;
+		bool build_time_order() noexcept;
+		[[nodiscard]]
+		std::uint32_t fingerprint(const packet_t& packet) const noexcept;
+		[[nodiscard]]
+		bool keep_changed(std::size_t idx, cached_packet_t& cached) noexcept;
+		template<typename sink_t>
+		bool write_capture(sink_t& sink, std::uint64_t run_limit, std::size_t first, std::size_t last,
+			const std::vector<bool> *selected) const noexcept;
+		bool write_file(const libnokogiri::internal::fs::path& file, capture_compression_t compression, std::size_t first,
+			std::size_t last, const std::vector<bool> *selected) const noexcept;
+		bool select_packets(const std::function<bool(std::size_t, const packet_descriptor_t&)>& predicate,
+			std::vector<bool>& selected) const noexcept;
+		template<typename sink_t>
+		bool copy_records(sink_t& sink, std::uint64_t start, std::uint64_t len) const noexcept;
+
+		/* Maps a position in time order to a packet index */
+		[[nodiscard]]
+		std::size_t time_order(const std::size_t pos) const noexcept { return (_time_sorted) ? pos : _time_order[pos]; }
+		[[nodiscard]]
+		std::size_t time_lower_bound(const std::uint64_t timestamp) const noexcept;
+
+		/* The in-memory image of the capture, be it mapped or prefetched */
+		[[nodiscard]]
+		const std::uint8_t *image() const noexcept { return (_map.valid()) ? _map.data() : _arena.get(); }
+		[[nodiscard]]
+		std::size_t image_length() const noexcept { return (_map.valid()) ? _map.length() : _arena_len; }
+		std::size_t index_records(const std::uint8_t *const data, const std::size_t len, const std::uintptr_t base) noexcept;
+
+		/* Read from the uncompressed capture, wherever it happens to be */
+		[[nodiscard]]
+		bool read_capture(void *const buffer, const std::size_t len, const off_t offset) const noexcept {
+			if (_frames) {
+				return _frames->pread(buffer, len, offset);
+			}
+			return (_gzip) ? _gzip->pread(buffer, len, offset) : _file.pread(buffer, len, offset);
+		}
 	public:
 		constexpr pcap_t() = delete;
 
@@ -59,15 +138,19 @@ namespace libnokogiri::pcap {
 			\param file The path to the pcap file
 			\param compression The compression mode for the pcap file
 			\param read_only Open the pcap file in read only
-			\param prefetch Rather than initially building a packet index and then doing I/O to get each packet, ingest all packets at once, this trades memory usage for speed
+			\param prefetch Rather than initially building a packet index and then doing I/O to get each packet, read the whole capture into memory at once and hand out packets that are views into it, this trades memory usage for speed
+			\param memory_map Map the capture into memory and hand out packets that are views into the mapping rather than copies, this takes precedence over `prefetch`
+			\param use_index Keep the packet index in a sidecar file next to the capture (`<file>.nkidx`), it is written the first time the capture is opened and reused on every open after that until the capture changes
+			\param lazy_decompress Rather than decompressing a compressed capture up front, keep checkpoints into the compressed data and only decompress the parts that packets are read from, this only applies to read only captures and takes precedence over `prefetch` and `memory_map`. Seekable captures, see libnokogiri::internal::seekable_writer_t, already say where each frame is so this works for any compression, otherwise it only applies to gzip, and with `use_index` the checkpoints are kept in the sidecar so reopening the capture doesn't need to decompress it at all
 		*/
-		pcap_t(libnokogiri::internal::fs::path& file, capture_compression_t compression, bool read_only, bool prefetch = false) noexcept;
+		pcap_t(libnokogiri::internal::fs::path& file, capture_compression_t compression, bool read_only, bool prefetch = false,
+			bool memory_map = false, bool use_index = false, bool lazy_decompress = false) noexcept;
 
 		pcap_t(const pcap_t&) = delete;
 		pcap_t& operator=(const pcap_t&) = delete;
 
 		pcap_t(pcap_t&& capture) noexcept :
-			_file{},_compression{}, _readonly{true}
+			_file{},_compression{}, _readonly{true}, _prefetch{false}
 			{ swap(capture); }
 		void operator=(pcap_t&& capture) noexcept { swap(capture); }
 
@@ -76,6 +159,8 @@ namespace libnokogiri::pcap {
 
 		[[nodiscard]]
 		file_header_t& header() noexcept { return _header; }
+		[[nodiscard]]
+		const file_header_t& header() const noexcept { return _header; }
 		void header(file_header_t&& header) noexcept { _header = std::move(header); }
 
 		[[nodiscard]]
@@ -84,42 +169,293 @@ namespace libnokogiri::pcap {
 		[[nodiscard]]
 		bool valid() const noexcept { return _valid; }
 
+		/*! Check if the capture is being accessed through a memory mapping */
+		[[nodiscard]]
+		bool memory_mapped() const noexcept { return _map.valid(); }
+
+		/*! Check if the capture is compressed and being decompressed as packets are read */
+		[[nodiscard]]
+		bool lazily_decompressed() const noexcept { return _frames != nullptr || _gzip != nullptr; }
+
+		/*! Check if the whole capture is in memory, either mapped or prefetched */
+		[[nodiscard]]
+		bool in_memory() const noexcept { return _map.valid() || _arena != nullptr; }
+
+		/*! Retrieve the number of packets in the capture, not counting any that have been removed */
+		[[nodiscard]]
+		std::size_t packet_count() const noexcept { return _index.live(); }
+
+		/*! \brief Retrieve one past the largest packet index
+
+			Packets keep their index when others are removed, so once anything
+			has been removed this is larger than packet_count().
+		*/
 		[[nodiscard]]
-		std::size_t packet_count() const noexcept { return _packets.size(); }
+		std::size_t index_size() const noexcept { return _index.size(); }
+
+		/*! \brief Write the capture back to where it was opened from
 
+			This is save() to the same file, in the same compression, and the
+			capture has to have been opened read/write.
+		*/
 		[[nodiscard]]
 		bool save() const noexcept;
 
+		/*! \brief Write the capture out to a file
+
+			The file header and every packet that hasn't been removed are written
+			out, with any packets that were changed after get_packet() handed them
+			out written as they are now, so changes made to them are kept. Every other packet is
+			copied across as is, in runs that are as long as possible, and where
+			both are plain files the kernel does the copying. The packets are written in the byte order the
+			capture was in.
+
+			The capture is written to a temporary file next to `file` that is moved
+			into place once it's complete, so saving over the capture itself is fine
+			and this capture carries on reading from what it was opened from. When
+			`file` already exists it keeps its permissions.
+
+			Compressed captures are written as seekable captures, see
+			libnokogiri::internal::seekable_writer_t, and are compressed on as many
+			threads as there are cores.
+
+			\param file Where to write the capture
+			\param compression How to compress it, libnokogiri::capture_compression_t::Autodetect keeps the compression of this capture
+		*/
+		[[nodiscard]]
+		bool save(const libnokogiri::internal::fs::path& file, capture_compression_t compression = capture_compression_t::Autodetect) const noexcept;
+
+		/*! \brief Write the packets in the half-open index range [`first`, `last`) out to a new capture
+
+			This is save() for part of the capture, it gets the same file header
+			and runs of packets next to each other are copied across in one go,
+			inside the kernel where both are plain files, so slicing even a very
+			large capture never reads the packets it copies. Removed packets are
+			left out.
+
+			\param file Where to write the capture
+			\param first The index of the first packet to write
+			\param last One past the index of the last packet to write, this is clamped to index_size()
+			\param compression How to compress it, libnokogiri::capture_compression_t::Autodetect keeps the compression of this capture
+		*/
+		[[nodiscard]]
+		bool extract(const libnokogiri::internal::fs::path& file, std::size_t first, std::size_t last,
+			capture_compression_t compression = capture_compression_t::Autodetect) const noexcept;
+
+		/*! \brief Write the packets a predicate picks out to a new capture
+
+			Like the range form of extract(), but the packets that are written are
+			those `predicate` returns true for. It is given the index and a
+			descriptor of each packet, with everything but the packet data, so
+			only the packet headers are read to decide, and the descriptor's data
+			offset is always 0. Packets the predicate picks that are next to each
+			other are still copied across in one go.
+
+			\param file Where to write the capture
+			\param predicate Called once for each packet that hasn't been removed, in order, to decide if it's written
+			\param compression How to compress it, libnokogiri::capture_compression_t::Autodetect keeps the compression of this capture
+		*/
+		[[nodiscard]]
+		bool extract(const libnokogiri::internal::fs::path& file, const std::function<bool(std::size_t, const packet_descriptor_t&)>& predicate,
+			capture_compression_t compression = capture_compression_t::Autodetect) const noexcept;
+
 		void swap(pcap_t& desc) noexcept {
 			std::swap(_file, desc._file);
+			std::swap(_path, desc._path);
 			std::swap(_compression, desc._compression);
 			std::swap(_readonly, desc._readonly);
+			std::swap(_prefetch, desc._prefetch);
+			std::swap(_map, desc._map);
+			std::swap(_arena, desc._arena);
+			std::swap(_arena_len, desc._arena_len);
+			std::swap(_frames, desc._frames);
+			std::swap(_gzip, desc._gzip);
 			std::swap(_header, desc._header);
 			std::swap(_valid, desc._valid);
+			std::swap(_needs_swapping, desc._needs_swapping);
+			std::swap(_index, desc._index);
+			std::swap(_packet_cache, desc._packet_cache);
+			std::swap(_changed, desc._changed);
+			std::swap(_uncached, desc._uncached);
+			std::swap(_time_order_built, desc._time_order_built);
+			std::swap(_time_sorted, desc._time_sorted);
+			std::swap(_time_order, desc._time_order);
 		}
 
+		/*! \brief Remove a packet from the capture
 
-		void remove_packet(std::size_t index) noexcept {  }
+			The packet is only marked as removed, so this takes constant time and
+			every other packet keeps its index. Removed packets can't be read, and
+			are skipped by begin() and end() and when searching by time, while
+			indexed_packets() still goes by index and gives std::nullopt for them.
+			They're left out when the capture is saved, at which point the packets
+			either side of them are copied across as single runs.
 
-		std::optional<std::reference_wrapper<packet_t>> get_packet(std::size_t idx) noexcept {
-			if (idx <= _packets.size()) {
-				return get_packet(std::ref(_packets[idx]));
-			}
-			return std::nullopt;
-		}
+			\param idx The index of the packet to remove
+			\returns If the packet was removed, false if it doesn't exist or was already removed
+		*/
+		bool remove_packet(std::size_t idx) noexcept;
 
-		std::optional<std::reference_wrapper<packet_t>> get_packet(packet_storage_t& pkt_storage) noexcept;
+		/*! Check if the packet at `idx` has been removed */
+		[[nodiscard]]
+		bool packet_removed(const std::size_t idx) const noexcept { return _index.removed(idx); }
 
-		iterator_t begin() noexcept {
-			return iterator_t([this](packet_storage_t& pkt_storage) -> std::optional<std::reference_wrapper<packet_t>> {
-				return get_packet(pkt_storage);
-			}, _packets.begin(), _packets.end(), true);
-		}
+		/*! Retrieve the index of the packet at `pos` when counting only packets that haven't been removed, or index_size() if there isn't one */
+		[[nodiscard]]
+		std::size_t live_packet_index(const std::size_t pos) const noexcept { return _index.live_index(pos); }
+
+		/*! \brief Get a packet from the capture
+
+			Packets are cached once read, so getting the same packet again is cheap and
+			any changes made to it are kept. The cache is bounded by cache_budget(),
+			once it's over budget the least recently used packets are dropped, so the
+			returned reference is only guaranteed to be valid until the next call.
+			Packets that were changed aren't dropped but set aside until the capture
+			is gone, so however many are changed they're all saved, and they don't
+			count towards the budget. If there isn't the memory to cache the packet
+			it's handed out anyway, but isn't kept past the next call.
+
+			For a capture that is mapped or prefetched the packet starts out as a view
+			into the image, so getting it costs no copy, its data is only copied the
+			first time it's accessed mutably.
+
+			\param idx The index of the packet to get
+		*/
+		std::optional<std::reference_wrapper<packet_t>> get_packet(std::size_t idx) noexcept;
+
+		/*! Retrieve how many bytes of packets get_packet() may keep cached */
+		[[nodiscard]]
+		std::size_t cache_budget() const noexcept { return _packet_cache.budget(); }
+		/*! Set how many bytes of packets get_packet() may keep cached, this evicts packets if needed */
+		void cache_budget(std::size_t budget) noexcept;
+
+		/*! Retrieve how many bytes of packets are currently cached */
+		[[nodiscard]]
+		std::size_t cache_usage() const noexcept { return _packet_cache.used(); }
+
+		/*! Drop every cached packet, bar any that were changed */
+		void clear_cache() noexcept;
+
+		/*! \brief Check if the packets in the capture are in chronological order
+
+			Captures that aren't are still searchable by time, but the first search
+			has to sort an index of the packets by time, which takes memory.
+		*/
+		[[nodiscard]]
+		bool time_sorted() noexcept { return build_time_order() && _time_sorted; }
+
+		/*! \brief Find the first packet captured at or after the given time
+
+			This is a binary search over the timestamps in the packet index, the first
+			search reads the timestamp of every packet but no packet data is read.
+
+			Removed packets are never returned.
+
+			\param timestamp The time in nanoseconds since the epoch
+			\returns The index of the packet, or std::nullopt if every packet is older than `timestamp`
+		*/
+		[[nodiscard]]
+		std::optional<std::size_t> lower_bound_time(const std::uint64_t timestamp) noexcept;
+
+		/*! \brief Find all of the packets captured in the half-open time range [`begin`, `end`)
+
+			\param begin The start of the range in nanoseconds since the epoch
+			\param end The end of the range in nanoseconds since the epoch
+			\returns The indices of the matching packets in chronological order, leaving out any that have been removed
+		*/
+		[[nodiscard]]
+		std::vector<std::size_t> range_by_time(const std::uint64_t begin, const std::uint64_t end) noexcept;
 
-		iterator_t end() noexcept {
-			return iterator_t([this](packet_storage_t& pkt_storage) -> std::optional<std::reference_wrapper<packet_t>> {
-				return get_packet(pkt_storage);
-			}, _packets.begin(), _packets.end(), false);
+		/*! \brief Read a packet without touching any shared state
+
+			Unlike get_packet() this neither moves the file position nor caches the
+			packet, it uses positional reads, so any number of threads can call it
+			on the same capture at once without any locking. The packet is owned by
+			the caller, unless the capture is in memory in which case it is a view
+			into the capture that must not be written to. A mapped capture is
+			mapped read only, so writing to such a view faults rather than changing
+			the packet under every other reader, get_packet() hands out a copy that
+			can be changed.
+
+			It is only safe so long as nothing is modifying the capture at the same time.
+
+			\param idx The index of the packet to read
+		*/
+		[[nodiscard]]
+		std::optional<packet_t> read_packet(std::size_t idx) const noexcept;
+
+		/*! \brief Read a run of packets into a caller supplied buffer
+
+			The data of each packet is packed back to back into `buffer`, and a
+			descriptor with the header and the offset of the data in `buffer` is
+			written to `descriptors` for each packet.
+
+			Packets are read in as few I/O calls as possible, typically only one.
+			The packet headers are read into `buffer` along with the packet data
+			and compacted out afterwards, so it needs to be large enough to hold the
+			packet headers as well.
+
+			Like read_packet() this doesn't touch any shared state and can be called
+			from any number of threads at once.
+
+			Removed packets are skipped, so once anything has been removed the
+			packets read aren't necessarily `first` onwards one after the other,
+			use `next` to find where to carry on from.
+
+			\param first The index of the first packet to read
+			\param count The maximum number of packets to read, `descriptors` must have room for this many
+			\param buffer The buffer to read the packet data into
+			\param buffer_len The size of `buffer`
+			\param descriptors Where to write the descriptor for each packet
+			\param next If not null, where to store the index of the packet after the last one read
+			\returns The number of packets that were read, this will be less than `count` if the capture or buffer
+			runs out first, and zero if `first` is past the end of the capture or there was an I/O error
+		*/
+		[[nodiscard]]
+		std::size_t read_batch(std::size_t first, std::size_t count, std::uint8_t *buffer, std::size_t buffer_len,
+			packet_descriptor_t *descriptors, std::size_t *next = nullptr) const noexcept;
+
+		/*! Iterates over the packets that haven't been removed through get_packet() */
+		using iterator_t = libnokogiri::internal::index_iterator<
+			pcap_t, std::optional<std::reference_wrapper<packet_t>>, &pcap_t::get_packet, &pcap_t::live_packet_index
+		>;
+		/*! Iterates over the packets that haven't been removed through read_packet(), so it is safe to use from multiple threads */
+		using const_iterator_t = libnokogiri::internal::index_iterator<
+			const pcap_t, std::optional<packet_t>, &pcap_t::read_packet, &pcap_t::live_packet_index
+		>;
+		/*! Iterates over every packet index through get_packet(), removed packets come out as std::nullopt */
+		using indexed_iterator_t = libnokogiri::internal::index_iterator<
+			pcap_t, std::optional<std::reference_wrapper<packet_t>>, &pcap_t::get_packet
+		>;
+		/*! Iterates over every packet index through read_packet(), removed packets come out as std::nullopt */
+		using const_indexed_iterator_t = libnokogiri::internal::index_iterator<
+			const pcap_t, std::optional<packet_t>, &pcap_t::read_packet
+		>;
+
+		[[nodiscard]]
+		iterator_t begin() noexcept { return {this, 0U}; }
+		[[nodiscard]]
+		iterator_t end() noexcept { return {this, _index.live()}; }
+
+		[[nodiscard]]
+		const_iterator_t begin() const noexcept { return {this, 0U}; }
+		[[nodiscard]]
+		const_iterator_t end() const noexcept { return {this, _index.live()}; }
+
+		[[nodiscard]]
+		const_iterator_t cbegin() const noexcept { return {this, 0U}; }
+		[[nodiscard]]
+		const_iterator_t cend() const noexcept { return {this, _index.live()}; }
+
+		/*! Retrieve every packet index in order, including removed packets, to iterate over through get_packet() */
+		[[nodiscard]]
+		libnokogiri::internal::index_range<indexed_iterator_t> indexed_packets() noexcept {
+			return {{this, 0U}, {this, _index.size()}};
+		}
+		/*! Retrieve every packet index in order, including removed packets, to iterate over through read_packet() */
+		[[nodiscard]]
+		libnokogiri::internal::index_range<const_indexed_iterator_t> indexed_packets() const noexcept {
+			return {{this, 0U}, {this, _index.size()}};
 		}
 	};
 
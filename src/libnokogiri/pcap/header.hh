@@ -4,6 +4,7 @@
 #define LIBNOKOGIRI_PCAP_HEADER_HH
 
 #include <cstdint>
+#include <cstring>
 #include <array>
 #include <string_view>
 
@@ -146,6 +147,93 @@ namespace libnokogiri::pcap {
 		/*! Set the link type for the packets that this pcap file contain. */
 		void link_type(const link_type_t type) noexcept { _network = type; }
 	};
+
+	/*! The size of the pcap file header as it is on disk */
+	constexpr std::size_t file_header_length{24U};
+
+	/*! \brief Decode an on-disk pcap file header
+
+		\param data The raw file header, must be at least libnokogiri::pcap::file_header_length bytes
+		\param header The header to fill in, the variant is always stored unswapped
+		\param needs_swapping Set if the capture was written with the opposite byte order to ours
+		\returns false if the magic number is not one we know about
+	*/
+	[[nodiscard]]
+	inline bool decode_file_header(const std::uint8_t *const data, file_header_t& header, bool& needs_swapping) noexcept {
+		std::uint32_t magic{};
+		std::memcpy(&magic, data, sizeof(magic));
+
+		const auto pcap_magic{static_cast<pcap_variant_t>(magic)};
+		switch (pcap_magic) {
+			case pcap_variant_t::Standard:
+			case pcap_variant_t::Modified:
+			case pcap_variant_t::IXIAHW:
+			case pcap_variant_t::IXIASW:
+			case pcap_variant_t::Nanosecond: {
+				/* Swapping is disabled by default, no need to do so */
+				needs_swapping = false;
+				header.variant(pcap_magic);
+				break;
+			}
+			case pcap_variant_t::SwappedStandard:
+			case pcap_variant_t::SwappedModified:
+			case pcap_variant_t::SwappedIXIAHW:
+			case pcap_variant_t::SwappedIXIASW:
+			case pcap_variant_t::SwappedNanosecond: {
+				/* We need to swap all the things when reading */
+				needs_swapping = true;
+				header.variant(static_cast<pcap_variant_t>(LIBNOKOGIRI_SWAP32(magic)));
+				break;
+			} default : {
+				/* Unknown file, bail */
+				return false;
+			}
+		}
+
+		const auto read_u16 = [&](const std::size_t offset) -> std::uint16_t {
+			std::uint16_t value{};
+			std::memcpy(&value, data + offset, sizeof(value));
+			return (needs_swapping) ? LIBNOKOGIRI_SWAP16(value) : value;
+		};
+		const auto read_u32 = [&](const std::size_t offset) -> std::uint32_t {
+			std::uint32_t value{};
+			std::memcpy(&value, data + offset, sizeof(value));
+			return (needs_swapping) ? LIBNOKOGIRI_SWAP32(value) : value;
+		};
+
+		header.version(version_t{read_u16(4U), read_u16(6U)});
+		header.timezone_offset(static_cast<std::int32_t>(read_u32(8U)));
+		header.timestamp_accuracy(read_u32(12U));
+		header.max_packet_length(read_u32(16U));
+		header.link_type(static_cast<link_type_t>(read_u32(20U)));
+
+		return true;
+	}
+
+	/*! \brief Encode a pcap file header as it is on disk
+
+		\param header The header to encode
+		\param needs_swapping Write it in the opposite byte order to ours, so it matches a capture that was
+		\param data Where to put it, must be at least libnokogiri::pcap::file_header_length bytes
+	*/
+	inline void encode_file_header(const file_header_t& header, const bool needs_swapping, std::uint8_t *const data) noexcept {
+		const auto write_u16 = [&](const std::size_t offset, const std::uint16_t value) {
+			const std::uint16_t raw = (needs_swapping) ? LIBNOKOGIRI_SWAP16(value) : value;
+			std::memcpy(data + offset, &raw, sizeof(raw));
+		};
+		const auto write_u32 = [&](const std::size_t offset, const std::uint32_t value) {
+			const std::uint32_t raw = (needs_swapping) ? LIBNOKOGIRI_SWAP32(value) : value;
+			std::memcpy(data + offset, &raw, sizeof(raw));
+		};
+
+		write_u32(0U, static_cast<std::uint32_t>(header.variant()));
+		write_u16(4U, std::uint16_t(header.version().major_version()));
+		write_u16(6U, std::uint16_t(header.version().minor_version()));
+		write_u32(8U, static_cast<std::uint32_t>(header.timezone_offset()));
+		write_u32(12U, header.timestamp_accuracy());
+		write_u32(16U, header.max_packet_length());
+		write_u32(20U, static_cast<std::uint32_t>(header.link_type()));
+	}
 }
 
 #endif /* LIBNOKOGIRI_PCAP_HEADER_HH */
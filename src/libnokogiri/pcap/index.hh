@@ -0,0 +1,265 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/index.hh - libnokogiri pcap packet index */
+#if !defined(LIBNOKOGIRI_PCAP_INDEX_HH)
+#define LIBNOKOGIRI_PCAP_INDEX_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+
+namespace libnokogiri::pcap {
+	/*! \struct libnokogiri::pcap::packet_index_t
+		\brief Compact index of the packet records in a pcap file
+
+		The index is stored as columns rather than as one structure per packet,
+		and the only column that is always present is the file offset of each
+		packet record, so it costs 8 bytes per packet.
+
+		The records in a pcap file are back to back, so the length of a packet
+		is the distance to the start of the next record less the size of the
+		packet header, with the end of the last record stored separately.
+
+		The capture timestamps are only needed to search by time, so they are
+		a column of their own that is filled in on demand.
+
+		Removing a packet only marks it as removed in a bit per packet column,
+		which is allocated the first time anything is removed, so nothing is
+		shifted and every other packet keeps its index. Alongside that is the
+		count of packets removed before the start of each block of the column,
+		so finding the n-th packet that is left, see live_index(), is a binary
+		search over the blocks and a scan of one block rather than of the whole
+		column.
+
+		The offset and timestamp columns can also be borrowed from memory owned
+		by something else, such as a mapped index sidecar, in which case they're
+		only checked as each record is used, see record_valid().
+	*/
+	struct packet_index_t final {
+	private:
+		std::vector<std::uint64_t> _offsets{};
+		std::vector<std::uint64_t> _timestamps{};
+		/* Columns borrowed with borrow(), these are used in place of the vectors when set */
+		const std::uint64_t *_borrowed_offsets{nullptr};
+		const std::uint64_t *_borrowed_timestamps{nullptr};
+		std::size_t _borrowed_count{0U};
+		std::vector<bool> _removed{};
+		/* The number of packets removed before the start of each block of `removed_block` packets */
+		std::vector<std::size_t> _removed_before{};
+		std::size_t _removed_count{0U};
+		std::uint64_t _end{0U};
+		std::uint32_t _header_length{0U};
+
+		static constexpr std::size_t removed_block{512U};
+	public:
+		packet_index_t() noexcept = default;
+
+		packet_index_t(const std::uint32_t header_length) noexcept :
+			_header_length{header_length} { /* NOP */ }
+
+		packet_index_t(const packet_index_t&) = delete;
+		packet_index_t& operator=(const packet_index_t&) = delete;
+
+		packet_index_t(packet_index_t&&) = default;
+		packet_index_t& operator=(packet_index_t&&) = default;
+
+		/*! The number of packets in the index */
+		[[nodiscard]]
+		std::size_t size() const noexcept { return (_borrowed_offsets != nullptr) ? _borrowed_count : _offsets.size(); }
+		[[nodiscard]]
+		bool empty() const noexcept { return size() == 0U; }
+
+		void clear() noexcept {
+			_offsets.clear();
+			_timestamps.clear();
+			_borrowed_offsets = nullptr;
+			_borrowed_timestamps = nullptr;
+			_borrowed_count = 0U;
+			_removed.clear();
+			_removed_before.clear();
+			_removed_count = 0U;
+			_end = 0U;
+		}
+
+		void reserve(const std::size_t count) { _offsets.reserve(count); }
+
+		/*! Add a packet record, this must be after every record already in the index, which must not be borrowed */
+		void push_back(const std::uint64_t offset) { _offsets.push_back(offset); }
+
+		/*! \brief Use columns that live in memory owned by something else
+
+			The memory must outlive the index or last until clear() is called,
+			`timestamps` may be nullptr if there is no timestamp column.
+		*/
+		void borrow(const std::uint64_t *const offsets, const std::uint64_t *const timestamps, const std::size_t count) noexcept {
+			clear();
+			_borrowed_offsets = offsets;
+			_borrowed_timestamps = timestamps;
+			_borrowed_count = count;
+		}
+
+		/*! Retrieve the size of the on-disk packet header */
+		[[nodiscard]]
+		std::uint32_t header_length() const noexcept { return _header_length; }
+
+		/*! Retrieve the file offset of the end of the last packet record */
+		[[nodiscard]]
+		std::uint64_t end() const noexcept { return _end; }
+		/*! Set the file offset of the end of the last packet record */
+		void end(const std::uint64_t end) noexcept { _end = end; }
+
+		/*! Retrieve the file offset of the packet record at `idx` */
+		[[nodiscard]]
+		std::uint64_t offset(const std::size_t idx) const noexcept { return offsets()[idx]; }
+
+		/*! Retrieve the file offset of the end of the packet record at `idx` */
+		[[nodiscard]]
+		std::uint64_t record_end(const std::size_t idx) const noexcept { return (idx + 1U < size()) ? offset(idx + 1U) : _end; }
+
+		/*! \brief Check that the packet record at `idx` is somewhere it could be
+
+			The record has to be long enough for a packet header and end before
+			both the next record and the end of the records. An index that was
+			built by scanning the capture always passes this, but borrowed columns
+			aren't checked up front, so anything that uses them checks as it goes.
+		*/
+		[[nodiscard]]
+		bool record_valid(const std::size_t idx) const noexcept {
+			if (idx >= size()) {
+				return false;
+			}
+			const auto start = offset(idx);
+			const auto next = record_end(idx);
+			return next <= _end && start <= next && next - start >= _header_length && next - start - _header_length <= UINT32_MAX;
+		}
+
+		/*! Retrieve the captured length of the packet at `idx`, not including the packet header, or 0 if the record isn't valid */
+		[[nodiscard]]
+		std::uint32_t length(const std::size_t idx) const noexcept {
+			if (!record_valid(idx)) {
+				return 0U;
+			}
+			return std::uint32_t(record_end(idx) - offset(idx) - _header_length);
+		}
+
+		/*! The number of packets in the index that haven't been removed */
+		[[nodiscard]]
+		std::size_t live() const noexcept { return size() - _removed_count; }
+
+		/*! The number of packets that have been removed */
+		[[nodiscard]]
+		std::size_t removed_count() const noexcept { return _removed_count; }
+
+		/*! Check if the packet at `idx` has been removed */
+		[[nodiscard]]
+		bool removed(const std::size_t idx) const noexcept { return _removed_count != 0U && idx < _removed.size() && _removed[idx]; }
+
+		/*! Mark the packet at `idx` as removed, returns false if it already was */
+		bool remove(const std::size_t idx) {
+			if (_removed.empty()) {
+				_removed_before.resize((size() + removed_block - 1U) / removed_block);
+				_removed.resize(size());
+			}
+			if (_removed[idx]) {
+				return false;
+			}
+			_removed[idx] = true;
+			++_removed_count;
+			for (auto block = idx / removed_block + 1U; block < _removed_before.size(); ++block) {
+				++_removed_before[block];
+			}
+			return true;
+		}
+
+		/*! \brief Find the packet that is `pos` packets after the first one that hasn't been removed
+
+			\param pos The position among the packets that haven't been removed
+			\returns The index of the packet, or size() if fewer than `pos + 1` packets haven't been removed
+		*/
+		[[nodiscard]]
+		std::size_t live_index(const std::size_t pos) const noexcept {
+			if (_removed_count == 0U) {
+				return std::min(pos, size());
+			}
+			if (pos >= live()) {
+				return size();
+			}
+
+			/* Find the last block with no more than `pos` packets left before it */
+			std::size_t block{0U};
+			for (auto count = _removed_before.size(); count != 0U;) {
+				const auto step = count / 2U;
+				const auto mid = block + step;
+				if (mid * removed_block - _removed_before[mid] <= pos) {
+					block = mid + 1U;
+					count -= step + 1U;
+				} else {
+					count = step;
+				}
+			}
+			--block;
+
+			auto idx = block * removed_block;
+			for (auto seen = idx - _removed_before[block];; ++idx) {
+				if (!_removed[idx]) {
+					if (seen == pos) {
+						return idx;
+					}
+					++seen;
+				}
+			}
+		}
+
+		/*! Find the first packet in [`first`, `last`) that has been removed, or `last` if none have */
+		[[nodiscard]]
+		std::size_t next_removed(std::size_t first, const std::size_t last) const noexcept {
+			if (_removed_count == 0U) {
+				return last;
+			}
+			while (first < last && !_removed[first]) {
+				++first;
+			}
+			return first;
+		}
+
+		/*! Find the first packet in [`first`, `last`) that hasn't been removed, or `last` if they all have */
+		[[nodiscard]]
+		std::size_t next_live(std::size_t first, const std::size_t last) const noexcept {
+			if (_removed_count == 0U) {
+				return std::min(first, last);
+			}
+			while (first < last && _removed[first]) {
+				++first;
+			}
+			return std::min(first, last);
+		}
+
+		/*! Retrieve the whole offset column, it has size() entries */
+		[[nodiscard]]
+		const std::uint64_t *offsets() const noexcept { return (_borrowed_offsets != nullptr) ? _borrowed_offsets : _offsets.data(); }
+
+		/*! Check if the timestamp column has been filled in */
+		[[nodiscard]]
+		bool has_timestamps() const noexcept { return _borrowed_timestamps != nullptr || _timestamps.size() == size(); }
+
+		/*! Retrieve the time the packet at `idx` was captured in nanoseconds since the epoch */
+		[[nodiscard]]
+		std::uint64_t timestamp(const std::size_t idx) const noexcept { return timestamps()[idx]; }
+
+		/*! Retrieve the whole timestamp column, it has size() entries once it has been filled in */
+		[[nodiscard]]
+		const std::uint64_t *timestamps() const noexcept { return (_borrowed_timestamps != nullptr) ? _borrowed_timestamps : _timestamps.data(); }
+
+		/*! Set the timestamp column, it must have an entry for every packet */
+		void timestamps(std::vector<std::uint64_t>&& timestamps) noexcept {
+			_timestamps = std::move(timestamps);
+			_borrowed_timestamps = nullptr;
+		}
+	};
+}
+
+#endif /* LIBNOKOGIRI_PCAP_INDEX_HH */
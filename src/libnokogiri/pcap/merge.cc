@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/merge.cc - libnokogiri time ordered merging of pcap files */
+
+#include <algorithm>
+#include <new>
+#include <optional>
+#include <type_traits>
+
+#include <libnokogiri/pcap.hh>
+#include <libnokogiri/pcap/merge.hh>
+
+namespace fs = libnokogiri::internal::fs;
+
+namespace libnokogiri::pcap {
+	namespace {
+		/* The packet an input has up next, it points into the input's own buffer */
+		struct merge_head_t final {
+			std::uint64_t timestamp;
+			const std::uint8_t *data;
+			std::uint32_t captured_len;
+			std::uint32_t actual_len;
+			std::uint32_t if_index;
+			std::uint16_t protocol;
+			std::uint8_t type;
+		};
+
+		/*
+			An input is either a stream reader, which hands out one packet at a
+			time out of its own buffer, or a capture we read batches out of into
+			a buffer of our own. Either way `head` is only valid until advance().
+		*/
+		struct merge_input_t final {
+			stream_reader_t *stream{nullptr};
+			const pcap_t *capture{nullptr};
+			pcap_variant_t variant{};
+
+			std::optional<packet_t> packet{};
+			std::vector<std::uint8_t> buffer{};
+			std::vector<packet_descriptor_t> descriptors{};
+			std::size_t batch_count{0U};
+			std::size_t batch_pos{0U};
+			std::size_t next_index{0U};
+
+			merge_head_t head{};
+
+			[[nodiscard]]
+			merge_head_t from_packet(const packet_t& pkt) const noexcept {
+				merge_head_t result{0U, pkt.begin(), std::uint32_t(pkt.length()), std::uint32_t(pkt.length()), 0U, 0U, 0U};
+				std::visit([&](const auto& header) {
+					using T = std::decay_t<decltype(header)>;
+					if constexpr (std::is_same_v<T, packet_header_modified_t>) {
+						const auto& base = header.base_header();
+						result.timestamp = timestamp_ns(base.timestamp(), base.useconds(), variant);
+						result.actual_len = base.actual_len();
+						result.if_index = header.interface_index();
+						result.protocol = header.protocol();
+						result.type = header.type();
+					} else if constexpr (std::is_same_v<T, packet_header_t>) {
+						result.timestamp = timestamp_ns(header.timestamp(), header.useconds(), variant);
+						result.actual_len = header.actual_len();
+					}
+				}, pkt.header());
+				return result;
+			}
+
+			[[nodiscard]]
+			merge_head_t from_descriptor(const packet_descriptor_t& desc) noexcept {
+				return {desc.timestamp(), buffer.data() + desc.offset(), desc.captured_len(), desc.actual_len(),
+					desc.interface_index(), desc.protocol(), desc.type()};
+			}
+
+			/* Moves on to the next packet, false once there are none, check failed() to see why */
+			[[nodiscard]]
+			bool advance() noexcept {
+				if (stream != nullptr) {
+					packet = stream->next();
+					if (!packet) {
+						return false;
+					}
+					head = from_packet(*packet);
+					return true;
+				}
+
+				if (batch_pos + 1U < batch_count) {
+					head = from_descriptor(descriptors[++batch_pos]);
+					return true;
+				}
+
+				batch_pos = 0U;
+				batch_count = capture->read_batch(next_index, descriptors.size(), buffer.data(), buffer.size(), descriptors.data(), &next_index);
+				if (batch_count != 0U) {
+					head = from_descriptor(descriptors[0U]);
+					return true;
+				}
+
+				/* Anything that doesn't fit in the buffer on its own is read by itself */
+				if (next_index >= capture->index_size()) {
+					return false;
+				}
+				packet = capture->read_packet(next_index);
+				if (!packet) {
+					return false;
+				}
+				head = from_packet(*packet);
+				do {
+					++next_index;
+				} while (next_index < capture->index_size() && capture->packet_removed(next_index));
+				return true;
+			}
+
+			/* If the input ran out because something went wrong rather than it ending */
+			[[nodiscard]]
+			bool failed() const noexcept {
+				if (stream != nullptr) {
+					return !stream->eof();
+				}
+				return next_index < capture->index_size();
+			}
+		};
+
+		/* Checks the link types agree, works out the output header, and merges everything that's left */
+		merge_result_t merge_inputs(std::vector<merge_input_t>& inputs, const std::vector<const file_header_t *>& headers,
+			const fs::path& output, const merge_options_t& options) noexcept {
+			if (inputs.empty()) {
+				return merge_result_t::NoInputs;
+			}
+
+			const auto link_type = headers.front()->link_type();
+			std::uint32_t snaplen{};
+			bool nanosecond{false};
+			bool modified{true};
+			bool skipped{false};
+			std::size_t kept{};
+			for (std::size_t idx{}; idx < inputs.size(); ++idx) {
+				const auto& header = *headers[idx];
+				if (header.link_type() != link_type) {
+					if (options.link_type_conflict == link_type_conflict_t::Fail) {
+						return merge_result_t::LinkTypeMismatch;
+					}
+					skipped = true;
+					continue;
+				}
+
+				snaplen = std::max(snaplen, header.max_packet_length());
+				nanosecond = nanosecond || header.variant() == pcap_variant_t::Nanosecond;
+				modified = modified && header.variant() == pcap_variant_t::Modified;
+				inputs[kept++] = std::move(inputs[idx]);
+			}
+			inputs.resize(kept);
+
+			const auto variant = (nanosecond) ? pcap_variant_t::Nanosecond :
+				((modified) ? pcap_variant_t::Modified : pcap_variant_t::Standard);
+			const file_header_t header{variant, version_t{2U, 4U}, 0, 0U, snaplen, link_type};
+			writer_t writer{output, header, options.writer};
+			if (!writer.valid()) {
+				return merge_result_t::WriteFailed;
+			}
+
+			/* A min-heap of the inputs by their next packet, ties go to whichever input came first */
+			const auto later = [&](const std::size_t a, const std::size_t b) {
+				const auto& lhs = inputs[a].head;
+				const auto& rhs = inputs[b].head;
+				return lhs.timestamp > rhs.timestamp || (lhs.timestamp == rhs.timestamp && a > b);
+			};
+
+			std::vector<std::size_t> heap{};
+			bool read_failed{false};
+			try {
+				heap.reserve(inputs.size());
+			} catch (const std::bad_alloc&) {
+				return merge_result_t::WriteFailed;
+			}
+			for (std::size_t idx{}; idx < inputs.size(); ++idx) {
+				if (inputs[idx].advance()) {
+					heap.push_back(idx);
+				} else {
+					read_failed = read_failed || inputs[idx].failed();
+				}
+			}
+			std::make_heap(heap.begin(), heap.end(), later);
+
+			const auto divisor = (variant == pcap_variant_t::Nanosecond) ? 1U : 1000U;
+			while (!heap.empty()) {
+				std::pop_heap(heap.begin(), heap.end(), later);
+				auto& input = inputs[heap.back()];
+				const auto& head = input.head;
+
+				const auto seconds = std::uint32_t(head.timestamp / 1000000000U);
+				const auto fraction = std::uint32_t((head.timestamp % 1000000000U) / divisor);
+				bool written{};
+				if (variant == pcap_variant_t::Modified) {
+					const packet_t packet{
+						packet_header_modified_t{
+							packet_header_t{seconds, fraction, head.captured_len, head.actual_len},
+							head.if_index, head.protocol, head.type
+						}, head.data, head.captured_len
+					};
+					written = writer.write(packet);
+				} else {
+					written = writer.write(seconds, fraction, head.data, head.captured_len, head.actual_len);
+				}
+				if (!written) {
+					return merge_result_t::WriteFailed;
+				}
+
+				if (input.advance()) {
+					std::push_heap(heap.begin(), heap.end(), later);
+				} else {
+					read_failed = read_failed || input.failed();
+					heap.pop_back();
+				}
+			}
+
+			if (!writer.close()) {
+				return merge_result_t::WriteFailed;
+			}
+			if (read_failed) {
+				return merge_result_t::ReadFailed;
+			}
+			return (skipped) ? merge_result_t::Skipped : merge_result_t::Merged;
+		}
+	}
+
+	merge_result_t merge(std::vector<stream_reader_t>& inputs, const fs::path& output, const merge_options_t& options) noexcept {
+		std::vector<merge_input_t> sources{};
+		std::vector<const file_header_t *> headers{};
+		try {
+			sources.resize(inputs.size());
+			headers.reserve(inputs.size());
+		} catch (const std::bad_alloc&) {
+			return merge_result_t::BadInput;
+		}
+
+		for (std::size_t idx{}; idx < inputs.size(); ++idx) {
+			if (!inputs[idx].valid()) {
+				return merge_result_t::BadInput;
+			}
+			sources[idx].stream = &inputs[idx];
+			sources[idx].variant = inputs[idx].header().variant();
+			headers.push_back(&inputs[idx].header());
+		}
+		return merge_inputs(sources, headers, output, options);
+	}
+
+	merge_result_t merge(const std::vector<fs::path>& inputs, const fs::path& output, const merge_options_t& options) noexcept {
+		std::vector<stream_reader_t> readers{};
+		try {
+			readers.reserve(inputs.size());
+			for (const auto& input : inputs) {
+				readers.emplace_back(input, capture_compression_t::Autodetect, options.read_ahead);
+			}
+		} catch (const std::bad_alloc&) {
+			return merge_result_t::BadInput;
+		}
+		return merge(readers, output, options);
+	}
+
+	merge_result_t merge(const std::vector<std::reference_wrapper<const pcap_t>>& inputs, const fs::path& output,
+		const merge_options_t& options) noexcept {
+		std::vector<merge_input_t> sources{};
+		std::vector<const file_header_t *> headers{};
+		try {
+			sources.resize(inputs.size());
+			headers.reserve(inputs.size());
+			for (std::size_t idx{}; idx < inputs.size(); ++idx) {
+				const pcap_t& capture = inputs[idx];
+				if (!capture.valid()) {
+					return merge_result_t::BadInput;
+				}
+
+				auto& source = sources[idx];
+				source.capture = &capture;
+				source.variant = capture.header().variant();
+				source.buffer.resize(std::max<std::size_t>(options.read_ahead, 1U));
+				/* Room for as many packets as would fit if they were all tiny */
+				source.descriptors.resize(std::max<std::size_t>(source.buffer.size() / 64U, 1U));
+				headers.push_back(&capture.header());
+			}
+		} catch (const std::bad_alloc&) {
+			return merge_result_t::BadInput;
+		}
+		return merge_inputs(sources, headers, output, options);
+	}
+}
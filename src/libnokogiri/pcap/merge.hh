@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/merge.hh - libnokogiri time ordered merging of pcap files */
+#if !defined(LIBNOKOGIRI_PCAP_MERGE_HH)
+#define LIBNOKOGIRI_PCAP_MERGE_HH
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fs.hh>
+
+#include <libnokogiri/pcap/header.hh>
+#include <libnokogiri/pcap/stream_reader.hh>
+#include <libnokogiri/pcap/writer.hh>
+
+namespace libnokogiri::pcap {
+	struct pcap_t;
+
+	/*! \enum libnokogiri::pcap::link_type_conflict_t
+		\brief What libnokogiri::pcap::merge() does with inputs that have a different link type
+
+		A pcap file only has the one link type, so packets from inputs that
+		don't match can't be told apart once they're merged.
+	*/
+	enum struct link_type_conflict_t : std::uint8_t {
+		Fail = 0x00U, /*!< Don't merge anything, merge() returns libnokogiri::pcap::merge_result_t::LinkTypeMismatch */
+		Skip = 0x01U, /*!< Leave out every input that doesn't have the same link type as the first, merge() returns libnokogiri::pcap::merge_result_t::Skipped */
+	};
+
+	/*! \enum libnokogiri::pcap::merge_result_t
+		\brief The outcome of libnokogiri::pcap::merge()
+	*/
+	enum struct merge_result_t : std::uint8_t {
+		Merged           = 0x00U, /*!< Every packet was merged */
+		NoInputs         = 0x01U, /*!< There was nothing to merge, nothing is written */
+		BadInput         = 0x02U, /*!< An input couldn't be opened or isn't a pcap file, nothing is written */
+		LinkTypeMismatch = 0x03U, /*!< The inputs have different link types, nothing is written */
+		ReadFailed       = 0x04U, /*!< An input turned out to be truncated or corrupt, what was merged up until then is written */
+		WriteFailed      = 0x05U, /*!< The output couldn't be written */
+		Skipped          = 0x06U, /*!< Every packet was merged bar those in inputs left out for having a different link type */
+	};
+
+	/*! \struct libnokogiri::pcap::merge_options_t
+		\brief How libnokogiri::pcap::merge() reads its inputs and writes its output
+	*/
+	struct merge_options_t final {
+		/*! How much of each input to read ahead, this bounds the memory used per input */
+		std::size_t read_ahead{1_MiB};
+		/*! What to do with inputs that have a different link type */
+		link_type_conflict_t link_type_conflict{link_type_conflict_t::Fail};
+		/*! How the output is buffered and flushed */
+		writer_options_t writer{};
+	};
+
+	/*! \brief Merge a set of captures into one in time order
+
+		The inputs are each read from front to back, and a heap of the next
+		packet from each picks which goes out next, so only one packet per input
+		is ever looked at and memory use doesn't grow with the size of the
+		inputs. Packets with the same timestamp keep the order of the inputs.
+		Nothing is allocated per packet, so merging is bound by the I/O.
+
+		Each input has to be in time order itself, packets that aren't are
+		written out in the order they are read.
+
+		The output takes the link type of the inputs and the largest snapshot
+		length of any of them. It's a nanosecond capture if any input is, a
+		modified capture if they all are, and otherwise a standard one.
+		Timestamps are converted to match.
+
+		The interface index, protocol, and packet type of packets from modified
+		captures are passed through as they are rather than renumbered per input,
+		so an interface index in the output means whatever it meant in the input
+		the packet came from, and the same index from two inputs can't be told
+		apart.
+
+		\param inputs The captures to merge, they are read as streams so can be compressed
+		\param output Where to write the merged capture, it's replaced if it exists
+		\param options How to read, merge, and write
+	*/
+	[[nodiscard]]
+	LIBNOKOGIRI_API merge_result_t merge(const std::vector<libnokogiri::internal::fs::path>& inputs,
+		const libnokogiri::internal::fs::path& output, const merge_options_t& options = {}) noexcept;
+
+	/*! \brief Merge a set of already open stream readers into one capture in time order
+
+		Each reader carries on from wherever it is, and is read to the end.
+		Its own buffer is its read ahead, so `read_ahead` isn't used.
+	*/
+	[[nodiscard]]
+	LIBNOKOGIRI_API merge_result_t merge(std::vector<stream_reader_t>& inputs, const libnokogiri::internal::fs::path& output,
+		const merge_options_t& options = {}) noexcept;
+
+	/*! \brief Merge a set of captures that are already open into one capture in time order
+
+		Packets are read in batches of up to `read_ahead` bytes through
+		libnokogiri::pcap::pcap_t::read_batch(), so nothing is cached, and
+		removed packets are left out.
+	*/
+	[[nodiscard]]
+	LIBNOKOGIRI_API merge_result_t merge(const std::vector<std::reference_wrapper<const pcap_t>>& inputs,
+		const libnokogiri::internal::fs::path& output, const merge_options_t& options = {}) noexcept;
+}
+
+#endif /* LIBNOKOGIRI_PCAP_MERGE_HH */
@@ -15,6 +15,8 @@
 
 #include <libnokogiri/internal/defs.hh>
 
+#include <libnokogiri/pcap/header.hh>
+
 namespace libnokogiri::pcap {
 	using libnokogiri::internal::enum_pair_t;
 	/*! \enum libnokogiri::pcap::packet_type_t
@@ -261,8 +263,19 @@ namespace libnokogiri::pcap {
 		>;
 	private:
 		std::vector<std::uint8_t> _raw_data;
+		const std::uint8_t *_data;
+		std::size_t _length;
 		pkt_header_t _packet_header;
 
+		/* Views are read only, the first write to one copies it into memory the packet owns */
+		std::uint8_t *writable() {
+			if (is_view()) {
+				_raw_data.assign(_data, _data + _length);
+				_data = _raw_data.data();
+			}
+			return _raw_data.data();
+		}
+
 		template<typename T>
 		[[nodiscard]]
 		std::enable_if_t<
@@ -271,8 +284,8 @@ namespace libnokogiri::pcap {
 			!std::is_same_v<T, void*>,
 		T*>
 		index(const std::size_t offset) {
-			if (offset < _raw_data.size()) {
-				return new (reinterpret_cast<std::uint8_t *>(_raw_data.data()) + (offset * sizeof(T))) T{};
+			if (offset < _length) {
+				return new (writable() + (offset * sizeof(T))) T{};
 			}
 			return nullptr;
 		}
@@ -284,8 +297,8 @@ namespace libnokogiri::pcap {
 			!std::is_same_v<T, void*>,
 		T*>
 		index(const std::size_t offset) {
-			if (offset < _raw_data.size()) {
-				return new (reinterpret_cast<std::uint8_t *>(_raw_data.data()) + (offset * sizeof(T))) T{nullptr};
+			if (offset < _length) {
+				return new (writable() + (offset * sizeof(T))) T{nullptr};
 			}
 			return nullptr;
 		}
@@ -294,16 +307,27 @@ namespace libnokogiri::pcap {
 		[[nodiscard]]
 		std::enable_if_t<std::is_same_v<T, void*>, void*>
 		index(const std::size_t offset) {
-			if (offset < _raw_data.size()) {
-				return reinterpret_cast<std::uint8_t *>(_raw_data.data()) + offset;
+			if (offset < _length) {
+				return writable() + offset;
 			}
 			return nullptr;
 		}
 
 	public:
 
-		packet_t(std::size_t length, pkt_header_t header = {}) noexcept :
-			_raw_data{std::vector<std::uint8_t>(length)},
+		/*! Construct a packet that owns `length` bytes of data, this throws std::bad_alloc if they can't be allocated */
+		packet_t(std::size_t length, pkt_header_t header = {}) :
+			_raw_data{std::vector<std::uint8_t>(length)}, _data{_raw_data.data()},
+			_length{length}, _packet_header{std::move(header)} { /* NOP */ }
+
+		/*! \brief Construct a packet that is a view into memory owned by something else
+
+			No copy of the packet data is made, the memory must outlive the packet. The view
+			is read only, the first mutable access to the data copies it into memory owned
+			by the packet, so the memory behind the view is never written to.
+		*/
+		packet_t(pkt_header_t header, const std::uint8_t *data, std::size_t length) noexcept :
+			_raw_data{}, _data{data}, _length{length},
 			_packet_header{std::move(header)} { /* NOP */ }
 
 
@@ -314,10 +338,16 @@ namespace libnokogiri::pcap {
 		packet_t& operator=(packet_t&&) = default;
 
 		[[nodiscard]]
-		std::size_t length() const noexcept { return _raw_data.size(); }
+		std::size_t length() const noexcept { return _length; }
+
+		/*! Check if the packet data is a view into memory that the packet does not own */
+		[[nodiscard]]
+		bool is_view() const noexcept { return _raw_data.empty() && _length != 0U; }
 
 		[[nodiscard]]
 		pkt_header_t& header() noexcept { return _packet_header; }
+		[[nodiscard]]
+		const pkt_header_t& header() const noexcept { return _packet_header; }
 
 		[[nodiscard]]
 		bool is_complete() const noexcept {
@@ -341,10 +371,15 @@ namespace libnokogiri::pcap {
 		[[nodiscard]]
 		T *operator [](const off_t idx) { return index<T>(idx); }
 
+		/*! Retrieve the packet data for writing, if the packet is a view this copies it and throws std::bad_alloc on failure */
 		[[nodiscard]]
-		auto begin() noexcept { return _raw_data.begin(); }
+		std::uint8_t *begin() { return writable(); }
 		[[nodiscard]]
-		auto end() noexcept { return _raw_data.end(); }
+		std::uint8_t *end() { return writable() + _length; }
+		[[nodiscard]]
+		const std::uint8_t *begin() const noexcept { return _data; }
+		[[nodiscard]]
+		const std::uint8_t *end() const noexcept { return _data + _length; }
 
 		template<typename T>
 		[[nodiscard]]
@@ -358,56 +393,187 @@ namespace libnokogiri::pcap {
 		[[nodiscard]]
 		const T *at(const off_t idx) const { return index<const T>(idx); }
 
-		void *address(const off_t offset) noexcept { return index<void *>(offset); }
+		void *address(const off_t offset) { return index<void *>(offset); }
 	};
 
 
 
-	/*! \struct libnokogiri::pcap::packet_storage_t
-		\brief Storage container for pcap packet data
+	/*! \struct libnokogiri::pcap::packet_descriptor_t
+		\brief Describes a packet read into a caller supplied buffer
 
-		This structure stores a small amount of information pertaining to a packet
-		within the pcap file.
+		This is filled in by libnokogiri::pcap::pcap_t::read_batch(), one per packet,
+		and is a flat trivially copyable structure so an array of them is dense.
 
-		It holds the packet type, the size of the packet (including the header), the offset
-		into the pcap file, and the cached packet itself if it's been read.
+		The interface index, protocol, and type are only set for captures that are
+		in the modified pcap format, otherwise they are zero.
 	*/
-	struct packet_storage_t final {
+	struct packet_descriptor_t final {
 	private:
-		std::uint32_t _len;
-		std::uintptr_t _offset;
-		packet_t _packet_cache;
+		std::uint64_t _timestamp;
+		std::size_t _offset;
+		std::uint32_t _captured_len;
+		std::uint32_t _actual_len;
+		std::uint32_t _if_index;
+		std::uint16_t _proto;
+		std::uint8_t _type;
 	public:
-		packet_storage_t() noexcept :
-			_len{0U}, _offset{0U}, _packet_cache{0}
-			{ /* NOP */ }
+		constexpr packet_descriptor_t() noexcept :
+			_timestamp{0U}, _offset{0U}, _captured_len{0U}, _actual_len{0U},
+			_if_index{0U}, _proto{0U}, _type{0U} { /* NOP */ }
 
-		packet_storage_t(std::uint32_t len, std::uintptr_t offset) noexcept :
-			_len{len}, _offset{offset}, _packet_cache{0}
-			{ /* NOP */ }
+		constexpr packet_descriptor_t(std::uint64_t timestamp, std::size_t offset, std::uint32_t captured_len,
+				std::uint32_t actual_len, std::uint32_t if_index = 0U, std::uint16_t protocol = 0U, std::uint8_t type = 0U) noexcept :
+			_timestamp{timestamp}, _offset{offset}, _captured_len{captured_len}, _actual_len{actual_len},
+			_if_index{if_index}, _proto{protocol}, _type{type} { /* NOP */ }
 
-		packet_storage_t(std::uint32_t len, std::uintptr_t offset, packet_t&& packet) noexcept :
-			_len{len}, _offset{offset}, _packet_cache{std::move(packet)}
-			{ /* NOP */ }
+		/*! Retrieve the time the packet was captured in nanoseconds since the epoch */
+		[[nodiscard]]
+		std::uint64_t timestamp() const noexcept { return _timestamp; }
 
-		packet_storage_t(const packet_storage_t&) = delete;
-		packet_storage_t& operator=(const packet_storage_t&) = delete;
+		/*! Retrieve the offset of the packet data in the buffer */
+		[[nodiscard]]
+		std::size_t offset() const noexcept { return _offset; }
 
-		packet_storage_t(packet_storage_t&&) = default;
-		packet_storage_t& operator=(packet_storage_t&&) = default;
+		/*! Retrieve the captured length of the packet, this is how much of the buffer it takes up */
+		[[nodiscard]]
+		std::uint32_t captured_len() const noexcept { return _captured_len; }
 
+		/*! Retrieve the actual length of the packet */
 		[[nodiscard]]
-		std::uint32_t length() const noexcept { return _len; }
+		std::uint32_t actual_len() const noexcept { return _actual_len; }
 
+		/*! Retrieve the interface index for this packet */
 		[[nodiscard]]
-		std::uintptr_t offset() const noexcept { return _offset; }
+		std::uint32_t interface_index() const noexcept { return _if_index; }
 
-		/*! Gets the packet that is represented by this storage object */
+		/*! Retrieve protocol type for this packet */
 		[[nodiscard]]
-		packet_t& get_packet() noexcept { return _packet_cache; }
+		std::uint16_t protocol() const noexcept { return _proto; }
 
-		void set_packet(packet_t&& pkt) noexcept { _packet_cache = std::move(pkt); }
+		/*! Retrieve the type of this packet */
+		[[nodiscard]]
+		std::uint8_t type() const noexcept { return _type; }
 	};
+
+	/*! Retrieve the size of the on-disk packet header for the given pcap variant */
+	[[nodiscard]]
+	constexpr std::size_t packet_header_length(const pcap_variant_t variant) noexcept {
+		return (variant == pcap_variant_t::Modified) ? 24U : 16U;
+	}
+
+	/*! \brief Convert an on-disk packet timestamp into nanoseconds since the epoch
+
+		\param seconds The seconds part of the timestamp
+		\param fraction The micro or nanoseconds part of the timestamp
+		\param variant The variant of the capture the packet is from, this dictates the unit of `fraction`
+	*/
+	[[nodiscard]]
+	constexpr std::uint64_t timestamp_ns(const std::uint32_t seconds, const std::uint32_t fraction, const pcap_variant_t variant) noexcept {
+		return (std::uint64_t(seconds) * 1000000000U) +
+			((variant == pcap_variant_t::Nanosecond) ? std::uint64_t(fraction) : std::uint64_t(fraction) * 1000U);
+	}
+
+	/*! \brief Decode an on-disk packet header
+
+		\param data The raw packet header, must be at least libnokogiri::pcap::packet_header_length() bytes
+		\param variant The variant of the capture the packet is from
+		\param needs_swapping If the capture was written with the opposite byte order to ours
+	*/
+	[[nodiscard]]
+	inline packet_t::pkt_header_t decode_packet_header(const std::uint8_t *const data, const pcap_variant_t variant,
+			const bool needs_swapping) noexcept {
+		const auto read_u32 = [&](const std::size_t offset) -> std::uint32_t {
+			std::uint32_t value{};
+			std::memcpy(&value, data + offset, sizeof(value));
+			return (needs_swapping) ? LIBNOKOGIRI_SWAP32(value) : value;
+		};
+
+		packet_header_t header{read_u32(0U), read_u32(4U), read_u32(8U), read_u32(12U)};
+		if (variant != pcap_variant_t::Modified) {
+			return header;
+		}
+
+		std::uint16_t protocol{};
+		std::memcpy(&protocol, data + 20U, sizeof(protocol));
+		return packet_header_modified_t{
+			std::move(header), read_u32(16U),
+			(needs_swapping) ? LIBNOKOGIRI_SWAP16(protocol) : protocol, data[22U]
+		};
+	}
+
+	/*! \brief Encode a packet header as it is on disk
+
+		The captured length is always written as `captured_len` rather than what
+		is in the header, so the record always matches the data written after it.
+
+		\param header The header to encode
+		\param variant The variant of the capture the packet is going into
+		\param needs_swapping Write it in the opposite byte order to ours, so it matches a capture that was
+		\param captured_len How much packet data follows the header
+		\param data Where to put it, must be at least libnokogiri::pcap::packet_header_length() bytes
+	*/
+	inline void encode_packet_header(const packet_t::pkt_header_t& header, const pcap_variant_t variant,
+			const bool needs_swapping, const std::uint32_t captured_len, std::uint8_t *const data) noexcept {
+		const auto write_u32 = [&](const std::size_t offset, const std::uint32_t value) {
+			const std::uint32_t raw = (needs_swapping) ? LIBNOKOGIRI_SWAP32(value) : value;
+			std::memcpy(data + offset, &raw, sizeof(raw));
+		};
+		const auto write_base = [&](const packet_header_t& base) {
+			write_u32(0U, base.timestamp());
+			write_u32(4U, base.useconds());
+			write_u32(8U, captured_len);
+			write_u32(12U, base.actual_len());
+		};
+
+		std::memset(data, 0, packet_header_length(variant));
+		std::visit([&](const auto& hdr) {
+			using T = std::decay_t<decltype(hdr)>;
+			if constexpr (std::is_same_v<T, packet_header_modified_t>) {
+				write_base(hdr.base_header());
+				if (variant == pcap_variant_t::Modified) {
+					write_u32(16U, hdr.interface_index());
+					const std::uint16_t protocol = (needs_swapping) ? LIBNOKOGIRI_SWAP16(hdr.protocol()) : hdr.protocol();
+					std::memcpy(data + 20U, &protocol, sizeof(protocol));
+					data[22U] = hdr.type();
+				}
+			} else if constexpr (std::is_same_v<T, packet_header_t>) {
+				write_base(hdr);
+			} else {
+				/* No header at all, so all we know is how long it is */
+				write_u32(8U, captured_len);
+				write_u32(12U, captured_len);
+			}
+		}, header);
+	}
+
+	/*! \brief Decode an on-disk packet header into a packet descriptor
+
+		\param data The raw packet header, must be at least libnokogiri::pcap::packet_header_length() bytes
+		\param variant The variant of the capture the packet is from
+		\param needs_swapping If the capture was written with the opposite byte order to ours
+		\param offset Where the packet data is in the buffer the descriptor is for
+	*/
+	[[nodiscard]]
+	inline packet_descriptor_t decode_packet_descriptor(const std::uint8_t *const data, const pcap_variant_t variant,
+			const bool needs_swapping, const std::size_t offset) noexcept {
+		const auto read_u32 = [&](const std::size_t field) -> std::uint32_t {
+			std::uint32_t value{};
+			std::memcpy(&value, data + field, sizeof(value));
+			return (needs_swapping) ? LIBNOKOGIRI_SWAP32(value) : value;
+		};
+
+		const auto timestamp = timestamp_ns(read_u32(0U), read_u32(4U), variant);
+		if (variant != pcap_variant_t::Modified) {
+			return {timestamp, offset, read_u32(8U), read_u32(12U)};
+		}
+
+		std::uint16_t protocol{};
+		std::memcpy(&protocol, data + 20U, sizeof(protocol));
+		return {
+			timestamp, offset, read_u32(8U), read_u32(12U), read_u32(16U),
+			(needs_swapping) ? LIBNOKOGIRI_SWAP16(protocol) : protocol, data[22U]
+		};
+	}
 }
 
 #endif /* LIBNOKOGIRI_PCAP_PACKET_HH */
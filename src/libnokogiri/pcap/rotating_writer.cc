@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/rotating_writer.cc - libnokogiri pcap writer that rolls over to new files */
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <system_error>
+#include <type_traits>
+
+#include <libnokogiri/pcap/rotating_writer.hh>
+
+namespace fs = libnokogiri::internal::fs;
+
+namespace libnokogiri::pcap {
+	static constexpr std::string_view index_placeholder{"{index}"};
+
+	rotating_writer_t::rotating_writer_t(std::string name_template, const file_header_t& header, const rotation_options_t& rotation,
+		const writer_options_t& options) noexcept :
+		_template{std::move(name_template)},
+		_header{header.variant(), header.version(), header.timezone_offset(), header.timestamp_accuracy(), header.max_packet_length(), header.link_type()},
+		_rotation{rotation}, _options{options}, _packet_header_length{packet_header_length(header.variant())} {
+		/* Any number of files can be started within the same second, so only the index tells them apart */
+		if ((_rotation.max_bytes != 0U || _rotation.max_packets != 0U) && _template.find(index_placeholder) == std::string::npos) {
+			try {
+				_template += '.';
+				_template += index_placeholder;
+			} catch (const std::bad_alloc&) {
+				return;
+			}
+		}
+
+		/* The first file is the only one that's opened up front */
+		_current = open_part(0U);
+		if (!_current.writer || !_current.writer->valid()) {
+			return;
+		}
+		_next_index = 1U;
+
+		try {
+			_worker = std::thread{&rotating_writer_t::work, this};
+		} catch (const std::system_error&) {
+			/* Without it, files are opened and closed as we move on to them */
+		}
+		_valid = true;
+	}
+
+	rotating_writer_t::~rotating_writer_t() noexcept {
+		[[maybe_unused]]
+		const auto _ = close();
+	}
+
+	/* Files are written under a hidden name next to where they'll end up, and renamed once they're done */
+	rotating_writer_t::part_t rotating_writer_t::open_part(const std::size_t index) const noexcept {
+		const fs::path name{_template};
+		auto temp = name.parent_path() / ('.' + name.filename().string());
+		temp += '.' + std::to_string(index) + ".part";
+
+		return {std::make_unique<writer_t>(temp, _header, _options), temp, index, 0U, false};
+	}
+
+	fs::path capture_file_name(const std::string& name_template, const std::size_t index, const std::uint32_t seconds) noexcept {
+		auto name{name_template};
+		if (name.find(index_placeholder) == std::string::npos && name.find('%') == std::string::npos) {
+			name += '.';
+			name += index_placeholder;
+		}
+		const auto number = std::to_string(index);
+		for (auto pos = name.find(index_placeholder); pos != std::string::npos; pos = name.find(index_placeholder, pos + number.size())) {
+			name.replace(pos, index_placeholder.size(), number);
+		}
+		if (name.find('%') == std::string::npos) {
+			return name;
+		}
+
+		const auto time = std::time_t(seconds);
+		std::tm utc{};
+#if defined(_WINDOWS)
+		gmtime_s(&utc, &time);
+#else
+		gmtime_r(&time, &utc);
+#endif
+		/* Conversions can be a lot longer than what they're written as, but not endlessly */
+		std::string expanded(name.size() * 4U + 64U, '\0');
+		const auto len = std::strftime(expanded.data(), expanded.size(), name.c_str(), &utc);
+		if (len == 0U) {
+			return name;
+		}
+		expanded.resize(len);
+		return expanded;
+	}
+
+	/* Closes a file that's done and moves it to its real name */
+	bool rotating_writer_t::retire(part_t& part) noexcept {
+		const bool closed = part.writer->close();
+		part.writer.reset();
+
+		/* A file that never got a packet is named after when it was closed */
+		const auto seconds = (part.started) ? part.seconds : std::uint32_t(std::time(nullptr));
+		const auto name = capture_file_name(_template, part.index, seconds);
+		/* Rather than replace a file we've already written, this one is left under its hidden name */
+		{
+			const std::lock_guard<std::mutex> lock{_lock};
+			if (std::find(_files.begin(), _files.end(), name) != _files.end()) {
+				return false;
+			}
+		}
+		std::error_code ec{};
+		fs::rename(part.temp, name, ec);
+		if (ec) {
+			return false;
+		}
+
+		const std::lock_guard<std::mutex> lock{_lock};
+		_files.push_back(name);
+		return closed;
+	}
+
+	/* Closes files that are done and opens the next one ahead of time */
+	void rotating_writer_t::work() noexcept {
+		std::unique_lock<std::mutex> lock{_lock};
+		while (true) {
+			_work_ready.wait(lock, [this]() { return _stopping || !_retired.empty() || (!_next.writer && !_error); });
+
+			if (!_retired.empty()) {
+				auto part = std::move(_retired.front());
+				_retired.pop_front();
+				lock.unlock();
+				const bool ok = retire(part);
+				lock.lock();
+				_error = _error || !ok;
+				_next_ready.notify_all();
+			} else if (!_next.writer && !_error && !_stopping) {
+				const auto index = _next_index;
+				lock.unlock();
+				auto part = open_part(index);
+				lock.lock();
+				if (part.writer->valid()) {
+					_next = std::move(part);
+				} else {
+					_error = true;
+				}
+				_next_ready.notify_all();
+			} else if (_stopping) {
+				return;
+			}
+		}
+	}
+
+	/* Moves on to the next file, which is normally already open and waiting */
+	bool rotating_writer_t::rotate() noexcept {
+		if (!_worker.joinable()) {
+			auto next = open_part(_next_index++);
+			_valid = next.writer->valid() && retire(_current);
+			_current = std::move(next);
+			return _valid;
+		}
+
+		std::unique_lock<std::mutex> lock{_lock};
+		_next_ready.wait(lock, [this]() { return _next.writer || _error; });
+		if (_error) {
+			return (_valid = false);
+		}
+
+		_retired.push_back(std::move(_current));
+		_current = std::move(_next);
+		_next = part_t{};
+		++_next_index;
+		_work_ready.notify_one();
+		return true;
+	}
+
+	/* Moves on to the next file if a packet of `len` bytes captured at `seconds` doesn't belong in this one */
+	bool rotating_writer_t::make_room(const std::uint32_t seconds, const std::size_t len) noexcept {
+		if (!_valid) {
+			return false;
+		}
+
+		const auto& writer = *_current.writer;
+		if (_current.started && (
+			(_rotation.max_packets != 0U && writer.packets_written() >= _rotation.max_packets) ||
+			(_rotation.max_bytes != 0U && writer.bytes_written() + len > _rotation.max_bytes) ||
+			(_rotation.max_seconds != 0U && seconds >= _current.seconds && seconds - _current.seconds >= _rotation.max_seconds)
+		) && !rotate()) {
+			return false;
+		}
+
+		if (!_current.started) {
+			_current.seconds = seconds;
+			_current.started = true;
+		}
+		return true;
+	}
+
+	std::vector<fs::path> rotating_writer_t::files() noexcept {
+		const std::lock_guard<std::mutex> lock{_lock};
+		return _files;
+	}
+
+	bool rotating_writer_t::write(const std::uint32_t seconds, const std::uint32_t fraction, const void *const data,
+		const std::uint32_t captured_len, const std::uint32_t actual_len) noexcept {
+		return make_room(seconds, _packet_header_length + captured_len) &&
+			_current.writer->write(seconds, fraction, data, captured_len, actual_len);
+	}
+
+	bool rotating_writer_t::write(const packet_t& packet) noexcept {
+		const auto seconds = std::visit([](const auto& header) -> std::uint32_t {
+			using T = std::decay_t<decltype(header)>;
+			if constexpr (std::is_same_v<T, packet_header_modified_t>) {
+				return header.base_header().timestamp();
+			} else if constexpr (std::is_same_v<T, packet_header_t>) {
+				return header.timestamp();
+			} else {
+				return 0U;
+			}
+		}, packet.header());
+		return make_room(seconds, _packet_header_length + packet.length()) && _current.writer->write(packet);
+	}
+
+	bool rotating_writer_t::write_records(const void *const records, const std::size_t len, const std::size_t count) noexcept {
+		if (len < _packet_header_length) {
+			return false;
+		}
+
+		std::uint32_t seconds{};
+		std::memcpy(&seconds, records, sizeof(seconds));
+		return make_room(seconds, len) && _current.writer->write_records(records, len, count);
+	}
+
+	bool rotating_writer_t::flush() noexcept {
+		_valid = _valid && _current.writer->flush();
+		return _valid;
+	}
+
+	bool rotating_writer_t::close() noexcept {
+		if (!_current.writer) {
+			return false;
+		}
+
+		bool ok{_valid};
+		if (_worker.joinable()) {
+			{
+				const std::lock_guard<std::mutex> lock{_lock};
+				_retired.push_back(std::move(_current));
+				_stopping = true;
+			}
+			_work_ready.notify_all();
+			_worker.join();
+		} else {
+			ok = retire(_current) && ok;
+		}
+		_current = part_t{};
+
+		/* The file we opened ahead of time was never used */
+		if (_next.writer) {
+			[[maybe_unused]]
+			const auto _ = _next.writer->close();
+			std::error_code ec{};
+			fs::remove(_next.temp, ec);
+			_next = part_t{};
+		}
+
+		_valid = false;
+		return ok && !_error;
+	}
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/rotating_writer.hh - libnokogiri pcap writer that rolls over to new files */
+#if !defined(LIBNOKOGIRI_PCAP_ROTATING_WRITER_HH)
+#define LIBNOKOGIRI_PCAP_ROTATING_WRITER_HH
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fs.hh>
+
+#include <libnokogiri/pcap/header.hh>
+#include <libnokogiri/pcap/packet.hh>
+#include <libnokogiri/pcap/writer.hh>
+
+namespace libnokogiri::pcap {
+	/*! \struct libnokogiri::pcap::rotation_options_t
+		\brief When a libnokogiri::pcap::rotating_writer_t moves on to a new file
+
+		Whichever limit is hit first starts a new file, a limit of 0 is never
+		hit. A file always gets at least one packet, even if that alone is over
+		the limit.
+	*/
+	struct rotation_options_t final {
+		/*! Start a new file rather than let one grow past this many bytes, like `tcpdump -C` */
+		std::uint64_t max_bytes{0U};
+		/*! Start a new file once a packet is this many seconds newer than the first in the file, like `tcpdump -G` */
+		std::uint32_t max_seconds{0U};
+		/*! Start a new file once one has this many packets */
+		std::uint64_t max_packets{0U};
+	};
+
+	/*! \brief Work out a file name from a template, as libnokogiri::pcap::rotating_writer_t names its files
+
+		`{index}` is replaced with `index` and the rest goes through strftime
+		with `seconds` as a UTC time. If the template has neither, `.{index}`
+		is added to the end.
+
+		\param name_template The template for the file name
+		\param index The number of the file
+		\param seconds The UTC time to name the file after
+	*/
+	[[nodiscard]]
+	LIBNOKOGIRI_API libnokogiri::internal::fs::path capture_file_name(const std::string& name_template, std::size_t index,
+		std::uint32_t seconds) noexcept;
+
+	/*! \struct libnokogiri::pcap::rotating_writer_t
+		\brief Writes a capture out over a series of files, like `tcpdump -C` and `-G`
+
+		Each file is written by a libnokogiri::pcap::writer_t. The next file is
+		always opened, and has space reserved if `preallocate` is set, ahead of
+		time on a background thread, and files that are done are closed there
+		too, so moving on to a new file never waits on the file system. If the
+		writer options ask for `compression` each file is compressed on its own,
+		and `max_bytes` is then of the uncompressed capture.
+
+		Files are named from a template. `{index}` is replaced with the number
+		of the file, counting from 0, and the rest goes through strftime with
+		the UTC timestamp of the first packet in the file. If the template has
+		neither, or files are started by size or packet count and it has no
+		`{index}`, `.{index}` is added to the end. Until a file is done it's
+		kept in the same directory under a hidden name, so anything that picks
+		up finished files never sees one part way through. The directory part
+		of the template is used as is. Should a file still end up with the
+		same name as an earlier one, as it can with a template that only has
+		the day in it and a new file every hour, it's left under its hidden name
+		and the writer fails rather than replace the earlier one.
+
+		Timestamps are taken from the packets, not the clock, so a capture
+		being replayed splits up the same way it did live.
+	*/
+	struct LIBNOKOGIRI_CLS_API rotating_writer_t final {
+	private:
+		struct part_t final {
+			std::unique_ptr<writer_t> writer;
+			libnokogiri::internal::fs::path temp;
+			std::size_t index;
+			std::uint32_t seconds;
+			bool started;
+		};
+
+		std::string _template;
+		file_header_t _header;
+		rotation_options_t _rotation;
+		writer_options_t _options;
+		std::size_t _packet_header_length;
+
+		/* The file being written, only ever touched by the writing thread */
+		part_t _current{};
+
+		/* Everything below is shared with the background thread and guarded by _lock */
+		std::mutex _lock{};
+		std::condition_variable _work_ready{};
+		std::condition_variable _next_ready{};
+		part_t _next{};
+		std::deque<part_t> _retired{};
+		std::vector<libnokogiri::internal::fs::path> _files{};
+		std::size_t _next_index{0U};
+		bool _stopping{false};
+		bool _error{false};
+		std::thread _worker{};
+
+		bool _valid{false};
+
+		[[nodiscard]]
+		part_t open_part(std::size_t index) const noexcept;
+		bool retire(part_t& part) noexcept;
+		void work() noexcept;
+		bool rotate() noexcept;
+		bool make_room(std::uint32_t seconds, std::size_t len) noexcept;
+	public:
+		rotating_writer_t() = delete;
+
+		/*! \brief Start writing a capture out over a series of files
+
+			\param name_template The template for the file names
+			\param header The file header for every file, the variant decides the packet header layout
+			\param rotation When to start a new file
+			\param options How each file is buffered and flushed
+		*/
+		rotating_writer_t(std::string name_template, const file_header_t& header, const rotation_options_t& rotation,
+			const writer_options_t& options = {}) noexcept;
+
+		rotating_writer_t(const rotating_writer_t&) = delete;
+		rotating_writer_t& operator=(const rotating_writer_t&) = delete;
+
+		/* The background thread holds on to this, so it can't move */
+		rotating_writer_t(rotating_writer_t&&) = delete;
+		rotating_writer_t& operator=(rotating_writer_t&&) = delete;
+
+		~rotating_writer_t() noexcept;
+
+		/*! Check if everything so far has been written, once anything fails this stays false */
+		[[nodiscard]]
+		bool valid() const noexcept { return _valid; }
+
+		/*! Retrieve the number of the file being written */
+		[[nodiscard]]
+		std::size_t file_index() const noexcept { return _current.index; }
+
+		/*! Retrieve the names of the files that are done, in order */
+		[[nodiscard]]
+		std::vector<libnokogiri::internal::fs::path> files() noexcept;
+
+		/*! Append a packet, see libnokogiri::pcap::writer_t::write() */
+		[[nodiscard]]
+		bool write(std::uint32_t seconds, std::uint32_t fraction, const void *data, std::uint32_t captured_len, std::uint32_t actual_len) noexcept;
+
+		/*! Append a packet, along with the rest of its header if it's from a modified capture */
+		[[nodiscard]]
+		bool write(const packet_t& packet) noexcept;
+
+		/*! \brief Append packet records that are already encoded, see libnokogiri::pcap::writer_t::write_records()
+
+			They all go into the same file, which is decided by the first of them.
+		*/
+		[[nodiscard]]
+		bool write_records(const void *records, std::size_t len, std::size_t count) noexcept;
+
+		/*! Hand off what's buffered for the current file and wait until it has all been written */
+		[[nodiscard]]
+		bool flush() noexcept;
+
+		/*! Finish the current file and wait for every file to be done, nothing can be written after this */
+		[[nodiscard]]
+		bool close() noexcept;
+	};
+}
+
+#endif /* LIBNOKOGIRI_PCAP_ROTATING_WRITER_HH */
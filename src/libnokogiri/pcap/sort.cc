@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/sort.cc - libnokogiri external time sort of pcap files */
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <libnokogiri/pcap/merge.hh>
+#include <libnokogiri/pcap/sort.hh>
+
+namespace fs = libnokogiri::internal::fs;
+
+namespace libnokogiri::pcap {
+	namespace {
+		/* A packet waiting in the reorder window, already encoded as it'll be written */
+		struct held_t final {
+			std::vector<std::uint8_t> record;
+			std::uint64_t timestamp;
+			std::uint64_t sequence;
+			std::size_t run;
+		};
+
+		/*
+			Replacement selection over the reorder window. Packets are held in
+			a heap ordered by run and then timestamp, the oldest packet of the
+			current run goes out whenever the window is full, and a packet that
+			is older than the last one out can't go in this run so it waits for
+			the next. Each run ends up in its own file.
+		*/
+		struct sorter_t final {
+			const sort_options_t& options;
+			const file_header_t header;
+			const std::size_t packet_header_len;
+			const fs::path run_directory;
+			const fs::path output;
+
+			std::vector<held_t> held{};
+			std::vector<std::size_t> heap{};
+			std::vector<std::size_t> spare{};
+			std::size_t held_bytes{0U};
+			std::uint64_t sequence{0U};
+
+			std::size_t current_run{0U};
+			std::uint64_t last_timestamp{0U};
+			bool emitted{false};
+			std::unique_ptr<writer_t> writer{};
+			std::vector<fs::path> runs{};
+			std::size_t temp_count{0U};
+
+			sorter_t(const sort_options_t& sort_options, const file_header_t& input_header, const fs::path& output_path) noexcept :
+				options{sort_options},
+				header{input_header.variant(), input_header.version(), input_header.timezone_offset(),
+					input_header.timestamp_accuracy(), input_header.max_packet_length(), input_header.link_type()},
+				packet_header_len{packet_header_length(input_header.variant())},
+				run_directory{(sort_options.temp_directory.empty()) ? output_path.parent_path() : sort_options.temp_directory},
+				output{output_path} { /* NOP */ }
+
+			/* The first run goes next to the output, as if it's the only one it's just renamed into place */
+			[[nodiscard]]
+			fs::path temp_path(const bool first) noexcept {
+				const auto directory = (first) ? output.parent_path() : run_directory;
+				return directory / ('.' + output.filename().string() + ".run." + std::to_string(temp_count++));
+			}
+
+			[[nodiscard]]
+			bool start_run() noexcept {
+				if (writer && !writer->close()) {
+					return false;
+				}
+				runs.push_back(temp_path(runs.empty()));
+				writer = std::make_unique<writer_t>(runs.back(), header, options.writer);
+				return writer->valid();
+			}
+
+			[[nodiscard]]
+			bool before(const std::size_t a, const std::size_t b) const noexcept {
+				const auto& lhs = held[a];
+				const auto& rhs = held[b];
+				if (lhs.run != rhs.run) {
+					return lhs.run < rhs.run;
+				}
+				if (lhs.timestamp != rhs.timestamp) {
+					return lhs.timestamp < rhs.timestamp;
+				}
+				return lhs.sequence < rhs.sequence;
+			}
+
+			/* Writes out the oldest packet in the window */
+			[[nodiscard]]
+			bool emit() noexcept {
+				const auto later = [this](const std::size_t a, const std::size_t b) { return before(b, a); };
+				std::pop_heap(heap.begin(), heap.end(), later);
+				const auto idx = heap.back();
+				heap.pop_back();
+
+				auto& packet = held[idx];
+				if ((!writer || packet.run != current_run) && !start_run()) {
+					return false;
+				}
+				current_run = packet.run;
+				last_timestamp = packet.timestamp;
+				emitted = true;
+
+				if (!writer->write_records(packet.record.data(), packet.record.size(), 1U)) {
+					return false;
+				}
+				held_bytes -= packet.record.size();
+				spare.push_back(idx);
+				return true;
+			}
+
+			[[nodiscard]]
+			bool add(const packet_t& packet) noexcept {
+				const auto record_len = packet_header_len + packet.length();
+				while (!heap.empty() && held_bytes + record_len > options.reorder_window) {
+					if (!emit()) {
+						return false;
+					}
+				}
+
+				const auto timestamp = std::visit([this](const auto& hdr) -> std::uint64_t {
+					using T = std::decay_t<decltype(hdr)>;
+					if constexpr (std::is_same_v<T, packet_header_modified_t>) {
+						return timestamp_ns(hdr.base_header().timestamp(), hdr.base_header().useconds(), header.variant());
+					} else if constexpr (std::is_same_v<T, packet_header_t>) {
+						return timestamp_ns(hdr.timestamp(), hdr.useconds(), header.variant());
+					} else {
+						return 0U;
+					}
+				}, packet.header());
+
+				/* Slots are reused, so once the window has filled up their buffers rarely need to grow */
+				try {
+					if (spare.empty()) {
+						spare.push_back(held.size());
+						held.push_back({});
+						heap.reserve(held.size());
+					}
+					const auto idx = spare.back();
+					auto& slot = held[idx];
+					slot.record.resize(record_len);
+					spare.pop_back();
+
+					encode_packet_header(packet.header(), header.variant(), false, std::uint32_t(packet.length()), slot.record.data());
+					std::memcpy(slot.record.data() + packet_header_len, packet.begin(), packet.length());
+					slot.timestamp = timestamp;
+					slot.sequence = sequence++;
+					slot.run = (emitted && timestamp < last_timestamp) ? current_run + 1U : current_run;
+
+					held_bytes += record_len;
+					heap.push_back(idx);
+					std::push_heap(heap.begin(), heap.end(), [this](const std::size_t a, const std::size_t b) { return before(b, a); });
+				} catch (const std::bad_alloc&) {
+					return false;
+				}
+				return true;
+			}
+
+			[[nodiscard]]
+			bool finish() noexcept {
+				while (!heap.empty()) {
+					if (!emit()) {
+						return false;
+					}
+				}
+				/* Nothing at all still gets an empty capture */
+				if (!writer && !start_run()) {
+					return false;
+				}
+				const bool closed = writer->close();
+				writer.reset();
+				return closed;
+			}
+
+			/* Merges the runs into the output, over as many passes as it takes to keep to the fan in */
+			[[nodiscard]]
+			bool merge_runs() noexcept {
+				std::error_code ec{};
+				if (runs.size() == 1U) {
+					fs::rename(runs.front(), output, ec);
+					if (!ec) {
+						runs.clear();
+					}
+					return !ec;
+				}
+
+				merge_options_t merge_options{};
+				merge_options.read_ahead = options.read_ahead;
+				merge_options.writer = options.writer;
+				const auto fan_in = std::max<std::size_t>(options.merge_fan_in, 2U);
+
+				while (runs.size() > fan_in) {
+					std::vector<fs::path> merged{};
+					for (std::size_t first{}; first < runs.size(); first += fan_in) {
+						const auto last = std::min(first + fan_in, runs.size());
+						merged.push_back(temp_path(false));
+						const std::vector<fs::path> group(runs.begin() + std::ptrdiff_t(first), runs.begin() + std::ptrdiff_t(last));
+						const bool ok = merge(group, merged.back(), merge_options) == merge_result_t::Merged;
+						for (const auto& run : group) {
+							fs::remove(run, ec);
+						}
+						if (!ok) {
+							runs.erase(runs.begin(), runs.begin() + std::ptrdiff_t(last));
+							runs.insert(runs.end(), merged.begin(), merged.end());
+							return false;
+						}
+					}
+					runs = std::move(merged);
+				}
+
+				return merge(runs, output, merge_options) == merge_result_t::Merged;
+			}
+
+			void remove_runs() noexcept {
+				std::error_code ec{};
+				for (const auto& run : runs) {
+					fs::remove(run, ec);
+				}
+				runs.clear();
+			}
+		};
+	}
+
+	sort_result_t sort_capture(stream_reader_t& input, const fs::path& output, const sort_options_t& options) noexcept {
+		if (!input.valid()) {
+			return sort_result_t::BadInput;
+		}
+
+		try {
+			sorter_t sorter{options, input.header(), output};
+			bool read_failed{false};
+			while (true) {
+				const auto packet = input.next();
+				if (!packet) {
+					read_failed = !input.eof();
+					break;
+				}
+				if (!sorter.add(*packet)) {
+					sorter.remove_runs();
+					return sort_result_t::WriteFailed;
+				}
+			}
+
+			const bool sorted = sorter.finish() && sorter.merge_runs();
+			sorter.remove_runs();
+			if (!sorted) {
+				return sort_result_t::WriteFailed;
+			}
+			return (read_failed) ? sort_result_t::ReadFailed : sort_result_t::Sorted;
+		} catch (const std::bad_alloc&) {
+			return sort_result_t::WriteFailed;
+		}
+	}
+
+	sort_result_t sort_capture(const fs::path& input, const fs::path& output, const sort_options_t& options) noexcept {
+		stream_reader_t reader{input, capture_compression_t::Autodetect, options.read_ahead};
+		return sort_capture(reader, output, options);
+	}
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/sort.hh - libnokogiri external time sort of pcap files */
+#if !defined(LIBNOKOGIRI_PCAP_SORT_HH)
+#define LIBNOKOGIRI_PCAP_SORT_HH
+
+#include <cstdint>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fs.hh>
+
+#include <libnokogiri/pcap/stream_reader.hh>
+#include <libnokogiri/pcap/writer.hh>
+
+namespace libnokogiri::pcap {
+	/*! \enum libnokogiri::pcap::sort_result_t
+		\brief The outcome of libnokogiri::pcap::sort_capture()
+	*/
+	enum struct sort_result_t : std::uint8_t {
+		Sorted      = 0x00U, /*!< Every packet was sorted */
+		BadInput    = 0x01U, /*!< The input couldn't be opened or isn't a pcap file, nothing is written */
+		ReadFailed  = 0x02U, /*!< The input turned out to be truncated or corrupt, what was read up until then is sorted and written */
+		WriteFailed = 0x03U, /*!< The output or a temporary file couldn't be written */
+	};
+
+	/*! \struct libnokogiri::pcap::sort_options_t
+		\brief How libnokogiri::pcap::sort_capture() sorts
+	*/
+	struct sort_options_t final {
+		/*! How many bytes of packets to hold in memory to put back in order, this bounds the memory used */
+		std::size_t reorder_window{64_MiB};
+		/*! The most runs to merge at once, more than this are merged over several passes */
+		std::size_t merge_fan_in{64U};
+		/*! How much of the input, and of each run when merging, to read ahead */
+		std::size_t read_ahead{1_MiB};
+		/*! Where to put runs that don't fit in the window, empty to put them next to the output */
+		libnokogiri::internal::fs::path temp_directory{};
+		/*! How the output and each run are buffered and flushed */
+		writer_options_t writer{};
+	};
+
+	/*! \brief Sort a capture by timestamp, using a bounded amount of memory
+
+		Packets are read into a reorder window of `reorder_window` bytes and
+		the oldest packet in the window goes out each time it's full, which is
+		replacement selection, so a packet can arrive up to a whole window late
+		and still end up in order. A packet that arrives later than that, older
+		than something that has already gone out, starts a new sorted run.
+
+		Nearly sorted input, like that from a multi-queue NIC, comes out as a
+		single run and is written straight to the output. Otherwise each run is
+		spilled to a temporary file and the runs are merged with
+		libnokogiri::pcap::merge(), at most `merge_fan_in` at a time.
+
+		Packets with the same timestamp keep the order they were in. The output
+		is in our byte order and keeps the link type, snapshot length, and
+		timestamp precision of the input.
+
+		\param input The capture to sort, it is read as a stream so can be compressed or a pipe
+		\param output Where to write the sorted capture, it's replaced if it exists
+		\param options How much memory to use and where to spill to
+	*/
+	[[nodiscard]]
+	LIBNOKOGIRI_API sort_result_t sort_capture(const libnokogiri::internal::fs::path& input,
+		const libnokogiri::internal::fs::path& output, const sort_options_t& options = {}) noexcept;
+
+	/*! \brief Sort what's left of an already open stream, see the other sort_capture() */
+	[[nodiscard]]
+	LIBNOKOGIRI_API sort_result_t sort_capture(stream_reader_t& input, const libnokogiri::internal::fs::path& output,
+		const sort_options_t& options = {}) noexcept;
+}
+
+#endif /* LIBNOKOGIRI_PCAP_SORT_HH */
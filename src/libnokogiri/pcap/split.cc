@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/split.cc - libnokogiri splitting of pcap files into many */
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <libnokogiri/pcap/rotating_writer.hh>
+#include <libnokogiri/pcap/split.hh>
+
+namespace fs = libnokogiri::internal::fs;
+
+namespace libnokogiri::pcap {
+	namespace {
+		/* An output that's open, `last_used` is what picks which to close when another is needed */
+		struct open_file_t final {
+			std::uint64_t key;
+			std::unique_ptr<writer_t> writer;
+			std::uint64_t last_used;
+		};
+
+		struct splitter_t final {
+			const split_options_t& options;
+			const std::string& name_template;
+			const file_header_t header;
+			const std::size_t max_open;
+
+			std::vector<open_file_t> open{};
+			std::size_t current{0U};
+			std::uint64_t clock{0U};
+			/* Which of `files` each key was written to, so a file that was closed is appended to rather than replaced */
+			std::unordered_map<std::uint64_t, std::size_t> written{};
+			std::vector<fs::path> files{};
+			/* The names in `files`, so two keys that come out with the same name are caught */
+			std::unordered_set<std::string> names{};
+			bool duplicate{false};
+
+			splitter_t(const split_options_t& split_options, const std::string& file_template, const file_header_t& input_header) noexcept :
+				options{split_options}, name_template{file_template},
+				header{input_header.variant(), input_header.version(), input_header.timezone_offset(),
+					input_header.timestamp_accuracy(), input_header.max_packet_length(), input_header.link_type()},
+				max_open{(split_options.by == split_by_t::Packets) ? 1U : std::max<std::size_t>(split_options.max_open_files, 1U)}
+				{ /* NOP */ }
+
+			[[nodiscard]]
+			bool close_oldest() noexcept {
+				const auto oldest = std::min_element(open.begin(), open.end(),
+					[](const open_file_t& a, const open_file_t& b) { return a.last_used < b.last_used; });
+				const bool closed = oldest->writer->close();
+				*oldest = std::move(open.back());
+				open.pop_back();
+				return closed;
+			}
+
+			/* Finds or opens the writer for `key`, `seconds` is only used to name a new file */
+			[[nodiscard]]
+			writer_t *writer_for(const std::uint64_t key, const std::uint32_t seconds) {
+				++clock;
+				/* Nearly every packet goes to the same file as the one before it */
+				if (current < open.size() && open[current].key == key) {
+					open[current].last_used = clock;
+					return open[current].writer.get();
+				}
+				for (std::size_t idx{}; idx < open.size(); ++idx) {
+					if (open[idx].key == key) {
+						current = idx;
+						open[idx].last_used = clock;
+						return open[idx].writer.get();
+					}
+				}
+
+				if (open.size() >= max_open && !close_oldest()) {
+					return nullptr;
+				}
+
+				std::unique_ptr<writer_t> writer{};
+				const auto file = written.find(key);
+				if (file == written.end()) {
+					auto name = capture_file_name(name_template, std::size_t(key), seconds);
+					/* Opening it would truncate a file that already has another key's packets in it */
+					if (!names.insert(name.string()).second) {
+						duplicate = true;
+						return nullptr;
+					}
+					files.push_back(std::move(name));
+					written.emplace(key, files.size() - 1U);
+					writer = std::make_unique<writer_t>(files.back(), header, options.writer);
+				} else {
+					libnokogiri::internal::fd_t fd{files[file->second], O_WRONLY};
+					if (!fd.valid() || fd.seek(0, SEEK_END) < 0) {
+						return nullptr;
+					}
+					writer = std::make_unique<writer_t>(std::move(fd), header, options.writer, false);
+				}
+				if (!writer->valid()) {
+					return nullptr;
+				}
+
+				open.push_back({key, std::move(writer), clock});
+				current = open.size() - 1U;
+				return open.back().writer.get();
+			}
+
+			[[nodiscard]]
+			bool finish() noexcept {
+				bool closed{true};
+				for (auto& file : open) {
+					closed = file.writer->close() && closed;
+				}
+				open.clear();
+				return closed;
+			}
+		};
+	}
+
+	split_result_t split_capture(stream_reader_t& input, const std::string& name_template, const split_options_t& options,
+		std::vector<fs::path> *files) noexcept {
+		if (!input.valid()) {
+			return split_result_t::BadInput;
+		}
+		if (options.by == split_by_t::Interface && input.header().variant() != pcap_variant_t::Modified) {
+			return split_result_t::NotModified;
+		}
+
+		const auto every = std::max<std::uint64_t>(options.every, 1U);
+		splitter_t splitter{options, name_template, input.header()};
+		bool written{true};
+		bool read_failed{false};
+		try {
+			std::uint64_t count{0U};
+			std::uint32_t first_seconds{0U};
+
+			while (true) {
+				const auto packet = input.next();
+				if (!packet) {
+					read_failed = !input.eof();
+					break;
+				}
+
+				std::uint32_t seconds{};
+				std::uint32_t if_index{};
+				std::visit([&](const auto& hdr) {
+					using T = std::decay_t<decltype(hdr)>;
+					if constexpr (std::is_same_v<T, packet_header_modified_t>) {
+						seconds = hdr.base_header().timestamp();
+						if_index = hdr.interface_index();
+					} else if constexpr (std::is_same_v<T, packet_header_t>) {
+						seconds = hdr.timestamp();
+					}
+				}, packet->header());
+				if (count == 0U) {
+					first_seconds = seconds;
+				}
+
+				std::uint64_t key{};
+				switch (options.by) {
+					case split_by_t::Seconds: {
+						key = (seconds > first_seconds) ? (seconds - first_seconds) / every : 0U;
+						seconds = std::uint32_t(first_seconds + key * every);
+						break;
+					}
+					case split_by_t::Packets: {
+						key = count / every;
+						break;
+					}
+					case split_by_t::Interface: {
+						key = if_index;
+						break;
+					}
+				}
+				++count;
+
+				auto *const writer = splitter.writer_for(key, seconds);
+				if (writer == nullptr || !writer->write(*packet)) {
+					written = false;
+					break;
+				}
+			}
+		} catch (const std::bad_alloc&) {
+			written = false;
+		}
+
+		written = splitter.finish() && written;
+		if (files != nullptr) {
+			*files = std::move(splitter.files);
+		}
+		if (splitter.duplicate) {
+			return split_result_t::DuplicateName;
+		}
+		if (!written) {
+			return split_result_t::WriteFailed;
+		}
+		return (read_failed) ? split_result_t::ReadFailed : split_result_t::Split;
+	}
+
+	split_result_t split_capture(const fs::path& input, const std::string& name_template, const split_options_t& options,
+		std::vector<fs::path> *files) noexcept {
+		stream_reader_t reader{input, capture_compression_t::Autodetect, options.read_ahead};
+		return split_capture(reader, name_template, options, files);
+	}
+}
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/split.hh - libnokogiri splitting of pcap files into many */
+#if !defined(LIBNOKOGIRI_PCAP_SPLIT_HH)
+#define LIBNOKOGIRI_PCAP_SPLIT_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fs.hh>
+
+#include <libnokogiri/pcap/stream_reader.hh>
+#include <libnokogiri/pcap/writer.hh>
+
+namespace libnokogiri::pcap {
+	/*! \enum libnokogiri::pcap::split_by_t
+		\brief What libnokogiri::pcap::split_capture() splits a capture up by
+	*/
+	enum struct split_by_t : std::uint8_t {
+		Seconds   = 0x00U, /*!< A new file for every `every` seconds, counting from the first packet */
+		Packets   = 0x01U, /*!< A new file for every `every` packets */
+		Interface = 0x02U, /*!< A file per interface, only modified captures record which interface a packet came in on */
+	};
+
+	/*! \enum libnokogiri::pcap::split_result_t
+		\brief The outcome of libnokogiri::pcap::split_capture()
+	*/
+	enum struct split_result_t : std::uint8_t {
+		Split         = 0x00U, /*!< Every packet was written out */
+		BadInput      = 0x01U, /*!< The input couldn't be opened or isn't a pcap file, nothing is written */
+		NotModified   = 0x02U, /*!< Splitting by interface needs a modified capture, nothing is written */
+		ReadFailed    = 0x03U, /*!< The input turned out to be truncated or corrupt, what was read up until then is written */
+		WriteFailed   = 0x04U, /*!< One of the outputs couldn't be written */
+		DuplicateName = 0x05U, /*!< Two files would have had the same name, what was written up until then is kept */
+	};
+
+	/*! \struct libnokogiri::pcap::split_options_t
+		\brief How libnokogiri::pcap::split_capture() splits
+	*/
+	struct split_options_t final {
+		/*! What to split by */
+		split_by_t by{split_by_t::Seconds};
+		/*! How many seconds or packets go in each file, not used when splitting by interface */
+		std::uint64_t every{60U};
+		/*! The most files to have open at once, each has its own writer and buffers */
+		std::size_t max_open_files{16U};
+		/*! How much of the input to read ahead */
+		std::size_t read_ahead{1_MiB};
+		/*! How each output is buffered and flushed */
+		writer_options_t writer{};
+	};
+
+	/*! \brief Split a capture up into many in a single pass
+
+		Each packet goes to a file picked by what the capture is split by, the
+		time window it falls in, which block of packets it's in, or the
+		interface it came in on. Files are named with
+		libnokogiri::pcap::capture_file_name(), where `{index}` is the number of
+		the window or block, counting from 0, or the interface index, and the
+		time is that of the start of the window or of the first packet in the
+		file. Unless each name has a distinct time in it, put `{index}` in the
+		template so two files don't end up with the same name. If two do,
+		splitting stops with libnokogiri::pcap::split_result_t::DuplicateName
+		rather than write over the first.
+
+		At most `max_open_files` writers are open at once, so memory use is
+		bounded by that and the writer options and not by how many files there
+		are. When another is needed the one used longest ago is closed, and if
+		a packet for it turns up later its file is opened again and appended
+		to. Splitting by packet count only ever needs one open.
+
+		Packets from before the start of the first time window, which only a
+		capture that's out of order has, go in the first file. The outputs are
+		in our byte order and keep the variant, link type, snapshot length, and
+		timestamp precision of the input. Nothing is written for an empty
+		capture.
+
+		\param input The capture to split, it is read as a stream so can be compressed or a pipe
+		\param name_template The template for the file names, existing files are replaced
+		\param options What to split by and how many files to keep open
+		\param files If not null, filled with the files written in the order they were started, even if something fails
+	*/
+	[[nodiscard]]
+	LIBNOKOGIRI_API split_result_t split_capture(const libnokogiri::internal::fs::path& input, const std::string& name_template,
+		const split_options_t& options = {}, std::vector<libnokogiri::internal::fs::path> *files = nullptr) noexcept;
+
+	/*! \brief Split what's left of an already open stream, see the other split_capture() */
+	[[nodiscard]]
+	LIBNOKOGIRI_API split_result_t split_capture(stream_reader_t& input, const std::string& name_template,
+		const split_options_t& options = {}, std::vector<libnokogiri::internal::fs::path> *files = nullptr) noexcept;
+}
+
+#endif /* LIBNOKOGIRI_PCAP_SPLIT_HH */
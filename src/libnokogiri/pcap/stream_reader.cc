@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/stream_reader.cc - libnokogiri forward-only pcap reader */
+
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+#include <libnokogiri/pcap/stream_reader.hh>
+
+namespace libnokogiri::pcap {
+	/* Largest packet we'll believe a header about if the snaplen is smaller */
+	static constexpr std::size_t max_sane_packet_length{256_KiB};
+	/* Largest packet we'll believe a header about whatever the snaplen says, so a corrupt one can't ask for gigabytes */
+	static constexpr std::size_t max_packet_length{64_MiB};
+	/* Enough of the start of the file to tell every compression we know apart */
+	static constexpr std::size_t compression_magic_length{4U};
+
+	stream_reader_t::stream_reader_t(libnokogiri::internal::fd_t&& file, capture_compression_t compression, std::size_t buffer_size) noexcept :
+		_file{std::move(file)}, _compression{compression}, _buffer(std::max(buffer_size, file_header_length)) {
+		if (!_file.valid()) {
+			return;
+		}
+
+		/* Pull in the first chunk raw so we can sniff the compression without needing to seek back, a pipe may hand it over in dribs */
+		while (_end < compression_magic_length) {
+			const auto res = _file.read(_buffer.data() + _end, _buffer.size() - _end, nullptr);
+			if (res < 0) {
+				return;
+			} else if (res == 0) {
+				break;
+			}
+			_end += std::size_t(res);
+		}
+		if (_end == 0U) {
+			return;
+		}
+
+		if (_compression == capture_compression_t::Autodetect) {
+			_compression = libnokogiri::internal::detect_captrue_compression(_buffer.data(), _end);
+		}
+
+		if (is_compressed(_compression)) {
+			_decompressor = std::make_unique<libnokogiri::internal::decompressor_t>(_compression);
+			if (!_decompressor->valid()) {
+				return;
+			}
+
+			/* What we read is actually compressed input, so it becomes the input buffer */
+			std::swap(_input, _buffer);
+			_input_end = _end;
+			_buffer.resize(_input.size());
+			_end = 0U;
+		} else if (_compression != capture_compression_t::Uncompressed) {
+			return;
+		}
+
+		if (!ensure(file_header_length)) {
+			return;
+		}
+
+		_valid = decode_file_header(_buffer.data() + _begin, _header, _needs_swapping);
+		_begin += file_header_length;
+	}
+
+	/* Appends as much data as we can get from a single read to the end of the buffer */
+	bool stream_reader_t::fill() noexcept {
+		if (!_decompressor) {
+			const auto res = _file.read(_buffer.data() + _end, _buffer.size() - _end, nullptr);
+			if (res < 0) {
+				return false;
+			} else if (res == 0) {
+				_eof = true;
+			}
+			_end += std::size_t(res);
+			return true;
+		}
+
+		while (true) {
+			const std::uint8_t *in = _input.data() + _input_begin;
+			std::size_t in_len = _input_end - _input_begin;
+			std::uint8_t *out = _buffer.data() + _end;
+			std::size_t out_len = _buffer.size() - _end;
+
+			if (!_decompressor->decompress(in, in_len, out, out_len)) {
+				return false;
+			}
+
+			_input_begin = _input_end - in_len;
+			const auto produced = (_buffer.size() - out_len) - _end;
+			_end += produced;
+			if (produced != 0U || _input_begin != _input_end) {
+				return true;
+			}
+
+			/* The stream is starved, feed it some more input */
+			const auto res = _file.read(_input.data(), _input.size(), nullptr);
+			if (res < 0) {
+				return false;
+			} else if (res == 0) {
+				_eof = true;
+				return true;
+			}
+			_input_begin = 0U;
+			_input_end = std::size_t(res);
+		}
+	}
+
+	/* Makes sure there are at least `len` unconsumed bytes in the buffer */
+	bool stream_reader_t::ensure(const std::size_t len) noexcept {
+		if (_end - _begin >= len) {
+			return true;
+		}
+
+		if (_begin != 0U) {
+			std::memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+			_end -= _begin;
+			_begin = 0U;
+		}
+
+		if (_buffer.size() < len) {
+			try {
+				_buffer.resize(len);
+			} catch (const std::bad_alloc&) {
+				return false;
+			}
+		}
+
+		while (_end - _begin < len) {
+			if (_eof || !fill()) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	std::optional<packet_t> stream_reader_t::next() noexcept {
+		if (!_valid) {
+			return std::nullopt;
+		}
+
+		const auto pkt_hdr_len = packet_header_length(_header.variant());
+		if (!ensure(pkt_hdr_len)) {
+			return std::nullopt;
+		}
+
+		std::uint32_t captured_len{};
+		std::memcpy(&captured_len, _buffer.data() + _begin + 8U, sizeof(captured_len));
+		if (_needs_swapping) {
+			captured_len = LIBNOKOGIRI_SWAP32(captured_len);
+		}
+
+		const auto limit = std::min(std::max<std::size_t>(_header.max_packet_length(), max_sane_packet_length), max_packet_length);
+		if (captured_len > limit) {
+			_valid = false;
+			return std::nullopt;
+		}
+
+		if (!ensure(pkt_hdr_len + captured_len)) {
+			return std::nullopt;
+		}
+
+		const auto data = _buffer.data() + _begin;
+		_begin += pkt_hdr_len + captured_len;
+
+		return packet_t{
+			decode_packet_header(data, _header.variant(), _needs_swapping),
+			data + pkt_hdr_len, captured_len
+		};
+	}
+}
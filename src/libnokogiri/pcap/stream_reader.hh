@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/stream_reader.hh - libnokogiri forward-only pcap reader */
+#if !defined(LIBNOKOGIRI_PCAP_STREAM_READER_HH)
+#define LIBNOKOGIRI_PCAP_STREAM_READER_HH
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+#include <libnokogiri/internal/fs.hh>
+#include <libnokogiri/internal/compression.hh>
+
+#include <libnokogiri/pcap/header.hh>
+#include <libnokogiri/pcap/packet.hh>
+
+namespace libnokogiri::pcap {
+	/*! \struct libnokogiri::pcap::stream_reader_t
+		\brief Single pass, forward-only pcap reader
+
+		Unlike libnokogiri::pcap::pcap_t this builds no packet index and never
+		seeks, so it can read from pipes, sockets, and standard input, and its
+		memory usage does not grow with the number of packets in the capture.
+
+		Packets are handed out as views into an internal buffer that is reused,
+		so a packet is only valid until the next call to next().
+
+		gzip, Zstandard, and LZ4 compressed streams are decompressed on the fly.
+	*/
+	struct LIBNOKOGIRI_CLS_API stream_reader_t final {
+	private:
+		libnokogiri::internal::fd_t _file;
+		capture_compression_t _compression;
+		std::unique_ptr<libnokogiri::internal::decompressor_t> _decompressor{};
+		file_header_t _header{};
+
+		/* Raw compressed input, only used if the stream is compressed */
+		std::vector<std::uint8_t> _input{};
+		std::size_t _input_begin{0U};
+		std::size_t _input_end{0U};
+
+		/* Decoded capture data, [_begin, _end) is what has not been consumed */
+		std::vector<std::uint8_t> _buffer{};
+		std::size_t _begin{0U};
+		std::size_t _end{0U};
+
+		bool _valid{false};
+		bool _needs_swapping{false};
+		bool _eof{false};
+
+		bool fill() noexcept;
+		bool ensure(const std::size_t len) noexcept;
+	public:
+		stream_reader_t() = delete;
+
+		/*! \brief Construct a new stream reader over an already open file descriptor
+
+			\param file The file descriptor to read from, this can be a pipe or socket
+			\param compression The compression mode for the stream
+			\param buffer_size The initial size of the read buffer, it will grow if a packet is larger than it
+		*/
+		stream_reader_t(libnokogiri::internal::fd_t&& file, capture_compression_t compression = capture_compression_t::Autodetect,
+			std::size_t buffer_size = 1_MiB) noexcept;
+
+		/*! \brief Construct a new stream reader
+
+			\param file The path to the pcap file
+			\param compression The compression mode for the stream
+			\param buffer_size The initial size of the read buffer, it will grow if a packet is larger than it
+		*/
+		stream_reader_t(const libnokogiri::internal::fs::path& file, capture_compression_t compression = capture_compression_t::Autodetect,
+			std::size_t buffer_size = 1_MiB) noexcept :
+			stream_reader_t{libnokogiri::internal::fd_t{file, O_RDONLY}, compression, buffer_size} { /* NOP */ }
+
+		stream_reader_t(const stream_reader_t&) = delete;
+		stream_reader_t& operator=(const stream_reader_t&) = delete;
+
+		stream_reader_t(stream_reader_t&&) = default;
+		stream_reader_t& operator=(stream_reader_t&&) = default;
+
+		[[nodiscard]]
+		bool valid() const noexcept { return _valid; }
+
+		[[nodiscard]]
+		bool needs_swapping() const noexcept { return _needs_swapping; }
+
+		[[nodiscard]]
+		const file_header_t& header() const noexcept { return _header; }
+
+		[[nodiscard]]
+		capture_compression_t compression_type() const noexcept { return _compression; }
+
+		/*! Check if the end of the stream has been reached */
+		[[nodiscard]]
+		bool eof() const noexcept { return _eof && _begin == _end; }
+
+		/*! \brief Read the next packet from the stream
+
+			The returned packet is a view into the reader's buffer and is only valid
+			until the next call to next().
+
+			\returns std::nullopt at the end of the stream or if the stream is truncated or corrupt
+		*/
+		[[nodiscard]]
+		std::optional<packet_t> next() noexcept;
+	};
+}
+
+#endif /* LIBNOKOGIRI_PCAP_STREAM_READER_HH */
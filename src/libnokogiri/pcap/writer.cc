@@ -0,0 +1,381 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/writer.cc - libnokogiri append-only pcap writer */
+
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <system_error>
+
+#include <libnokogiri/pcap/writer.hh>
+
+namespace libnokogiri::pcap {
+	writer_t::writer_t(libnokogiri::internal::fd_t&& file, const file_header_t& header, const writer_options_t& options,
+		const bool write_header) noexcept :
+		_file{std::move(file)}, _options{options}, _variant{header.variant()}, _packet_header_length{packet_header_length(header.variant())} {
+		if (!_file.valid()) {
+			return;
+		}
+
+		_options.buffer_size = std::max(_options.buffer_size, file_header_length);
+		_options.buffer_count = std::max<std::size_t>(_options.buffer_count, 2U);
+		if (_options.flush_bytes == 0U || _options.flush_bytes > _options.buffer_size) {
+			_options.flush_bytes = _options.buffer_size;
+		}
+
+		/* Appending to a compressed capture would mean rewriting its frame table, and how big it gets isn't known ahead */
+		if (_options.compression != capture_compression_t::Uncompressed) {
+			if (!write_header) {
+				return;
+			}
+			_options.preallocate = 0U;
+			try {
+				_compressor = std::make_unique<libnokogiri::internal::seekable_writer_t>(std::move(_file), _options.compression,
+					libnokogiri::internal::seekable_default_frame_size, 0U, _options.compression_level);
+			} catch (const std::bad_alloc&) {
+				return;
+			}
+			if (!_compressor->valid()) {
+				return;
+			}
+		}
+
+		_position = std::max<off_t>(_file.tell(), 0);
+		_allocated = _position;
+		/* Reserve the first stretch now, so it's done by whoever opens the file and not on the first write */
+		if (_options.preallocate != 0U && _file.allocate(_position, off_t(_options.preallocate))) {
+			_allocated = _position + off_t(_options.preallocate);
+		}
+
+		/* Allocate every buffer up front, so the only allocations later on are for oversized packets */
+		try {
+			_buffers.reserve(_options.buffer_count);
+			for (std::size_t idx{}; idx < _options.buffer_count; ++idx) {
+				_buffers.push_back({std::vector<std::uint8_t>(_options.buffer_size), 0U});
+				if (idx != 0U) {
+					_free.push_back(idx);
+				}
+			}
+		} catch (const std::bad_alloc&) {
+			return;
+		}
+
+		/* Without a thread to write buffers out in the background they're written as they're handed off */
+		try {
+			_flusher = std::thread{&writer_t::flush_thread, this};
+		} catch (const std::system_error&) {
+			/* NOP */
+		}
+
+		/* The file header goes out with the first buffer */
+		_valid = true;
+		if (!write_header) {
+			return;
+		}
+		const auto current = hold_current();
+		std::array<std::uint8_t, file_header_length> raw_header{};
+		encode_file_header(header, false, raw_header.data());
+		const auto dest = reserve(raw_header.size());
+		std::memcpy(dest, raw_header.data(), raw_header.size());
+		_valid = written(raw_header.size(), 0U);
+	}
+
+	writer_t::~writer_t() noexcept {
+		[[maybe_unused]]
+		const auto _ = close();
+	}
+
+	/* Writes a buffer out at the end of the file, keeping the space ahead reserved and syncing as asked */
+	bool writer_t::write_buffer(buffer_t& buffer) noexcept {
+		const auto len = off_t(buffer.used);
+		if (_options.preallocate != 0U && _position + len > _allocated) {
+			const auto allocated = _position + len + off_t(_options.preallocate);
+			/* It's only ever an optimisation, so if it can't be done the file just grows as it's written */
+			if (_file.allocate(_allocated, allocated - _allocated)) {
+				_allocated = allocated;
+			} else {
+				_options.preallocate = 0U;
+			}
+		}
+
+		if (_compressor) {
+			/* Buffers only ever hold whole records, so every frame starts with one */
+			if (!_compressor->write(buffer.data.data(), buffer.used) || !_compressor->end_record()) {
+				return false;
+			}
+		} else if (!_file.writeAll(buffer.data.data(), buffer.used)) {
+			return false;
+		}
+		_position += len;
+		buffer.used = 0U;
+
+		/* Oversized packets grow a buffer, shrink it back so that's not kept around */
+		if (buffer.data.size() > _options.buffer_size) {
+			buffer.data.resize(_options.buffer_size);
+			buffer.data.shrink_to_fit();
+		}
+
+		if (_options.sync_bytes != 0U) {
+			_unsynced += std::uint64_t(len);
+			if (_unsynced >= _options.sync_bytes) {
+				_unsynced = 0U;
+				return output().sync();
+			}
+		}
+		return true;
+	}
+
+	const libnokogiri::internal::fd_t& writer_t::output() const noexcept {
+		return (_compressor) ? _compressor->file() : _file;
+	}
+
+	/* Anything that uses the buffer being filled holds this, it's a no-op unless the flushing thread might hand it off */
+	std::unique_lock<std::mutex> writer_t::hold_current() noexcept {
+		if (_options.flush_interval.count() == 0 || !_flusher.joinable()) {
+			return {};
+		}
+		return std::unique_lock<std::mutex>{_current_lock};
+	}
+
+	void writer_t::flush_thread() noexcept {
+		std::unique_lock<std::mutex> lock{_lock};
+		while (true) {
+			const auto due = _due;
+			const auto woken = [&]() { return _stopping || !_full.empty() || _due != due; };
+			if (due) {
+				_full_ready.wait_until(lock, *due, woken);
+			} else {
+				_full_ready.wait(lock, woken);
+			}
+
+			if (_full.empty()) {
+				if (_stopping) {
+					return;
+				}
+				if (!_due || _due != due || std::chrono::steady_clock::now() < *_due) {
+					continue;
+				}
+
+				/*
+					The buffer being filled is due and the writer hasn't handed it
+					off, so we do it for them. If they're in the middle of using it
+					they'll most likely see it's due themselves, so rather than wait
+					on them, which could be for a free buffer only we can give them,
+					we give them a while to and then look again.
+				*/
+				lock.unlock();
+				std::unique_lock<std::mutex> current{_current_lock, std::try_to_lock};
+				lock.lock();
+				if (!current.owns_lock()) {
+					_full_ready.wait_for(lock, _options.flush_interval, woken);
+					continue;
+				}
+				if (_full.empty() && _due == due) {
+					_due.reset();
+					/* Nothing else is queued, so every other buffer is free */
+					if (!_free.empty()) {
+						_full.push_back(_current);
+						_current = _free.front();
+						_free.pop_front();
+					}
+				}
+				continue;
+			}
+
+			const auto idx = _full.front();
+			_full.pop_front();
+			++_flushing;
+			const bool failed = _error;
+			lock.unlock();
+
+			/* Once anything has failed buffers are just thrown away so the writer never waits on us forever */
+			const bool ok = failed || write_buffer(_buffers[idx]);
+			_buffers[idx].used = 0U;
+
+			lock.lock();
+			_error = _error || !ok;
+			--_flushing;
+			_free.push_back(idx);
+			_free_ready.notify_all();
+		}
+	}
+
+	/* Queues the current buffer to be written and takes the next free one, waiting for one if need be */
+	bool writer_t::hand_off() noexcept {
+		if (_buffers[_current].used == 0U) {
+			return true;
+		}
+
+		if (!_flusher.joinable()) {
+			_valid = _valid && write_buffer(_buffers[_current]);
+			return _valid;
+		}
+
+		std::unique_lock<std::mutex> lock{_lock};
+		_full.push_back(_current);
+		_due.reset();
+		_full_ready.notify_one();
+		_free_ready.wait(lock, [this]() { return !_free.empty(); });
+		_current = _free.front();
+		_free.pop_front();
+
+		_valid = _valid && !_error;
+		return _valid;
+	}
+
+	/* Makes room for `len` bytes at the end of the current buffer */
+	std::uint8_t *writer_t::reserve(const std::size_t len) noexcept {
+		if (_buffers[_current].used + len > _buffers[_current].data.size() && !hand_off()) {
+			return nullptr;
+		}
+
+		auto& buffer = _buffers[_current];
+		if (len > buffer.data.size()) {
+			try {
+				buffer.data.resize(len);
+			} catch (const std::bad_alloc&) {
+				return nullptr;
+			}
+		}
+
+		if (buffer.used == 0U && _options.flush_interval.count() != 0) {
+			_current_started = std::chrono::steady_clock::now();
+		}
+		return buffer.data.data() + buffer.used;
+	}
+
+	/* Accounts for `count` packets taking `len` bytes being put in the current buffer, handing it off if it's due */
+	bool writer_t::written(const std::size_t len, const std::size_t count) noexcept {
+		auto& buffer = _buffers[_current];
+		const bool started = buffer.used == 0U;
+		buffer.used += len;
+		_bytes += len;
+		_packets += count;
+
+		if (buffer.used >= _options.flush_bytes) {
+			return hand_off();
+		}
+		if (_options.flush_interval.count() != 0) {
+			if (std::chrono::steady_clock::now() - _current_started >= _options.flush_interval) {
+				return hand_off();
+			}
+			/* Let the flushing thread know when to come back for it */
+			if (started && _flusher.joinable()) {
+				{
+					const std::lock_guard<std::mutex> lock{_lock};
+					_due = _current_started + _options.flush_interval;
+				}
+				_full_ready.notify_one();
+			}
+		}
+		return true;
+	}
+
+	bool writer_t::write(const std::uint32_t seconds, const std::uint32_t fraction, const void *const data,
+		const std::uint32_t captured_len, const std::uint32_t actual_len) noexcept {
+		if (!_valid) {
+			return false;
+		}
+		const auto current = hold_current();
+
+		const auto record_len = _packet_header_length + captured_len;
+		const auto dest = reserve(record_len);
+		if (dest == nullptr) {
+			return false;
+		}
+
+		const std::array<std::uint32_t, 4> header{{seconds, fraction, captured_len, actual_len}};
+		std::memcpy(dest, header.data(), sizeof(header));
+		if (_packet_header_length != sizeof(header)) {
+			std::memset(dest + sizeof(header), 0, _packet_header_length - sizeof(header));
+		}
+		std::memcpy(dest + _packet_header_length, data, captured_len);
+		return written(record_len, 1U);
+	}
+
+	bool writer_t::write(const packet_t& packet) noexcept {
+		if (!_valid || packet.length() > UINT32_MAX) {
+			return false;
+		}
+		const auto current = hold_current();
+
+		const auto record_len = _packet_header_length + packet.length();
+		const auto dest = reserve(record_len);
+		if (dest == nullptr) {
+			return false;
+		}
+
+		encode_packet_header(packet.header(), _variant, false, std::uint32_t(packet.length()), dest);
+		std::memcpy(dest + _packet_header_length, packet.begin(), packet.length());
+		return written(record_len, 1U);
+	}
+
+	bool writer_t::write_records(const void *const records, const std::size_t len, const std::size_t count) noexcept {
+		if (!_valid) {
+			return false;
+		}
+		const auto current = hold_current();
+
+		const auto dest = reserve(len);
+		if (dest == nullptr) {
+			return false;
+		}
+
+		std::memcpy(dest, records, len);
+		return written(len, count);
+	}
+
+	bool writer_t::flush() noexcept {
+		if (!_valid) {
+			return false;
+		}
+		auto current = hold_current();
+		if (!hand_off()) {
+			return false;
+		}
+		current = {};
+
+		if (_flusher.joinable()) {
+			std::unique_lock<std::mutex> lock{_lock};
+			_free_ready.wait(lock, [this]() { return _full.empty() && _flushing == 0U; });
+			_valid = !_error;
+		}
+		return _valid;
+	}
+
+	bool writer_t::sync() noexcept {
+		if (!flush()) {
+			return false;
+		}
+		/* The flushing thread is idle until something else is handed off */
+		_unsynced = 0U;
+		_valid = output().sync();
+		return _valid;
+	}
+
+	bool writer_t::close() noexcept {
+		if (!output().valid()) {
+			return false;
+		}
+
+		const bool flushed = _valid && flush();
+		if (_flusher.joinable()) {
+			{
+				const std::lock_guard<std::mutex> lock{_lock};
+				_stopping = true;
+			}
+			_full_ready.notify_all();
+			_flusher.join();
+		}
+
+		/* The frame table goes on the end, without it a compressed capture can't be read lazily */
+		const bool finished = !_compressor || (flushed && _compressor->finish());
+		/* Anything we reserved past the end is no longer needed */
+		const bool trimmed = _allocated <= _position || _file.resize(_position);
+		const bool synced = _options.sync_bytes == 0U || output().sync();
+		_compressor.reset();
+		_file = libnokogiri::internal::fd_t{};
+		_valid = false;
+		return flushed && finished && trimmed && synced;
+	}
+}
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+/* pcap/writer.hh - libnokogiri append-only pcap writer */
+#if !defined(LIBNOKOGIRI_PCAP_WRITER_HH)
+#define LIBNOKOGIRI_PCAP_WRITER_HH
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <libnokogiri/config.hh>
+#include <libnokogiri/common.hh>
+
+#include <libnokogiri/internal/defs.hh>
+#include <libnokogiri/internal/fd.hh>
+#include <libnokogiri/internal/fs.hh>
+#include <libnokogiri/internal/seekable.hh>
+
+#include <libnokogiri/pcap/header.hh>
+#include <libnokogiri/pcap/packet.hh>
+
+namespace libnokogiri::pcap {
+	/*! \struct libnokogiri::pcap::writer_options_t
+		\brief How a libnokogiri::pcap::writer_t buffers and flushes
+	*/
+	struct writer_options_t final {
+		/*! The size of each write buffer, packets larger than this still work but cost an allocation */
+		std::size_t buffer_size{1_MiB};
+		/*! How many write buffers there are, once they're all waiting to be written new packets wait for one */
+		std::size_t buffer_count{4U};
+		/*! Hand a buffer off to be written once it holds this many bytes, 0 for when it's full */
+		std::size_t flush_bytes{0U};
+		/*! Hand a buffer off to be written once its oldest packet has been in it this long, 0 to never */
+		std::chrono::milliseconds flush_interval{0};
+		/*! Flush the file out to the disk with fdatasync every time this many bytes have been written, 0 to never */
+		std::uint64_t sync_bytes{0U};
+		/*! Keep this much space reserved past the end of the file with fallocate, 0 to not */
+		std::uint64_t preallocate{0U};
+		/*! \brief Compress the capture as it's written, Uncompressed for not
+
+			The capture is written as a seekable compressed capture, so it can still
+			be read lazily. Each buffer is compressed as it's written out, so that
+			happens on the flushing thread. The sizes the writer reports are of the
+			uncompressed capture, and `preallocate` is ignored.
+		*/
+		capture_compression_t compression{capture_compression_t::Uncompressed};
+		/*! The compression level, if not given the default for the format is used */
+		std::optional<std::int32_t> compression_level{};
+	};
+
+	/*! \struct libnokogiri::pcap::writer_t
+		\brief Append-only pcap writer for recording live captures
+
+		Unlike libnokogiri::pcap::pcap_t this never reads, indexes, or keeps
+		any packets around, it only ever appends, so it can keep up with a
+		live capture.
+
+		Packets are copied into one of a ring of preallocated buffers, and
+		full buffers are written out by a background thread while the next one
+		fills, so writing a packet is a copy and never a system call. A buffer
+		is handed off once it's full, once it holds `flush_bytes`, once the
+		oldest packet in it is older than `flush_interval`, or when flush() is
+		called. The background thread keeps an eye on the age of the buffer
+		being filled, so what a writer that goes quiet has buffered still goes
+		out once it's `flush_interval` old. Without that thread the age is only
+		checked as packets are written.
+
+		Everything is written in our byte order.
+	*/
+	struct LIBNOKOGIRI_CLS_API writer_t final {
+	private:
+		struct buffer_t final {
+			std::vector<std::uint8_t> data;
+			std::size_t used;
+		};
+
+		libnokogiri::internal::fd_t _file;
+		/* Set if the capture is compressed, then it owns the file and _file is unused */
+		std::unique_ptr<libnokogiri::internal::seekable_writer_t> _compressor{};
+		writer_options_t _options;
+		pcap_variant_t _variant;
+		std::size_t _packet_header_length;
+
+		std::vector<buffer_t> _buffers{};
+		/*
+			The buffer being filled, only ever touched by the writing thread
+			unless there's a `flush_interval`. Then the flushing thread can hand it
+			off too, and the writing thread holds _current_lock while using it.
+		*/
+		std::mutex _current_lock{};
+		std::size_t _current{0U};
+		std::chrono::steady_clock::time_point _current_started{};
+
+		/* Everything below is shared with the flushing thread and guarded by _lock */
+		std::mutex _lock{};
+		std::condition_variable _full_ready{};
+		std::condition_variable _free_ready{};
+		std::deque<std::size_t> _full{};
+		std::deque<std::size_t> _free{};
+		/* How many buffers the flushing thread has taken but not given back */
+		std::size_t _flushing{0U};
+		/* When the buffer being filled is due to be handed off, if there's a `flush_interval` and it has anything in it */
+		std::optional<std::chrono::steady_clock::time_point> _due{};
+		bool _stopping{false};
+		bool _error{false};
+		std::thread _flusher{};
+
+		/* Only touched by whichever thread is writing to the file */
+		off_t _position{0};
+		off_t _allocated{0};
+		std::uint64_t _unsynced{0U};
+
+		std::uint64_t _bytes{0U};
+		std::uint64_t _packets{0U};
+		bool _valid{false};
+
+		[[nodiscard]]
+		const libnokogiri::internal::fd_t& output() const noexcept;
+		[[nodiscard]]
+		std::unique_lock<std::mutex> hold_current() noexcept;
+		void flush_thread() noexcept;
+		bool write_buffer(buffer_t& buffer) noexcept;
+		bool hand_off() noexcept;
+		std::uint8_t *reserve(std::size_t len) noexcept;
+		bool written(std::size_t len, std::size_t count) noexcept;
+	public:
+		writer_t() = delete;
+
+		/*! \brief Start writing a capture to an already open file
+
+			The file header is written at the current position of the file.
+
+			\param file The file to write to
+			\param header The file header for the capture, the variant decides the packet header layout
+			\param options How to buffer and flush the capture
+			\param write_header Set to false to carry on appending packets to a capture that already has this header,
+				a compressed capture can't be appended to
+		*/
+		writer_t(libnokogiri::internal::fd_t&& file, const file_header_t& header, const writer_options_t& options = {},
+			bool write_header = true) noexcept;
+
+		/*! \brief Start writing a capture, replacing the file if it exists
+
+			\param file The path to write the capture to
+			\param header The file header for the capture, the variant decides the packet header layout
+			\param options How to buffer and flush the capture
+		*/
+		writer_t(const libnokogiri::internal::fs::path& file, const file_header_t& header, const writer_options_t& options = {}) noexcept :
+			writer_t{libnokogiri::internal::fd_t{file, O_WRONLY | O_CREAT | O_TRUNC, libnokogiri::internal::normalMode}, header, options}
+			{ /* NOP */ }
+
+		writer_t(const writer_t&) = delete;
+		writer_t& operator=(const writer_t&) = delete;
+
+		/* The flushing thread holds on to this, so it can't move */
+		writer_t(writer_t&&) = delete;
+		writer_t& operator=(writer_t&&) = delete;
+
+		~writer_t() noexcept;
+
+		/*! Check if everything so far has been written, once anything fails this stays false */
+		[[nodiscard]]
+		bool valid() const noexcept { return _valid; }
+
+		[[nodiscard]]
+		pcap_variant_t variant() const noexcept { return _variant; }
+
+		/*! Retrieve how many bytes have been written, including the file header and anything still buffered */
+		[[nodiscard]]
+		std::uint64_t bytes_written() const noexcept { return _bytes; }
+
+		/*! Retrieve how many packets have been written, including anything still buffered */
+		[[nodiscard]]
+		std::uint64_t packets_written() const noexcept { return _packets; }
+
+		/*! \brief Append a packet
+
+			\param seconds The seconds part of the timestamp
+			\param fraction The micro or nanoseconds part of the timestamp, depending on the variant
+			\param data The packet data
+			\param captured_len How much packet data there is
+			\param actual_len How long the packet was on the wire
+		*/
+		[[nodiscard]]
+		bool write(std::uint32_t seconds, std::uint32_t fraction, const void *data, std::uint32_t captured_len, std::uint32_t actual_len) noexcept;
+
+		/*! Append a packet, along with the rest of its header if it's from a modified capture */
+		[[nodiscard]]
+		bool write(const packet_t& packet) noexcept;
+
+		/*! \brief Append packet records that are already encoded
+
+			They have to be whole records in this capture's variant and our byte
+			order, like those copied out of another capture of the same kind.
+
+			\param records The records
+			\param len The length of all of the records together
+			\param count How many packets that is
+		*/
+		[[nodiscard]]
+		bool write_records(const void *records, std::size_t len, std::size_t count) noexcept;
+
+		/*! Hand off what's buffered and wait until it has all been written to the file */
+		[[nodiscard]]
+		bool flush() noexcept;
+
+		/*! Flush, and then flush the file out to the disk */
+		[[nodiscard]]
+		bool sync() noexcept;
+
+		/*! \brief Flush and close the file
+
+			Any space reserved past the end of the file is given back. Nothing can
+			be written after this.
+		*/
+		[[nodiscard]]
+		bool close() noexcept;
+	};
+}
+
+#endif /* LIBNOKOGIRI_PCAP_WRITER_HH */
@@ -4,20 +4,54 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <array>
+#include <iterator>
+#include <vector>
+#include <optional>
+#include <chrono>
+#include <thread>
+#include <utility>
 
 #include <libnokogiri/pcap.hh>
 
+#include <libnokogiri/internal/compression.hh>
 #include <libnokogiri/internal/fs.hh>
+#include <libnokogiri/internal/seekable.hh>
+
+extern "C" {
+	#include <zlib.h>
+}
 
 namespace fs = libnokogiri::internal::fs;
 
-int read(fs::path file);
+std::optional<std::vector<std::uint8_t>> load_capture(const fs::path& file);
+std::vector<std::uint8_t> read_file(const fs::path& file);
+std::uint32_t packet_seconds(const libnokogiri::pcap::packet_t& packet);
+int read(fs::path file, bool prefetch = false, bool mapped = false);
+int stream(fs::path file);
+int index(fs::path in, fs::path out);
+int lazy(fs::path in, fs::path out);
+int members(fs::path in, fs::path out);
+int recompress(fs::path in, fs::path out);
+int seekable(fs::path in, fs::path out);
+int time_search(fs::path file);
+int cache(fs::path file);
+int batch(fs::path file, bool prefetch);
 int write(fs::path in, fs::path out);
+int append(fs::path in, fs::path out);
+int rotate(fs::path in, fs::path out);
+int prune(fs::path in, fs::path out);
+int extract(fs::path in, fs::path out);
+int merge(fs::path in, fs::path out);
+int sort(fs::path in, fs::path out);
+int split(fs::path in, fs::path out);
 
 
 int main(int argc, char** argv) {
 	if (argc < 3) {
-		std::cout << "Usage: " << argv[0] << " [-r|-w] input file [output file (if -w is specified)]" << std::endl;
+		std::cout << "Usage: " << argv[0] << " [-r|-p|-m|-s|-t|-c|-b|-B|-i|-l|-g|-z|-S|-w|-a|-R|-x|-e|-M|-O|-T] input file [output directory (if -i, -l, -g, -z, -S, -w, -a, -R, -x, -e, -M, -O, or -T is specified)]" << std::endl;
 		return 1;
 	}
 
@@ -25,21 +59,130 @@ int main(int argc, char** argv) {
 		return read(fs::path{argv[2]});
 	}
 
+	if (std::strncmp(argv[1], "-p", 2) == 0) {
+		return read(fs::path{argv[2]}, true);
+	}
+
+	if (std::strncmp(argv[1], "-m", 2) == 0) {
+		return read(fs::path{argv[2]}, false, true);
+	}
+
+	if (std::strncmp(argv[1], "-s", 2) == 0) {
+		return stream(fs::path{argv[2]});
+	}
+
+	if (std::strncmp(argv[1], "-t", 2) == 0) {
+		return time_search(fs::path{argv[2]});
+	}
+
+	if (std::strncmp(argv[1], "-c", 2) == 0) {
+		return cache(fs::path{argv[2]});
+	}
+
+	if (std::strncmp(argv[1], "-b", 2) == 0) {
+		return batch(fs::path{argv[2]}, false);
+	}
+
+	if (std::strncmp(argv[1], "-B", 2) == 0) {
+		return batch(fs::path{argv[2]}, true);
+	}
+
+	if (std::strncmp(argv[1], "-i", 2) == 0 && argc > 3) {
+		return index(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-l", 2) == 0 && argc > 3) {
+		return lazy(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-g", 2) == 0 && argc > 3) {
+		return members(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-z", 2) == 0 && argc > 3) {
+		return recompress(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-S", 2) == 0 && argc > 3) {
+		return seekable(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
 	if (std::strncmp(argv[1], "-w", 2) == 0) {
 		return write(fs::path{argv[2]}, fs::path{argv[3]});
 	}
 
+	if (std::strncmp(argv[1], "-a", 2) == 0 && argc > 3) {
+		return append(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-R", 2) == 0 && argc > 3) {
+		return rotate(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-x", 2) == 0 && argc > 3) {
+		return prune(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-e", 2) == 0 && argc > 3) {
+		return extract(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-M", 2) == 0 && argc > 3) {
+		return merge(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-O", 2) == 0 && argc > 3) {
+		return sort(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
+	if (std::strncmp(argv[1], "-T", 2) == 0 && argc > 3) {
+		return split(fs::path{argv[2]}, fs::path{argv[3]});
+	}
+
 	return 1;
 }
 
+/* The whole of a capture uncompressed, gzread() passes uncompressed files through as-is, so this works for either */
+std::optional<std::vector<std::uint8_t>> load_capture(const fs::path& file) {
+	auto gz = gzopen(file.c_str(), "rb");
+	if (gz == nullptr) {
+		return std::nullopt;
+	}
+
+	std::vector<std::uint8_t> capture{};
+	std::array<std::uint8_t, 64 * 1024> chunk{};
+	int len{};
+	while ((len = gzread(gz, chunk.data(), chunk.size())) > 0) {
+		capture.insert(capture.end(), chunk.begin(), chunk.begin() + len);
+	}
+	gzclose(gz);
+	if (len < 0) {
+		return std::nullopt;
+	}
+	return capture;
+}
+
+/* The raw bytes of a file, or nothing if it can't be read */
+std::vector<std::uint8_t> read_file(const fs::path& file) {
+	libnokogiri::internal::fd_t fd{file, O_RDONLY};
+	std::vector<std::uint8_t> data(std::size_t(std::max<off_t>(fd.length(), 0)));
+	return (fd.valid() && fd.pread(data.data(), data.size(), 0)) ? data : std::vector<std::uint8_t>{};
+}
 
+/* The whole seconds of a packet's timestamp, whichever sort of header it has */
+std::uint32_t packet_seconds(const libnokogiri::pcap::packet_t& packet) {
+	if (const auto header = std::get_if<libnokogiri::pcap::packet_header_modified_t>(&packet.header())) {
+		return header->base_header().timestamp();
+	}
+	return std::get<libnokogiri::pcap::packet_header_t>(packet.header()).timestamp();
+}
 
-int read(fs::path file) {
+int read(fs::path file, bool prefetch, bool mapped) {
 	if (!fs::exists(file) || !fs::is_regular_file(file)) {
 		std::cerr << "Unable to find file " << file << '\n';
 	}
 
-	libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true};
+	libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true, prefetch, mapped};
 
 	if (!capture.valid()) {
 		std::cerr << "Capture file " << file << " is not valid \n";
@@ -78,17 +221,1771 @@ int read(fs::path file) {
 
 	}
 
+	static_assert(std::is_same_v<std::iterator_traits<libnokogiri::pcap::pcap_t::iterator_t>::iterator_category,
+		std::random_access_iterator_tag>);
+	static_assert(std::is_same_v<std::iterator_traits<libnokogiri::pcap::pcap_t::const_iterator_t>::iterator_category,
+		std::random_access_iterator_tag>);
+
+	const auto& const_capture = capture;
+	if (std::size_t(const_capture.cend() - const_capture.cbegin()) != capture.packet_count() ||
+		!std::all_of(const_capture.begin(), const_capture.end(), [](const auto& pkt) { return pkt && pkt->length() != 0; })) {
+		return 1;
+	}
+
+	/* Several threads reading the whole capture at once, each in its own order, all see what one thread does */
+	const auto count = const_capture.packet_count();
+	const auto checksum = [](const libnokogiri::pcap::packet_t& packet) {
+		return std::accumulate(packet.begin(), packet.end(), std::uint64_t(packet.length()));
+	};
+	std::vector<std::uint64_t> sums(count);
+	for (std::size_t idx{}; idx < count; ++idx) {
+		const auto packet = const_capture.read_packet(idx);
+		if (!packet) {
+			return 1;
+		}
+		sums[idx] = checksum(*packet);
+	}
+
+	std::array<bool, 4> matched{};
+	std::array<std::thread, 4> readers{};
+	for (std::size_t reader{}; reader < readers.size(); ++reader) {
+		readers[reader] = std::thread{[&, reader]() {
+			matched[reader] = true;
+			for (std::size_t n{}; n < count; ++n) {
+				const auto idx = (reader % 2U == 0U) ? (n + reader * count / readers.size()) % count : count - 1U - n;
+				const auto packet = const_capture.read_packet(idx);
+				if (!packet || checksum(*packet) != sums[idx]) {
+					matched[reader] = false;
+					return;
+				}
+			}
+		}};
+	}
+	for (auto& reader : readers) {
+		reader.join();
+	}
+	if (!std::all_of(matched.begin(), matched.end(), [](const bool ok) { return ok; })) {
+		return 1;
+	}
+
+	/* Writing to a packet that was read out of the capture never writes to the capture */
+	if (auto scratch = const_capture.read_packet(0U); scratch) {
+		std::fill(scratch->begin(), scratch->end(), std::uint8_t(~*std::as_const(*scratch).begin()));
+		if (checksum(*const_capture.read_packet(0U)) != sums[0U] || scratch->is_view()) {
+			return 1;
+		}
+	}
+
+	/* Cached packets aren't copied out of an image until they're written to */
+	if (auto cached = capture.get_packet(1U); !cached || cached->get().is_view() != capture.in_memory() ||
+		checksum(std::as_const(cached->get())) != sums[1U]) {
+		return 1;
+	}
+
+	return {};
+}
+
+int stream(fs::path file) {
+	if (!fs::exists(file) || !fs::is_regular_file(file)) {
+		std::cerr << "Unable to find file " << file << '\n';
+	}
+
+	libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true};
+	libnokogiri::pcap::stream_reader_t reader{file};
+
+	if (!capture.valid() || !reader.valid()) {
+		std::cerr << "Capture file " << file << " is not valid \n";
+		return 1;
+	}
+
+	std::size_t packets{};
+	while (auto pkt = reader.next()) {
+		auto ref = capture.get_packet(packets++);
+		if (!ref || ref->get().length() != pkt->length() ||
+			!std::equal(pkt->begin(), pkt->end(), ref->get().begin())) {
+			return 1;
+		}
+	}
+
+	if (!reader.eof() || packets != capture.packet_count()) {
+		return 1;
+	}
+
+	/* A pipe that hands over a single byte at first still has its compression sniffed right */
+	std::array<int, 2> ends{};
+	if (::pipe(ends.data()) != 0) {
+		return 1;
+	}
+	std::thread feeder{[&]() {
+		libnokogiri::internal::fd_t source{file, O_RDONLY};
+		libnokogiri::internal::fd_t sink{ends[1]};
+		std::array<std::uint8_t, 4096> chunk{};
+		for (std::size_t want{1U};; want = chunk.size()) {
+			const auto len = source.read(chunk.data(), want, nullptr);
+			if (len <= 0 || !sink.write(chunk.data(), std::size_t(len))) {
+				return;
+			}
+			if (want == 1U) {
+				std::this_thread::sleep_for(std::chrono::milliseconds{20});
+			}
+		}
+	}};
+	std::size_t piped_packets{};
+	{
+		/* The read end has to be closed before joining, else a reader that gives up leaves the feeder blocked */
+		libnokogiri::pcap::stream_reader_t piped{libnokogiri::internal::fd_t{ends[0]}};
+		while (piped.valid() && piped.next()) {
+			++piped_packets;
+		}
+	}
+	feeder.join();
+	if (piped_packets != capture.packet_count()) {
+		return 1;
+	}
+
 	return {};
 }
 
-int write(fs::path in, fs::path out) {
-	if (!fs::exists(in) || !fs::is_regular_file(in)) {
+int index(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
 		return 1;
 	}
 
-	if (!fs::is_directory(out)) {
+	/* Work on a copy so the sidecar doesn't end up next to the test data */
+	auto file = out / in.filename();
+	fs::copy_file(in, file, fs::copy_options::overwrite_existing);
+	auto sidecar = file;
+	sidecar += ".nkidx";
+	fs::remove(sidecar);
+
+	libnokogiri::pcap::pcap_t first{file, libnokogiri::capture_compression_t::Autodetect, true, false, false, true};
+	if (!first.valid() || !fs::exists(sidecar)) {
+		return 1;
+	}
+
+	/* The sidecar has the timestamp column as well as the offsets, so searching by time doesn't read the capture again */
+	if (first.packet_count() > 8U && fs::file_size(sidecar) < 16U * first.packet_count()) {
+		return 1;
+	}
+
+	libnokogiri::pcap::pcap_t second{file, libnokogiri::capture_compression_t::Autodetect, true, false, false, true};
+	if (!second.valid() || second.packet_count() != first.packet_count()) {
+		return 1;
+	}
+
+	libnokogiri::pcap::pcap_t reference{in, libnokogiri::capture_compression_t::Autodetect, true};
+	std::vector<libnokogiri::pcap::packet_descriptor_t> descriptors(1U);
+	std::vector<std::uint8_t> buffer(256U * 1024U);
+	for (std::size_t idx{}; idx < first.packet_count(); ++idx) {
+		auto a = first.read_packet(idx);
+		auto b = second.read_packet(idx);
+		if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+			return 1;
+		}
+
+		if (reference.read_batch(idx, 1U, buffer.data(), buffer.size(), descriptors.data()) != 1U) {
+			return 1;
+		}
+		const auto timestamp = descriptors[0].timestamp();
+		if (second.lower_bound_time(timestamp) != reference.lower_bound_time(timestamp)) {
+			return 1;
+		}
+	}
+
+	/* A sidecar with records out of order or past the end still loads, only those records can't be read */
+	if (first.packet_count() > 8U) {
+		/* The offset column starts straight after the 64 byte sidecar header */
+		constexpr off_t column{64};
+		const auto last = column + off_t(8U * (first.packet_count() - 1U));
+		const std::uint64_t past_end{UINT64_MAX / 2U};
+		std::array<std::uint64_t, 2> swapped{};
+		libnokogiri::internal::fd_t index_file{sidecar, O_RDWR};
+		if (!index_file.pread(swapped.data(), sizeof(swapped), column + 8)) {
+			return 1;
+		}
+		std::swap(swapped[0], swapped[1]);
+		if (index_file.seek(column + 8, SEEK_SET) != column + 8 || !index_file.write(swapped.data(), sizeof(swapped)) ||
+			index_file.seek(last, SEEK_SET) != last || !index_file.write(&past_end, sizeof(past_end))) {
+			return 1;
+		}
+
+		for (const bool mapped : {false, true}) {
+			libnokogiri::pcap::pcap_t damaged{file, libnokogiri::capture_compression_t::Autodetect, true, false, mapped, true};
+			const auto count = damaged.packet_count();
+			if (!damaged.valid() || count != first.packet_count() || !damaged.read_packet(0U) || damaged.read_packet(1U) ||
+				!damaged.read_packet(2U) || damaged.read_packet(count - 2U) || damaged.read_packet(count - 1U) ||
+				damaged.read_batch(0U, count, buffer.data(), buffer.size(), descriptors.data()) != 1U) {
+				return 1;
+			}
+		}
+	}
+
+	fs::remove(sidecar);
+	fs::remove(file);
+	return {};
+}
+
+int lazy(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	auto file = out / in.filename();
+	file += ".lazy"sv;
+	fs::copy_file(in, file, fs::copy_options::overwrite_existing);
+	auto sidecar = file;
+	sidecar += ".nkidx";
+	fs::remove(sidecar);
+
+	libnokogiri::pcap::pcap_t reference{in, libnokogiri::capture_compression_t::Autodetect, true};
+	if (!reference.valid()) {
+		return 1;
+	}
+
+	/* The first open builds the checkpoints, the second gets them from the sidecar */
+	for (std::size_t pass{}; pass < 2U; ++pass) {
+		libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true, false, false, true, true};
+		if (!capture.valid() || capture.packet_count() != reference.packet_count() ||
+			capture.lazily_decompressed() != (reference.compression_type() == libnokogiri::capture_compression_t::Compressed)) {
+			return 1;
+		}
+
+		const auto compare = [&](const std::size_t idx) {
+			auto a = capture.read_packet(idx);
+			auto b = reference.read_packet(idx);
+			return a && b && a->length() == b->length() && std::equal(a->begin(), a->end(), b->begin());
+		};
+
+		/* Forwards carries on from the last read, backwards has to go back to a checkpoint */
+		for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+			if (!compare(idx)) {
+				return 1;
+			}
+		}
+		for (std::size_t idx{capture.packet_count()}; idx > 0U; idx -= std::min<std::size_t>(idx, 97U)) {
+			if (!compare(idx - 1U)) {
+				return 1;
+			}
+		}
+	}
+
+	fs::remove(sidecar);
+	fs::remove(file);
+	return {};
+}
+
+int members(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	const auto loaded = load_capture(in);
+	if (!loaded || loaded->size() < 24U) {
+		return 1;
+	}
+	const auto& capture = *loaded;
+
+	/*
+		Repeat the packets enough times that the compressed file is split over
+		several threads, and write it out as lots of small members like
+		concatenated rotated captures would be.
+	*/
+	constexpr std::size_t repeats{8U};
+	constexpr std::size_t member_size{256U * 1024U};
+	std::vector<std::uint8_t> body{capture.begin(), capture.begin() + 24};
+	for (std::size_t repeat{}; repeat < repeats; ++repeat) {
+		body.insert(body.end(), capture.begin() + 24, capture.end());
+	}
+
+	auto file = out / in.filename();
+	file += ".members.gz"sv;
+	fs::remove(file);
+	for (std::size_t offset{}; offset < body.size(); offset += member_size) {
+		auto gz = gzopen(file.c_str(), "ab1");
+		const auto len = std::min(member_size, body.size() - offset);
+		if (gz == nullptr || gzwrite(gz, body.data() + offset, unsigned(len)) != int(len) || gzclose(gz) != Z_OK) {
+			return 1;
+		}
+	}
+
+	libnokogiri::pcap::pcap_t reference{in, libnokogiri::capture_compression_t::Autodetect, true};
+	libnokogiri::pcap::pcap_t multi{file, libnokogiri::capture_compression_t::Autodetect, true};
+	if (!reference.valid() || !multi.valid() || multi.packet_count() != reference.packet_count() * repeats) {
+		return 1;
+	}
+
+	for (std::size_t idx{}; idx < multi.packet_count(); ++idx) {
+		auto a = multi.read_packet(idx);
+		auto b = reference.read_packet(idx % reference.packet_count());
+		if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+			return 1;
+		}
+	}
+
+	/* Padding after the last member is ignored whether the capture is decompressed up front or lazily */
+	{
+		const std::array<std::uint8_t, 512> padding{};
+		libnokogiri::internal::fd_t padded{file, O_WRONLY | O_APPEND};
+		if (!padded.write(padding.data(), padding.size())) {
+			return 1;
+		}
+	}
+	for (const bool lazily : {false, true}) {
+		libnokogiri::pcap::pcap_t padded{file, libnokogiri::capture_compression_t::Autodetect, true, false, false, false, lazily};
+		if (!padded.valid() || padded.packet_count() != multi.packet_count()) {
+			return 1;
+		}
+		const auto last = padded.packet_count() - 1U;
+		auto a = padded.read_packet(last);
+		auto b = reference.read_packet(last % reference.packet_count());
+		if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+			return 1;
+		}
+	}
+
+	fs::remove(file);
+	return {};
+}
+
+int recompress(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	const auto loaded = load_capture(in);
+	if (!loaded) {
+		return 1;
+	}
+	const auto& capture = *loaded;
+
+	libnokogiri::pcap::pcap_t reference{in, libnokogiri::capture_compression_t::Autodetect, true};
+	if (!reference.valid()) {
+		return 1;
+	}
+
+#if defined(LIBNOKOGIRI_ZSTD)
+	constexpr bool zstd_supported{true};
+#else
+	constexpr bool zstd_supported{false};
+#endif
+#if defined(LIBNOKOGIRI_LZ4)
+	constexpr bool lz4_supported{true};
+#else
+	constexpr bool lz4_supported{false};
+#endif
+
+	for (const auto compression : {libnokogiri::capture_compression_t::ZStandard, libnokogiri::capture_compression_t::LZ4}) {
+		const bool supported = (compression == libnokogiri::capture_compression_t::ZStandard) ? zstd_supported : lz4_supported;
+		libnokogiri::internal::compressor_t compressor{compression};
+		if (compressor.valid() != supported || libnokogiri::internal::decompressor_t{compression}.valid() != supported) {
+			return 1;
+		}
+
+		auto file = out / in.filename();
+		file += (compression == libnokogiri::capture_compression_t::ZStandard) ? ".zst"sv : ".lz4"sv;
+
+		/* Without the library, a capture that only looks compressed is turned away rather than read as something else */
+		if (!supported) {
+			constexpr std::array<std::uint8_t, 4> zstd_magic{{0x28U, 0xB5U, 0x2FU, 0xFDU}};
+			constexpr std::array<std::uint8_t, 4> lz4_magic{{0x04U, 0x22U, 0x4DU, 0x18U}};
+			const auto& magic = (compression == libnokogiri::capture_compression_t::ZStandard) ? zstd_magic : lz4_magic;
+			{
+				libnokogiri::internal::fd_t fd{file, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR};
+				if (!fd.valid() || !fd.write(magic.data(), magic.size()) || !fd.write(capture.data(), capture.size())) {
+					return 1;
+				}
+			}
+
+			libnokogiri::pcap::pcap_t capture_file{file, libnokogiri::capture_compression_t::Autodetect, true};
+			libnokogiri::pcap::stream_reader_t reader{file};
+			if (capture_file.valid() || reader.valid() || reader.next()) {
+				return 1;
+			}
+			fs::remove(file);
+			continue;
+		}
+
+		/* Finish a frame every so often so reading has to deal with concatenated frames */
+		constexpr std::size_t frame_size{1024U * 1024U};
+		std::vector<std::uint8_t> compressed{};
+		for (std::size_t offset{}; offset < capture.size(); offset += frame_size) {
+			const auto len = std::min(frame_size, capture.size() - offset);
+			if (!compressor.compress(capture.data() + offset, len, compressed) || !compressor.finish(compressed)) {
+				return 1;
+			}
+		}
+
+		{
+			libnokogiri::internal::fd_t fd{file, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR};
+			if (!fd.valid() || !fd.write(compressed.data(), compressed.size())) {
+				return 1;
+			}
+		}
+
+		libnokogiri::pcap::pcap_t capture_file{file, libnokogiri::capture_compression_t::Autodetect, true};
+		libnokogiri::pcap::stream_reader_t reader{file};
+		if (!capture_file.valid() || capture_file.compression_type() != compression || !reader.valid() ||
+			reader.compression_type() != compression || capture_file.packet_count() != reference.packet_count()) {
+			return 1;
+		}
+
+		for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+			auto a = capture_file.read_packet(idx);
+			auto b = reference.read_packet(idx);
+			auto c = reader.next();
+			if (!a || !b || !c || a->length() != b->length() || c->length() != b->length() ||
+				!std::equal(a->begin(), a->end(), b->begin()) || !std::equal(c->begin(), c->end(), b->begin())) {
+				return 1;
+			}
+		}
+		if (reader.next() || !reader.eof()) {
+			return 1;
+		}
+
+		fs::remove(file);
+	}
+
+	return {};
+}
+
+int seekable(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	const auto loaded = load_capture(in);
+	if (!loaded) {
+		return 1;
+	}
+	const auto& capture = *loaded;
+
+	libnokogiri::pcap::pcap_t reference{in, libnokogiri::capture_compression_t::Autodetect, true};
+	if (!reference.valid() || reference.packet_count() == 0U) {
+		return 1;
+	}
+
+	const auto compare = [&](const libnokogiri::pcap::pcap_t& capture, const std::size_t idx) {
+		auto a = capture.read_packet(idx);
+		auto b = reference.read_packet(idx);
+		return a && b && a->length() == b->length() && std::equal(a->begin(), a->end(), b->begin());
+	};
+
+	using libnokogiri::capture_compression_t;
+	for (const auto compression : {capture_compression_t::Compressed, capture_compression_t::ZStandard, capture_compression_t::LZ4}) {
+		/* Cut frames by size, and by packet count */
+		for (const auto& [frame_size, frame_records] : {std::pair<std::size_t, std::size_t>{256U * 1024U, 0U}, {64U * 1024U * 1024U, 100U}}) {
+			/* The file header and then every packet record are written as records of their own */
+			const auto write = [&](const fs::path& file, const std::size_t threads) -> std::optional<std::size_t> {
+				libnokogiri::internal::seekable_writer_t writer{
+					libnokogiri::internal::fd_t{file, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR},
+					compression, frame_size, frame_records, std::nullopt, threads, 2U
+				};
+				if (!writer.valid()) {
+					return std::nullopt;
+				}
+
+				const auto pkt_hdr_len = libnokogiri::pcap::packet_header_length(reference.header().variant());
+				std::size_t offset{24U};
+				bool written = writer.write(capture.data(), offset) && writer.end_record();
+				for (std::size_t idx{}; written && idx < reference.packet_count(); ++idx) {
+					const auto len = pkt_hdr_len + reference.read_packet(idx)->length();
+					written = offset + len <= capture.size() && writer.write(capture.data() + offset, len) && writer.end_record();
+					offset += len;
+				}
+				if (!written || offset != capture.size() || !writer.finish()) {
+					return 0U;
+				}
+				return writer.frames().size();
+			};
+
+			auto file = out / in.filename();
+			file += ".seekable"sv;
+			const auto frames = write(file, 1U);
+			/* Not built with support for this one */
+			if (!frames) {
+				continue;
+			}
+			if (*frames < 2U) {
+				return 1;
+			}
+
+			/* Compressing on other threads has to give exactly the same capture */
+			{
+				auto threaded = file;
+				threaded += ".threaded"sv;
+				if (write(threaded, 4U) != frames) {
+					return 1;
+				}
+				libnokogiri::internal::fd_t a{file, O_RDONLY};
+				libnokogiri::internal::fd_t b{threaded, O_RDONLY};
+				std::vector<std::uint8_t> a_data(std::size_t(std::max<off_t>(a.length(), 0)));
+				std::vector<std::uint8_t> b_data(std::size_t(std::max<off_t>(b.length(), 0)));
+				if (a_data.size() != b_data.size() || !a.pread(a_data.data(), a_data.size(), 0) ||
+					!b.pread(b_data.data(), b_data.size(), 0) || a_data != b_data) {
+					return 1;
+				}
+				fs::remove(threaded);
+			}
+
+			/* It has to still be an ordinary compressed capture */
+			{
+				libnokogiri::internal::fd_t compressed{file, O_RDONLY};
+				auto plain = libnokogiri::internal::fd_t::makemem();
+				std::vector<std::uint8_t> decompressed(capture.size());
+				if (libnokogiri::internal::detect_captrue_compression(compressed) != compression ||
+					libnokogiri::internal::decompress_to(compressed, plain, compression) != off_t(capture.size()) ||
+					!plain.pread(decompressed.data(), decompressed.size(), 0) || decompressed != capture) {
+					return 1;
+				}
+			}
+
+			libnokogiri::pcap::pcap_t eager{file, capture_compression_t::Autodetect, true};
+			libnokogiri::pcap::pcap_t lazy{file, capture_compression_t::Autodetect, true, false, false, false, true};
+			if (!eager.valid() || !lazy.valid() || !lazy.lazily_decompressed() ||
+				eager.packet_count() != reference.packet_count() || lazy.packet_count() != reference.packet_count()) {
+				return 1;
+			}
+
+			for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+				if (!compare(eager, idx) || !compare(lazy, idx)) {
+					return 1;
+				}
+			}
+			/* Jumping backwards has to go back to the right frame */
+			for (std::size_t idx{reference.packet_count()}; idx > 0U; idx -= std::min<std::size_t>(idx, 97U)) {
+				if (!compare(lazy, idx - 1U)) {
+					return 1;
+				}
+			}
+
+			/* A frame that claims to be bigger than any the writer makes isn't believed */
+			if (compression == capture_compression_t::Compressed) {
+				libnokogiri::internal::fd_t patched{file, O_RDWR};
+				const std::array<std::uint8_t, 4> huge{{0x00U, 0x00U, 0x00U, 0x80U}};
+				if (!libnokogiri::internal::seekable_frames(patched, compression) || patched.seek(20, SEEK_SET) != 20 ||
+					!patched.write(huge.data(), huge.size()) || libnokogiri::internal::seekable_frames(patched, compression)) {
+					return 1;
+				}
+			}
+
+			fs::remove(file);
+		}
+	}
+
+	return {};
+}
+
+int time_search(fs::path file) {
+	if (!fs::exists(file) || !fs::is_regular_file(file)) {
+		std::cerr << "Unable to find file " << file << '\n';
+	}
+
+	libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true};
+	if (!capture.valid() || capture.packet_count() == 0) {
+		return 1;
+	}
+
+	std::vector<std::uint64_t> timestamps{};
+	for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+		auto pkt = capture.read_packet(idx);
+		if (!pkt) {
+			return 1;
+		}
+		const auto& hdr = std::get<libnokogiri::pcap::packet_header_t>(pkt->header());
+		timestamps.push_back(libnokogiri::pcap::timestamp_ns(hdr.timestamp(), hdr.useconds(), capture.header().variant()));
+	}
+
+	const auto [first, last] = std::minmax_element(timestamps.begin(), timestamps.end());
+	if (capture.time_sorted() != std::is_sorted(timestamps.begin(), timestamps.end())) {
 		return 1;
 	}
 
+	/* Walk a window across the capture and check it against a linear scan */
+	const auto span = *last - *first;
+	for (std::uint64_t step{}; step <= 16U; ++step) {
+		const auto begin = *first + (span / 16U) * step;
+		const auto end = begin + span / 4U + 1U;
+
+		const auto packets = capture.range_by_time(begin, end);
+		const auto expected = std::count_if(timestamps.begin(), timestamps.end(), [&](const std::uint64_t ts) {
+			return ts >= begin && ts < end;
+		});
+		if (packets.size() != std::size_t(expected)) {
+			return 1;
+		}
+
+		for (std::size_t idx{}; idx < packets.size(); ++idx) {
+			const auto ts = timestamps[packets[idx]];
+			if (ts < begin || ts >= end || (idx != 0 && ts < timestamps[packets[idx - 1]])) {
+				return 1;
+			}
+		}
+
+		const auto lower = capture.lower_bound_time(begin);
+		if (!lower || timestamps[*lower] < begin || (!packets.empty() && *lower != packets.front())) {
+			return 1;
+		}
+	}
+
+	if (capture.lower_bound_time(*last + 1U)) {
+		return 1;
+	}
+
+	return {};
+}
+
+int cache(fs::path file) {
+	if (!fs::exists(file) || !fs::is_regular_file(file)) {
+		std::cerr << "Unable to find file " << file << '\n';
+	}
+
+	libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true};
+	if (!capture.valid()) {
+		return 1;
+	}
+
+	/* Small enough that every pass has to evict */
+	constexpr std::size_t budget{16384U};
+	capture.cache_budget(budget);
+
+	for (std::size_t pass{}; pass < 2U; ++pass) {
+		for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+			auto pkt = capture.get_packet(idx);
+			auto ref = capture.read_packet(idx);
+			if (!pkt || !ref || pkt->get().length() != ref->length() ||
+				!std::equal(ref->begin(), ref->end(), pkt->get().begin())) {
+				return 1;
+			}
+
+			/* The most recent packet is always kept, even if it alone is over budget */
+			if (capture.cache_usage() > std::max<std::size_t>(budget, sizeof(libnokogiri::pcap::packet_t) + pkt->get().length())) {
+				return 1;
+			}
+		}
+	}
+
+	capture.clear_cache();
+	if (capture.cache_usage() != 0U) {
+		return 1;
+	}
+
+	return {};
+}
+
+int batch(fs::path file, bool prefetch) {
+	if (!fs::exists(file) || !fs::is_regular_file(file)) {
+		std::cerr << "Unable to find file " << file << '\n';
+	}
+
+	libnokogiri::pcap::pcap_t capture{file, libnokogiri::capture_compression_t::Autodetect, true, prefetch};
+	if (!capture.valid()) {
+		return 1;
+	}
+
+	constexpr std::size_t batch_size{64U};
+	std::vector<std::uint8_t> buffer(64U * 1024U);
+	std::vector<libnokogiri::pcap::packet_descriptor_t> descriptors(batch_size);
+
+	std::size_t idx{};
+	while (idx < capture.packet_count()) {
+		const auto count = capture.read_batch(idx, batch_size, buffer.data(), buffer.size(), descriptors.data());
+		if (count == 0U) {
+			return 1;
+		}
+
+		for (std::size_t pkt{}; pkt < count; ++pkt) {
+			const auto& desc = descriptors[pkt];
+			auto ref = capture.read_packet(idx + pkt);
+			if (!ref || desc.captured_len() != ref->length() ||
+				!std::equal(ref->begin(), ref->end(), buffer.begin() + std::ptrdiff_t(desc.offset()))) {
+				return 1;
+			}
+
+			/* The packet data is packed back to back */
+			if (pkt != 0U && desc.offset() != descriptors[pkt - 1U].offset() + descriptors[pkt - 1U].captured_len()) {
+				return 1;
+			}
+		}
+		idx += count;
+	}
+
+	return (capture.read_batch(idx, batch_size, buffer.data(), buffer.size(), descriptors.data()) == 0U) ? 0 : 1;
+}
+
+int write(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in)) {
+		return 1;
+	}
+
+	if (!fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	libnokogiri::pcap::pcap_t reference{in, capture_compression_t::Autodetect, true};
+	if (!reference.valid()) {
+		return 1;
+	}
+
+	/* Every packet has to match the reference, bar the ones in `changed` which have their data flipped */
+	const auto check = [&](fs::path file, const std::vector<std::size_t>& changed) {
+		libnokogiri::pcap::pcap_t capture{file, capture_compression_t::Autodetect, true};
+		if (!capture.valid() || capture.packet_count() != reference.packet_count()) {
+			return false;
+		}
+
+		for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+			auto a = capture.read_packet(idx);
+			auto b = reference.read_packet(idx);
+			if (!a || !b || a->length() != b->length()) {
+				return false;
+			}
+
+			const bool flipped = std::find(changed.begin(), changed.end(), idx) != changed.end();
+			if (!std::equal(a->begin(), a->end(), b->begin(), [&](const std::uint8_t x, const std::uint8_t y) {
+				return x == ((flipped) ? std::uint8_t(~y) : y);
+			})) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	/* Saving a capture untouched gives back exactly the same capture */
+	auto copy = out / in.filename();
+	copy += ".saved"sv;
+	if (!reference.save(copy, capture_compression_t::Uncompressed) || !check(copy, {})) {
+		return 1;
+	}
+	if (reference.compression_type() == capture_compression_t::Uncompressed && read_file(copy) != read_file(in)) {
+		return 1;
+	}
+
+	/* Change some packets and save over the capture in its own compression */
+	auto editable = out / in.filename();
+	editable += ".edit"sv;
+	fs::copy_file(in, editable, fs::copy_options::overwrite_existing);
+	std::vector<std::size_t> changed{};
+	{
+		libnokogiri::pcap::pcap_t capture{editable, capture_compression_t::Autodetect, false};
+		if (!capture.valid()) {
+			return 1;
+		}
+
+		for (std::size_t idx{}; idx < capture.packet_count(); idx += 1U + (capture.packet_count() / 7U)) {
+			auto packet = capture.get_packet(idx);
+			if (!packet) {
+				return 1;
+			}
+			for (auto& byte : packet->get()) {
+				byte = std::uint8_t(~byte);
+			}
+			changed.push_back(idx);
+		}
+
+		if (!capture.save()) {
+			return 1;
+		}
+		/* The capture carries on reading what it was opened from */
+		for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+			if (!capture.read_packet(idx)) {
+				return 1;
+			}
+		}
+	}
+	if (!check(editable, changed)) {
+		return 1;
+	}
+
+	/* With a cache far too small to hold them, every change still has to be saved, and the capture keeps its permissions */
+	auto squeezed = out / in.filename();
+	squeezed += ".squeezed"sv;
+	fs::copy_file(in, squeezed, fs::copy_options::overwrite_existing);
+	constexpr auto perms = fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read;
+	fs::permissions(squeezed, perms);
+	std::vector<std::size_t> every(reference.packet_count());
+	std::iota(every.begin(), every.end(), std::size_t{});
+	{
+		libnokogiri::pcap::pcap_t capture{squeezed, capture_compression_t::Autodetect, false};
+		if (!capture.valid()) {
+			return 1;
+		}
+
+		capture.cache_budget(4096U);
+		for (const auto idx : every) {
+			auto packet = capture.get_packet(idx);
+			if (!packet) {
+				return 1;
+			}
+			for (auto& byte : packet->get()) {
+				byte = std::uint8_t(~byte);
+			}
+		}
+
+		/* Changed packets outlive the cache too */
+		capture.clear_cache();
+		auto packet = capture.get_packet(0U);
+		auto original = reference.read_packet(0U);
+		if (!packet || !original || packet->get().length() != original->length() ||
+			(original->length() != 0U && *packet->get().begin() != std::uint8_t(~*original->begin()))) {
+			return 1;
+		}
+
+		if (!capture.save()) {
+			return 1;
+		}
+	}
+	if (!check(squeezed, every) || fs::status(squeezed).permissions() != perms) {
+		return 1;
+	}
+	fs::remove(squeezed);
+
+	/* And that it comes back out of every compression */
+	for (const auto compression : {capture_compression_t::Compressed, capture_compression_t::ZStandard, capture_compression_t::LZ4}) {
+		libnokogiri::pcap::pcap_t capture{editable, capture_compression_t::Autodetect, true};
+		auto compressed = out / in.filename();
+		compressed += ".compressed"sv;
+		if (!capture.valid() || !capture.save(compressed, compression)) {
+			/* Not built with support for this one */
+			if (libnokogiri::internal::compressor_t{compression}.valid()) {
+				return 1;
+			}
+			continue;
+		}
+
+		libnokogiri::pcap::pcap_t lazy{compressed, capture_compression_t::Autodetect, true, false, false, false, true};
+		if (!lazy.valid() || !lazy.lazily_decompressed() || !check(compressed, changed)) {
+			return 1;
+		}
+		fs::remove(compressed);
+	}
+
+	fs::remove(copy);
+	fs::remove(editable);
+	return {};
+}
+
+int append(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	libnokogiri::pcap::pcap_t reference{in, capture_compression_t::Autodetect, true};
+	if (!reference.valid()) {
+		return 1;
+	}
+
+	auto file = out / in.filename();
+	file += ".recorded"sv;
+
+	/* Small buffers so every policy gets a workout */
+	libnokogiri::pcap::writer_options_t options{};
+	options.buffer_size = 64U * 1024U;
+	options.buffer_count = 3U;
+	options.flush_bytes = 16U * 1024U;
+	options.sync_bytes = 256U * 1024U;
+	options.preallocate = 1024U * 1024U;
+	{
+		libnokogiri::pcap::writer_t writer{file, reference.header(), options};
+		if (!writer.valid()) {
+			return 1;
+		}
+
+		const auto half = reference.packet_count() / 2U;
+		for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+			auto packet = reference.read_packet(idx);
+			if (!packet) {
+				return 1;
+			}
+
+			/* Half through the raw interface and half through whole packets */
+			bool written{};
+			if (idx < half && reference.header().variant() != libnokogiri::pcap::pcap_variant_t::Modified) {
+				const auto& header = std::get<libnokogiri::pcap::packet_header_t>(packet->header());
+				written = writer.write(header.timestamp(), header.useconds(), packet->begin(), header.captured_len(), header.actual_len());
+			} else {
+				written = writer.write(*packet);
+			}
+			if (!written) {
+				return 1;
+			}
+
+			/* Once flushed everything so far has to be in the file */
+			if (idx == half) {
+				if (!writer.flush() || fs::file_size(file) != writer.bytes_written()) {
+					return 1;
+				}
+			}
+		}
+
+		if (writer.packets_written() != reference.packet_count() || !writer.close()) {
+			return 1;
+		}
+	}
+
+	/* Nothing reserved past the end shows up as part of the capture */
+	libnokogiri::pcap::pcap_t recorded{file, capture_compression_t::Autodetect, true};
+	if (!recorded.valid() || recorded.packet_count() != reference.packet_count()) {
+		return 1;
+	}
+	for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+		auto a = recorded.read_packet(idx);
+		auto b = reference.read_packet(idx);
+		if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+			return 1;
+		}
+	}
+
+	/* A writer that goes quiet still gets its buffer out once it's old enough, without writing anything else */
+	options = {};
+	options.flush_interval = std::chrono::milliseconds{5};
+	{
+		libnokogiri::pcap::writer_t writer{file, reference.header(), options};
+		const std::array<std::uint8_t, 4> data{{1U, 2U, 3U, 4U}};
+		if (!writer.write(0U, 0U, data.data(), data.size(), data.size())) {
+			return 1;
+		}
+
+		bool landed{};
+		for (std::size_t tries{}; tries < 1000U && !landed; ++tries) {
+			landed = fs::file_size(file) == writer.bytes_written();
+			std::this_thread::sleep_for(std::chrono::milliseconds{1});
+		}
+		if (!landed || !writer.close()) {
+			return 1;
+		}
+	}
+
+	/* A compressed recording is seekable, so it reads back lazily */
+	options = {};
+	options.buffer_size = 64U * 1024U;
+	for (const auto compression : {capture_compression_t::Compressed, capture_compression_t::ZStandard, capture_compression_t::LZ4}) {
+		options.compression = compression;
+		{
+			libnokogiri::pcap::writer_t writer{file, reference.header(), options};
+			/* Not built with support for this one */
+			if (!writer.valid() && compression != capture_compression_t::Compressed) {
+				continue;
+			}
+			for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+				auto packet = reference.read_packet(idx);
+				if (!packet || !writer.write(*packet)) {
+					return 1;
+				}
+			}
+			if (!writer.close()) {
+				return 1;
+			}
+		}
+
+		libnokogiri::pcap::pcap_t compressed{file, capture_compression_t::Autodetect, true, false, false, false, true};
+		if (!compressed.valid() || !compressed.lazily_decompressed() || compressed.compression_type() != compression ||
+			compressed.packet_count() != reference.packet_count()) {
+			return 1;
+		}
+		for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+			auto a = compressed.read_packet(idx);
+			auto b = reference.read_packet(idx);
+			if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+				return 1;
+			}
+		}
+	}
+
+	fs::remove(file);
+	return {};
+}
+
+int rotate(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	libnokogiri::pcap::pcap_t reference{in, capture_compression_t::Autodetect, true};
+	if (!reference.valid() || reference.packet_count() == 0U) {
+		return 1;
+	}
+
+	std::uint64_t total{};
+	std::uint32_t first{UINT32_MAX};
+	std::uint32_t last{};
+	for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+		auto packet = reference.read_packet(idx);
+		if (!packet) {
+			return 1;
+		}
+		total += packet->length();
+		first = std::min(first, packet_seconds(*packet));
+		last = std::max(last, packet_seconds(*packet));
+	}
+
+	/* Other tests share the output directory, so only our own hidden files are looked for */
+	const auto left_behind = [&](const std::string& name) {
+		const auto prefix = '.' + name;
+		for (const auto& entry : fs::directory_iterator{out}) {
+			const auto file_name = entry.path().filename().string();
+			if (file_name.compare(0U, prefix.size(), prefix) == 0 && entry.path().extension() == ".part") {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	/* Splits the capture up, checks each file keeps to the limits, and that together they're the whole capture */
+	const auto check = [&](const std::string& name, const libnokogiri::pcap::rotation_options_t& rotation) -> bool {
+		libnokogiri::pcap::writer_options_t options{};
+		options.buffer_size = 16U * 1024U;
+		options.preallocate = 64U * 1024U;
+
+		std::vector<fs::path> files{};
+		{
+			libnokogiri::pcap::rotating_writer_t writer{(out / name).string(), reference.header(), rotation, options};
+			if (!writer.valid()) {
+				return false;
+			}
+			for (std::size_t idx{}; idx < reference.packet_count(); ++idx) {
+				auto packet = reference.read_packet(idx);
+				if (!packet || !writer.write(*packet)) {
+					return false;
+				}
+			}
+			if (!writer.close()) {
+				return false;
+			}
+			files = writer.files();
+		}
+
+		std::size_t idx{};
+		for (auto& file : files) {
+			const auto file_name = file.filename().string();
+			if (file_name.find("{index}") != std::string::npos || file_name.find('%') != std::string::npos) {
+				return false;
+			}
+
+			const auto size = fs::file_size(file);
+			libnokogiri::pcap::pcap_t part{file, capture_compression_t::Autodetect, true};
+			if (!part.valid() || part.packet_count() == 0U) {
+				return false;
+			}
+			if (rotation.max_packets != 0U && part.packet_count() > rotation.max_packets) {
+				return false;
+			}
+			if (rotation.max_bytes != 0U && part.packet_count() > 1U && size > rotation.max_bytes) {
+				return false;
+			}
+
+			std::uint32_t part_first{};
+			for (std::size_t pkt{}; pkt < part.packet_count(); ++pkt, ++idx) {
+				auto a = part.read_packet(pkt);
+				auto b = reference.read_packet(idx);
+				if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+					return false;
+				}
+				if (pkt == 0U) {
+					part_first = packet_seconds(*a);
+				} else if (rotation.max_seconds != 0U && packet_seconds(*a) >= part_first && packet_seconds(*a) - part_first >= rotation.max_seconds) {
+					return false;
+				}
+			}
+			fs::remove(file);
+		}
+
+		/* Nothing is left behind under a temporary name */
+		return !left_behind(name) && idx == reference.packet_count();
+	};
+
+	const auto base = in.filename().string();
+	libnokogiri::pcap::rotation_options_t rotation{};
+	rotation.max_packets = reference.packet_count() / 5U + 1U;
+	if (!check(base + ".{index}.rotated", rotation)) {
+		return 1;
+	}
+
+	rotation = {};
+	rotation.max_bytes = libnokogiri::pcap::file_header_length + total / 4U + 64U;
+	if (!check(base + ".rotated", rotation)) {
+		return 1;
+	}
+
+	/* Many files can start in the same second, so rotating by count always numbers them */
+	rotation = {};
+	rotation.max_packets = reference.packet_count() / 5U + 1U;
+	if (!check(base + ".%Y%m%d.rotated", rotation)) {
+		return 1;
+	}
+
+	if (last > first) {
+		rotation = {};
+		rotation.max_seconds = std::max<std::uint32_t>((last - first) / 3U, 1U);
+		if (!check(base + ".%Y%m%d-%H%M%S.{index}.rotated", rotation)) {
+			return 1;
+		}
+
+		/* A second file by the same name fails rather than replace the first */
+		const auto name = base + ".%Y.clash";
+		rotation = {};
+		rotation.max_seconds = 1U;
+		bool written{true};
+		std::vector<fs::path> files{};
+		{
+			libnokogiri::pcap::rotating_writer_t writer{(out / name).string(), reference.header(), rotation};
+			for (std::size_t idx{}; written && idx < reference.packet_count(); ++idx) {
+				auto packet = reference.read_packet(idx);
+				written = packet && writer.write(*packet);
+			}
+			written = writer.close() && written;
+			files = writer.files();
+		}
+		if (written || files.empty() || !left_behind(name)) {
+			return 1;
+		}
+		for (const auto& file : files) {
+			fs::remove(file);
+		}
+		std::vector<fs::path> hidden{};
+		for (const auto& entry : fs::directory_iterator{out}) {
+			if (entry.path().filename().string().compare(0U, name.size() + 1U, '.' + name) == 0) {
+				hidden.push_back(entry.path());
+			}
+		}
+		for (const auto& file : hidden) {
+			fs::remove(file);
+		}
+	}
+
+	return {};
+}
+
+int prune(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	libnokogiri::pcap::pcap_t reference{in, capture_compression_t::Autodetect, true};
+	if (!reference.valid()) {
+		return 1;
+	}
+	const auto total = reference.packet_count();
+
+	/* Every packet in `capture` has to be the reference packet in `kept` at the same position */
+	const auto check = [&](const libnokogiri::pcap::pcap_t& capture, const std::vector<std::size_t>& kept) {
+		if (capture.packet_count() != kept.size()) {
+			return false;
+		}
+
+		std::size_t pos{};
+		for (const auto& packet : capture) {
+			auto ref = reference.read_packet(kept[pos++]);
+			if (!packet || !ref || packet->length() != ref->length() || !std::equal(packet->begin(), packet->end(), ref->begin())) {
+				return false;
+			}
+		}
+		return pos == kept.size();
+	};
+
+	for (const bool prefetch : {false, true}) {
+		libnokogiri::pcap::pcap_t capture{in, capture_compression_t::Autodetect, true, prefetch};
+		if (!capture.valid()) {
+			return 1;
+		}
+
+		/* Scattered packets, a run in the middle, and the first and last */
+		std::vector<std::size_t> kept{};
+		for (std::size_t idx{}; idx < total; ++idx) {
+			const bool remove = idx % 3U == 1U || (idx >= total / 2U && idx < total / 2U + 4U) || idx == 0U || idx + 1U == total;
+			if (remove && !capture.remove_packet(idx)) {
+				return 1;
+			} else if (!remove) {
+				kept.push_back(idx);
+			}
+		}
+
+		/* Removing is only ever done once, and removed packets are gone */
+		if (total != 0U && (capture.remove_packet(0U) || capture.read_packet(0U) || capture.get_packet(0U))) {
+			return 1;
+		}
+		if (capture.remove_packet(total) || capture.index_size() != total || !check(capture, kept)) {
+			return 1;
+		}
+		/* The iterators are still random access over what is left, going by position rather than index */
+		const auto& const_capture = capture;
+		if (std::size_t(const_capture.end() - const_capture.begin()) != kept.size() || kept.empty()) {
+			return 1;
+		}
+		for (const std::size_t pos : {std::size_t{}, kept.size() / 2U, kept.size() - 1U}) {
+			const auto it = const_capture.begin() + std::ptrdiff_t(pos);
+			auto live = capture.begin();
+			live += std::ptrdiff_t(pos);
+			const auto back = const_capture.end() - std::ptrdiff_t(kept.size() - pos);
+			if (it.index() != kept[pos] || live.index() != kept[pos] || back.index() != kept[pos] || !const_capture.begin()[std::ptrdiff_t(pos)] ||
+				!*live || (*live)->get().length() != reference.read_packet(kept[pos])->length()) {
+				return 1;
+			}
+		}
+		/* Going by index still has every packet, with nothing for the removed ones */
+		const auto indexed = const_capture.indexed_packets();
+		if (std::size_t(indexed.end() - indexed.begin()) != total ||
+			std::size_t(std::count_if(indexed.begin(), indexed.end(), [](const auto& packet) { return bool(packet); })) != kept.size()) {
+			return 1;
+		}
+
+		/* Reading in batches skips over them too */
+		std::vector<std::uint8_t> buffer(64U * 1024U);
+		std::vector<libnokogiri::pcap::packet_descriptor_t> descriptors(16U);
+		std::size_t next{};
+		std::size_t pos{};
+		while (pos < kept.size()) {
+			const auto count = capture.read_batch(next, descriptors.size(), buffer.data(), buffer.size(), descriptors.data(), &next);
+			if (count == 0U) {
+				return 1;
+			}
+			for (std::size_t pkt{}; pkt < count; ++pkt, ++pos) {
+				auto ref = reference.read_packet(kept[pos]);
+				if (!ref || descriptors[pkt].captured_len() != ref->length() ||
+					!std::equal(ref->begin(), ref->end(), buffer.begin() + std::ptrdiff_t(descriptors[pkt].offset()))) {
+					return 1;
+				}
+			}
+		}
+		if (next != total) {
+			return 1;
+		}
+
+		/* As does searching by time */
+		for (const auto idx : capture.range_by_time(0U, UINT64_MAX)) {
+			if (capture.packet_removed(idx)) {
+				return 1;
+			}
+		}
+
+		/* Only the packets that are left are saved, in every compression */
+		auto pruned = out / in.filename();
+		pruned += ".pruned"sv;
+		for (const auto compression : {capture_compression_t::Uncompressed, capture_compression_t::Compressed,
+			capture_compression_t::ZStandard, capture_compression_t::LZ4}) {
+			if (!capture.save(pruned, compression)) {
+				if (libnokogiri::internal::compressor_t{compression}.valid()) {
+					return 1;
+				}
+				continue;
+			}
+
+			libnokogiri::pcap::pcap_t saved{pruned, capture_compression_t::Autodetect, true};
+			if (!saved.valid() || saved.index_size() != kept.size()) {
+				return 1;
+			}
+			if (!check(saved, kept)) {
+				return 1;
+			}
+		}
+		fs::remove(pruned);
+	}
+
+	return {};
+}
+
+int extract(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	libnokogiri::pcap::pcap_t capture{in, capture_compression_t::Autodetect, true};
+	if (!capture.valid()) {
+		return 1;
+	}
+	const auto total = capture.packet_count();
+
+	/* The extracted capture has to be exactly the packets in `kept` */
+	const auto check = [&](fs::path file, const std::vector<std::size_t>& kept) {
+		libnokogiri::pcap::pcap_t slice{file, capture_compression_t::Autodetect, true};
+		if (!slice.valid() || slice.packet_count() != kept.size() || slice.header().link_type() != capture.header().link_type()) {
+			return false;
+		}
+		for (std::size_t idx{}; idx < kept.size(); ++idx) {
+			auto a = slice.read_packet(idx);
+			auto b = capture.read_packet(kept[idx]);
+			if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	auto slice = out / in.filename();
+	slice += ".slice"sv;
+
+	/* The middle third, which for an uncompressed capture is the header and then that part of the file as is */
+	const auto first = total / 3U;
+	const auto last = total - total / 3U;
+	std::vector<std::size_t> kept(last - first);
+	std::iota(kept.begin(), kept.end(), first);
+	if (!capture.extract(slice, first, last, capture_compression_t::Uncompressed) || !check(slice, kept)) {
+		return 1;
+	}
+	if (capture.compression_type() == capture_compression_t::Uncompressed) {
+		const auto record_len = libnokogiri::pcap::packet_header_length(capture.header().variant());
+		std::size_t start{libnokogiri::pcap::file_header_length};
+		std::size_t end{};
+		for (std::size_t idx{}; idx < last; ++idx) {
+			const auto len = record_len + capture.read_packet(idx)->length();
+			start += (idx < first) ? len : 0U;
+			end += (idx < first) ? 0U : len;
+		}
+
+		const auto original = read_file(in);
+		auto expected = std::vector<std::uint8_t>(original.begin(), original.begin() + std::ptrdiff_t(libnokogiri::pcap::file_header_length));
+		expected.insert(expected.end(), original.begin() + std::ptrdiff_t(start), original.begin() + std::ptrdiff_t(start + end));
+		if (read_file(slice) != expected) {
+			return 1;
+		}
+	}
+
+	/* Past the end is clamped, and an empty range is just the header */
+	if (!capture.extract(slice, total, total + 10U, capture_compression_t::Uncompressed) || !check(slice, {}) ||
+		fs::file_size(slice) != libnokogiri::pcap::file_header_length) {
+		return 1;
+	}
+	if (capture.extract(slice, total + 1U, total, capture_compression_t::Uncompressed)) {
+		return 1;
+	}
+
+	/* Picked out by a predicate, which sees every packet in order */
+	kept.clear();
+	std::size_t expected{};
+	bool ordered{true};
+	const auto pick = [&](const std::size_t idx, const libnokogiri::pcap::packet_descriptor_t& desc) {
+		auto packet = capture.read_packet(idx);
+		ordered = ordered && idx == expected++ && packet && desc.captured_len() == packet->length();
+		/* Long runs and lone packets */
+		const bool keep = (idx / 4U) % 2U == 0U || idx % 7U == 3U;
+		if (keep) {
+			kept.push_back(idx);
+		}
+		return keep;
+	};
+	if (!capture.extract(slice, pick) || !ordered || expected != total || !check(slice, kept)) {
+		return 1;
+	}
+
+	/* Removed packets stay out of a slice */
+	if (total > 2U) {
+		if (!capture.remove_packet(1U)) {
+			return 1;
+		}
+		if (!capture.extract(slice, 0U, 3U, capture_compression_t::Uncompressed) || !check(slice, {0U, 2U})) {
+			return 1;
+		}
+	}
+
+	/* And slices can be compressed */
+	for (const auto compression : {capture_compression_t::Compressed, capture_compression_t::ZStandard, capture_compression_t::LZ4}) {
+		if (!capture.extract(slice, first, last, compression)) {
+			if (libnokogiri::internal::compressor_t{compression}.valid()) {
+				return 1;
+			}
+			continue;
+		}
+		kept.resize(last - first);
+		std::iota(kept.begin(), kept.end(), first);
+		kept.erase(std::remove(kept.begin(), kept.end(), 1U), kept.end());
+		if (!check(slice, kept)) {
+			return 1;
+		}
+	}
+
+	fs::remove(slice);
+	return {};
+}
+
+int merge(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	using libnokogiri::pcap::merge_result_t;
+	libnokogiri::pcap::pcap_t capture{in, capture_compression_t::Autodetect, true};
+	if (!capture.valid()) {
+		return 1;
+	}
+	const auto variant = capture.header().variant();
+
+	std::vector<std::uint64_t> timestamps(capture.packet_count());
+	std::vector<libnokogiri::pcap::packet_descriptor_t> descriptors(1U);
+	std::vector<std::uint8_t> buffer(capture.packet_count() == 0U ? 1U : 256U * 1024U);
+	for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+		if (capture.read_batch(idx, 1U, buffer.data(), buffer.size(), descriptors.data()) != 1U) {
+			return 1;
+		}
+		timestamps[idx] = descriptors[0].timestamp();
+	}
+
+	/* Split it into the even and odd packets, merging them back is then a plain two way merge */
+	auto evens = out / in.filename();
+	evens += ".evens"sv;
+	auto odds = out / in.filename();
+	odds += ".odds"sv;
+	if (!capture.extract(evens, [](const std::size_t idx, const auto&) { return idx % 2U == 0U; }, capture_compression_t::Uncompressed) ||
+		!capture.extract(odds, [](const std::size_t idx, const auto&) { return idx % 2U == 1U; }, capture_compression_t::LZ4)) {
+		if (libnokogiri::internal::compressor_t{capture_compression_t::LZ4}.valid() ||
+			!capture.extract(odds, [](const std::size_t idx, const auto&) { return idx % 2U == 1U; }, capture_compression_t::Uncompressed)) {
+			return 1;
+		}
+	}
+
+	std::vector<std::size_t> even_idx{};
+	std::vector<std::size_t> odd_idx{};
+	for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+		((idx % 2U == 0U) ? even_idx : odd_idx).push_back(idx);
+	}
+	std::vector<std::size_t> expected(capture.packet_count());
+	std::merge(even_idx.begin(), even_idx.end(), odd_idx.begin(), odd_idx.end(), expected.begin(),
+		[&](const std::size_t a, const std::size_t b) { return timestamps[a] < timestamps[b]; });
+
+	const auto check = [&](fs::path file) {
+		libnokogiri::pcap::pcap_t merged{file, capture_compression_t::Autodetect, true};
+		if (!merged.valid() || merged.packet_count() != expected.size() || merged.header().variant() != variant ||
+			merged.header().link_type() != capture.header().link_type()) {
+			return false;
+		}
+		for (std::size_t idx{}; idx < expected.size(); ++idx) {
+			auto a = merged.read_packet(idx);
+			auto b = capture.read_packet(expected[idx]);
+			if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin()) ||
+				merged.read_batch(idx, 1U, buffer.data(), buffer.size(), descriptors.data()) != 1U ||
+				descriptors[0].timestamp() != timestamps[expected[idx]]) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	/* Tiny read ahead so the batches run out all the time */
+	libnokogiri::pcap::merge_options_t options{};
+	options.read_ahead = 4096U;
+	auto merged = out / in.filename();
+	merged += ".merged"sv;
+	if (libnokogiri::pcap::merge(std::vector<fs::path>{evens, odds}, merged, options) != merge_result_t::Merged || !check(merged)) {
+		return 1;
+	}
+
+	{
+		libnokogiri::pcap::pcap_t even_capture{evens, capture_compression_t::Autodetect, true};
+		libnokogiri::pcap::pcap_t odd_capture{odds, capture_compression_t::Autodetect, true};
+		if (libnokogiri::pcap::merge({std::cref(even_capture), std::cref(odd_capture)}, merged, options) != merge_result_t::Merged ||
+			!check(merged)) {
+			return 1;
+		}
+	}
+
+	/* A capture with another link type is either refused or left out */
+	auto other = out / in.filename();
+	other += ".other"sv;
+	{
+		const auto link_type = (capture.header().link_type() == libnokogiri::link_type_t::User0) ?
+			libnokogiri::link_type_t::User1 : libnokogiri::link_type_t::User0;
+		libnokogiri::pcap::writer_t writer{other, {variant, {2U, 4U}, 0, 0U, 65535U, link_type}};
+		const std::array<std::uint8_t, 4> data{{1U, 2U, 3U, 4U}};
+		if (!writer.write(0U, 0U, data.data(), data.size(), data.size()) || !writer.close()) {
+			return 1;
+		}
+	}
+	if (libnokogiri::pcap::merge(std::vector<fs::path>{evens, other, odds}, merged, options) != merge_result_t::LinkTypeMismatch) {
+		return 1;
+	}
+	options.link_type_conflict = libnokogiri::pcap::link_type_conflict_t::Skip;
+	if (libnokogiri::pcap::merge(std::vector<fs::path>{evens, other, odds}, merged, options) != merge_result_t::Skipped || !check(merged)) {
+		return 1;
+	}
+
+	/* Mixing in a nanosecond capture makes the whole thing nanoseconds */
+	if (variant == libnokogiri::pcap::pcap_variant_t::Standard && !timestamps.empty()) {
+		{
+			libnokogiri::pcap::writer_t writer{other, {libnokogiri::pcap::pcap_variant_t::Nanosecond, {2U, 4U}, 0, 0U, 65535U,
+				capture.header().link_type()}};
+			const std::array<std::uint8_t, 4> data{{1U, 2U, 3U, 4U}};
+			if (!writer.write(std::uint32_t(timestamps[0] / 1000000000U), 1U, data.data(), data.size(), data.size()) || !writer.close()) {
+				return 1;
+			}
+		}
+
+		if (libnokogiri::pcap::merge(std::vector<fs::path>{in, other}, merged, options) != merge_result_t::Merged) {
+			return 1;
+		}
+		libnokogiri::pcap::pcap_t nanosecond{merged, capture_compression_t::Autodetect, true};
+		if (!nanosecond.valid() || nanosecond.header().variant() != libnokogiri::pcap::pcap_variant_t::Nanosecond ||
+			nanosecond.packet_count() != capture.packet_count() + 1U) {
+			return 1;
+		}
+		for (std::size_t idx{}, pos{}; idx < nanosecond.packet_count(); ++idx) {
+			if (nanosecond.read_batch(idx, 1U, buffer.data(), buffer.size(), descriptors.data()) != 1U) {
+				return 1;
+			}
+			if (descriptors[0].captured_len() == 4U && descriptors[0].timestamp() == (timestamps[0] / 1000000000U) * 1000000000U + 1U) {
+				continue;
+			}
+			if (pos >= timestamps.size() || descriptors[0].timestamp() != timestamps[pos++]) {
+				return 1;
+			}
+		}
+	}
+
+	if (libnokogiri::pcap::merge(std::vector<fs::path>{}, merged) != merge_result_t::NoInputs ||
+		libnokogiri::pcap::merge(std::vector<fs::path>{out / "does-not-exist.pcap"}, merged) != merge_result_t::BadInput) {
+		return 1;
+	}
+
+	fs::remove(evens);
+	fs::remove(odds);
+	fs::remove(other);
+	fs::remove(merged);
+	return {};
+}
+
+int sort(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	using libnokogiri::pcap::sort_result_t;
+	libnokogiri::pcap::pcap_t capture{in, capture_compression_t::Autodetect, true};
+	if (!capture.valid()) {
+		return 1;
+	}
+
+	std::vector<std::uint64_t> timestamps(capture.packet_count());
+	std::vector<libnokogiri::pcap::packet_descriptor_t> descriptors(1U);
+	std::vector<std::uint8_t> buffer(256U * 1024U);
+	for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+		if (capture.read_batch(idx, 1U, buffer.data(), buffer.size(), descriptors.data()) != 1U) {
+			return 1;
+		}
+		timestamps[idx] = descriptors[0].timestamp();
+	}
+
+	/* Shuffle it a little, each block of 5 backwards, and a lot, every 11th packet moved to the end */
+	std::vector<std::size_t> shuffled{};
+	std::vector<std::size_t> late{};
+	for (std::size_t first{}; first < capture.packet_count(); first += 5U) {
+		const auto last = std::min<std::size_t>(first + 5U, capture.packet_count());
+		for (auto idx = last; idx-- > first;) {
+			((idx % 11U == 10U) ? late : shuffled).push_back(idx);
+		}
+	}
+	shuffled.insert(shuffled.end(), late.begin(), late.end());
+
+	auto unsorted = out / in.filename();
+	unsorted += ".unsorted"sv;
+	{
+		libnokogiri::pcap::writer_t writer{unsorted, capture.header()};
+		for (const auto idx : shuffled) {
+			auto packet = capture.read_packet(idx);
+			if (!packet || !writer.write(*packet)) {
+				return 1;
+			}
+		}
+		if (!writer.close()) {
+			return 1;
+		}
+	}
+
+	auto expected{shuffled};
+	std::stable_sort(expected.begin(), expected.end(), [&](const std::size_t a, const std::size_t b) {
+		return timestamps[a] < timestamps[b];
+	});
+
+	auto sorted = out / in.filename();
+	sorted += ".sorted"sv;
+	const auto check = [&](const libnokogiri::pcap::sort_options_t& options) {
+		if (libnokogiri::pcap::sort_capture(unsorted, sorted, options) != sort_result_t::Sorted) {
+			return false;
+		}
+
+		libnokogiri::pcap::pcap_t result{sorted, capture_compression_t::Autodetect, true};
+		if (!result.valid() || result.packet_count() != expected.size() || result.header().link_type() != capture.header().link_type() ||
+			result.header().variant() != capture.header().variant()) {
+			return false;
+		}
+		for (std::size_t idx{}; idx < expected.size(); ++idx) {
+			auto a = result.read_packet(idx);
+			auto b = capture.read_packet(expected[idx]);
+			if (!a || !b || a->length() != b->length() || !std::equal(a->begin(), a->end(), b->begin())) {
+				return false;
+			}
+		}
+
+		/* Every run is cleaned up, other tests share the output directory so only our own runs are looked for */
+		const auto runs = '.' + sorted.filename().string() + ".run.";
+		for (const auto& entry : fs::directory_iterator{out}) {
+			if (entry.path().filename().string().compare(0U, runs.size(), runs) == 0) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	/* Everything fits in the window, so it's all the one run */
+	libnokogiri::pcap::sort_options_t options{};
+	if (!check(options)) {
+		return 1;
+	}
+
+	/* A window of a few packets spills lots of runs, which with a fan in of 2 take several passes to merge */
+	options.reorder_window = 2048U;
+	options.merge_fan_in = 2U;
+	options.read_ahead = 4096U;
+	options.temp_directory = out;
+	if (!check(options)) {
+		return 1;
+	}
+
+	if (libnokogiri::pcap::sort_capture(out / "does-not-exist.pcap", sorted) != sort_result_t::BadInput) {
+		return 1;
+	}
+
+	fs::remove(unsorted);
+	fs::remove(sorted);
+	return {};
+}
+
+int split(fs::path in, fs::path out) {
+	if (!fs::exists(in) || !fs::is_regular_file(in) || !fs::is_directory(out)) {
+		return 1;
+	}
+
+	using libnokogiri::capture_compression_t;
+	using libnokogiri::pcap::split_by_t;
+	using libnokogiri::pcap::split_result_t;
+	libnokogiri::pcap::pcap_t capture{in, capture_compression_t::Autodetect, true};
+	if (!capture.valid()) {
+		return 1;
+	}
+
+	/* Write a modified copy of the capture with the packets spread over 3 interfaces, so there's something to split by interface */
+	auto modified = out / in.filename();
+	modified += ".modified"sv;
+	std::uint32_t first_seconds{};
+	{
+		const libnokogiri::pcap::file_header_t header{libnokogiri::pcap::pcap_variant_t::Modified, libnokogiri::version_t{2U, 4U},
+			0, 0U, capture.header().max_packet_length(), capture.header().link_type()};
+		libnokogiri::pcap::writer_t writer{modified, header};
+		for (std::size_t idx{}; idx < capture.packet_count(); ++idx) {
+			auto packet = capture.read_packet(idx);
+			if (!packet) {
+				return 1;
+			}
+			if (idx == 0U) {
+				first_seconds = packet_seconds(*packet);
+			}
+			const auto len = std::uint32_t(packet->length());
+			const libnokogiri::pcap::packet_t copy{
+				libnokogiri::pcap::packet_header_modified_t{
+					libnokogiri::pcap::packet_header_t{packet_seconds(*packet), 0U, len, len}, std::uint32_t(idx % 3U), 0U, 0U
+				}, packet->begin(), len
+			};
+			if (!writer.write(copy)) {
+				return 1;
+			}
+		}
+		if (!writer.close()) {
+			return 1;
+		}
+	}
+
+	/* Splits the capture, then checks each file has exactly the packets with its key, in the order they were in */
+	const auto check = [&](const fs::path& input, const libnokogiri::pcap::split_options_t& options,
+		const std::function<std::uint64_t(std::size_t, const libnokogiri::pcap::packet_t&)>& key_of) -> bool {
+		const auto name = (out / in.filename()).string() + ".split.{index}";
+		std::vector<fs::path> files{};
+		const auto result = libnokogiri::pcap::split_capture(input, name, options, &files);
+		bool ok = result == split_result_t::Split;
+
+		std::size_t total{};
+		for (auto& file : files) {
+			const auto suffix = file.string().substr(file.string().rfind('.') + 1U);
+			const auto key = std::stoull(suffix);
+			libnokogiri::pcap::pcap_t part{file, capture_compression_t::Autodetect, true};
+			ok = ok && part.valid() && part.header().link_type() == capture.header().link_type();
+			if (options.by == split_by_t::Packets) {
+				ok = ok && part.packet_count() <= options.every;
+			}
+
+			std::size_t pos{};
+			for (std::size_t idx{}; ok && idx < capture.packet_count(); ++idx) {
+				auto expected = capture.read_packet(idx);
+				if (!expected || key_of(idx, *expected) != key) {
+					ok = ok && expected;
+					continue;
+				}
+				auto actual = part.read_packet(pos++);
+				ok = actual && actual->length() == expected->length() && std::equal(actual->begin(), actual->end(), expected->begin());
+			}
+			ok = ok && pos == part.packet_count();
+			total += part.packet_count();
+			fs::remove(file);
+		}
+		return ok && total == capture.packet_count();
+	};
+
+	libnokogiri::pcap::split_options_t options{};
+	options.writer.buffer_size = 16U * 1024U;
+	options.writer.buffer_count = 2U;
+	options.by = split_by_t::Packets;
+	options.every = 7U;
+	if (!check(in, options, [](const std::size_t idx, const libnokogiri::pcap::packet_t&) { return idx / 7U; })) {
+		return 1;
+	}
+
+	/* With only the one file open at a time, any packet that's out of order has to reopen an earlier file */
+	options.by = split_by_t::Seconds;
+	options.every = 2U;
+	options.max_open_files = 1U;
+	const auto window = [&](const std::size_t, const libnokogiri::pcap::packet_t& packet) -> std::uint64_t {
+		const auto time = packet_seconds(packet);
+		return (time > first_seconds) ? (time - first_seconds) / 2U : 0U;
+	};
+	if (!check(in, options, window)) {
+		return 1;
+	}
+	options.max_open_files = 16U;
+	if (!check(in, options, window)) {
+		return 1;
+	}
+
+	/* Round robin over 3 interfaces with room for 2 means every file is closed and reopened over and over */
+	options.by = split_by_t::Interface;
+	options.max_open_files = 2U;
+	if (libnokogiri::pcap::split_capture(in, (out / "unused.{index}").string(), options) != split_result_t::NotModified ||
+		!check(modified, options, [](const std::size_t idx, const libnokogiri::pcap::packet_t&) { return idx % 3U; })) {
+		return 1;
+	}
+
+	if (libnokogiri::pcap::split_capture(out / "does-not-exist.pcap", (out / "unused.{index}").string(), options) != split_result_t::BadInput) {
+		return 1;
+	}
+
+	/* Without `{index}` every block of packets gets the same name, which stops the split rather than write over the first */
+	if (capture.packet_count() > 7U) {
+		options = {};
+		options.by = split_by_t::Packets;
+		options.every = 7U;
+		std::vector<fs::path> files{};
+		if (libnokogiri::pcap::split_capture(in, (out / in.filename()).string() + ".clash.%Y", options, &files) !=
+			split_result_t::DuplicateName || files.size() != 1U) {
+			return 1;
+		}
+		libnokogiri::pcap::pcap_t part{files.front(), capture_compression_t::Autodetect, true};
+		if (!part.valid() || part.packet_count() != 7U) {
+			return 1;
+		}
+		fs::remove(files.front());
+	}
+
+	fs::remove(modified);
 	return {};
 }